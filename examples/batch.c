@@ -0,0 +1,47 @@
+/*******************************************************************************
+ * gcc -L../src/.libs -lxml2 -lcurl -lcas batch.c -o batch
+ *******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "../src/cas.h"
+
+int
+main( int argc, char** argv ) {
+	int i;
+	int n=argc-1;
+	CAS* cas[argc];
+
+	//-- Init libcas, EXACTLY once per process, before threading
+	cas_init();
+
+	//-- Obtain a batch, and one CAS handle per concurrent validation
+	CAS_BATCH* batch=cas_batch_new();
+
+	//-- Queue one CAS2 validation per service ticket on the command line
+	//--   cas_batch_add(Batch, CAS Handle, Protocol, Validation URL, Escaped Service, Service Ticket, Renew Flag);
+	for( i=0; i<n; i++ ) {
+		cas[i]=cas_new();
+		cas_batch_add( batch,cas[i],CAS_PROTOCOL_CAS2,"http://localhost:12345/cas/serviceValidate","http%3a%2f%2flocalhost%2f",argv[i+1], 0);
+	}
+
+	//-- Run every queued validation at once, on this thread
+	cas_validate_batch( batch );
+
+	//-- Check each handle, act appropriately
+	for( i=0; i<n; i++ ) {
+		CAS_CODE code=cas_get_code( cas[i] );
+		if( code==CAS_VALIDATION_SUCCESS ) {
+			fprintf( stdout,"%s: %s\n",argv[i+1],cas_get_principal( cas[i] ) );
+		} else {
+			fprintf( stderr,"%s: (%d) %s: %s\n",argv[i+1],code,cas_code_str( code ),cas_get_message( cas[i] ) );
+		}
+		cas_zap( cas[i] );
+	}
+
+	//-- Destroy batch and libcas session
+	cas_batch_zap( batch );
+	cas_destroy();
+
+	return( 0 );
+}
@@ -0,0 +1,84 @@
+/*******************************************************************************
+ * gcc -L../src/.libs -lxml2 -lcurl -lcas epoll.c -o epoll
+ *******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include "../src/cas.h"
+
+static int epfd;
+static long timeout=-1;
+
+//-- libcas tells us which sockets to watch
+static int
+socket_callback( int fd, int what, void* userp ) {
+	struct epoll_event ev={0};
+	ev.data.fd=fd;
+	ev.events=( (what&CAS_POLL_IN) ? EPOLLIN : 0 )|( (what&CAS_POLL_OUT) ? EPOLLOUT : 0 );
+
+	if( what==CAS_POLL_REMOVE ) {
+		epoll_ctl( epfd,EPOLL_CTL_DEL,fd,NULL );
+	} else if( epoll_ctl( epfd,EPOLL_CTL_MOD,fd,&ev )!=0 ) {
+		epoll_ctl( epfd,EPOLL_CTL_ADD,fd,&ev );
+	}
+	return( 0 );
+}
+
+//-- ...and how long we may wait before telling it that time has passed
+static void
+timer_callback( long timeout_ms, void* userp ) {
+	timeout=timeout_ms;
+}
+
+//-- Each validation reports back here
+static void
+done_callback( CAS* cas, CAS_CODE code, char* principal, void* userp ) {
+	if( code==CAS_VALIDATION_SUCCESS ) {
+		fprintf( stdout,"%s: %s\n",(char*)userp,principal );
+	} else {
+		fprintf( stderr,"%s: (%d) %s: %s\n",(char*)userp,code,cas_code_str( code ),cas_get_message( cas ) );
+	}
+}
+
+int
+main( int argc, char** argv ) {
+	int i,n,running=0;
+	CAS* cas[argc];
+	struct epoll_event events[64];
+
+	//-- Init libcas, EXACTLY once per process, before threading
+	cas_init();
+
+	epfd=epoll_create1( 0 );
+	CAS_ASYNC* async=cas_async_new( socket_callback,timer_callback,NULL );
+
+	//-- Start one CAS2 validation per service ticket on the command line
+	for( i=1; i<argc; i++ ) {
+		cas[i]=cas_new();
+		if( cas_async_start( async,cas[i],CAS_PROTOCOL_CAS2,"http://localhost:12345/cas/serviceValidate","http%3a%2f%2flocalhost%2f",argv[i],0,done_callback,argv[i] )==CAS_VALIDATION_SUCCESS ) {
+			running++;
+		}
+	}
+
+	//-- The event loop
+	while( running>0 ) {
+		n=epoll_wait( epfd,events,64,timeout );
+		if( n==0 ) {
+			cas_async_socket_action( async,CAS_SOCKET_TIMEOUT,0,&running );
+		}
+		for( i=0; i<n; i++ ) {
+			int what=( (events[i].events&EPOLLIN) ? CAS_CSELECT_IN : 0 )|( (events[i].events&EPOLLOUT) ? CAS_CSELECT_OUT : 0 )|( (events[i].events&(EPOLLERR|EPOLLHUP)) ? CAS_CSELECT_ERR : 0 );
+			cas_async_socket_action( async,events[i].data.fd,what,&running );
+		}
+	}
+
+	//-- Teardown
+	for( i=1; i<argc; i++ ) {
+		cas_zap( cas[i] );
+	}
+	cas_async_zap( async );
+	cas_destroy();
+
+	return( 0 );
+}
@@ -1,3 +1,6 @@
+
+#include <stdio.h>
+#include <time.h>
 #include <curl/curl.h>
 #include <libxml/parser.h>
 
@@ -10,21 +13,331 @@
 #ifndef CAS_INT_H
 #define CAS_INT_H
 
+#define CAS_HEDGE_HISTORY 64
+#define CAS_HEDGE_MIN_SAMPLES 16
+
+//-- Allocator of libcas, libxml2 and libcurl, see casmem.c
+typedef struct {
+	cas_malloc_callback malloc_fn;
+	cas_free_callback free_fn;
+	cas_realloc_callback realloc_fn;
+	cas_calloc_callback calloc_fn;
+	cas_strdup_callback strdup_fn;
+} CAS_MEM;
+
+extern CAS_MEM cas_mem;
+extern int cas_mem_counting;
+
+#define cas_malloc( size ) cas_mem.malloc_fn( size )
+#define cas_free( ptr ) cas_mem.free_fn( ptr )
+#define cas_realloc( ptr,size ) cas_mem.realloc_fn( ptr,size )
+#define cas_calloc( nmemb,size ) cas_mem.calloc_fn( nmemb,size )
+#define cas_strdup( str ) cas_mem.strdup_fn( str )
+
+//-- Tracing, see castrace.c.  cas_debug() records an event while tracing is
+//--  on, and with -DDEBUG also prints it.
+extern int cas_tracing;
+
+void cas_trace( const char* function, int line, const char* format, ... ) __attribute__(( format( printf,3,4 ) ));
+int cas_trace_curl( CURL* curl, curl_infotype type, char* data, size_t size, void* userp );
+
+#undef cas_debug
+#ifdef DEBUG
+#define cas_debug(format, args...) do { \
+	fprintf(stderr,"\n**********\n[%s(%d):%s]:\n" format "\n**********\n", __FILE__,__LINE__,__func__,## args); \
+	if( __atomic_load_n( &cas_tracing,__ATOMIC_RELAXED ) ) cas_trace( __func__,__LINE__,format,## args ); \
+} while( 0 )
+#else
+#define cas_debug(format, args...) do { \
+	if( __builtin_expect( __atomic_load_n( &cas_tracing,__ATOMIC_RELAXED ),0 ) ) cas_trace( __func__,__LINE__,format,## args ); \
+} while( 0 )
+#endif
+
+typedef struct {
+	size_t size;
+	char* contents;
+	size_t capacity;				// - allocated size of contents, if kept for reuse
+} CAS_BUFFER;
+
+typedef struct {
+	unsigned int hash;
+	size_t name_size;				// - 0 for an empty slot
+	size_t name;					// - arena offset of the name
+	size_t first;					// - arena offsets of the first and last values
+	size_t last;
+	size_t values;					// - number of complete values
+} CAS_ATTRIBUTE_SLOT;
+
+typedef struct {
+	CAS_BUFFER arena;				// - names and values, see casattr.c
+	CAS_ATTRIBUTE_SLOT* slots;		// - open-addressing table, capacity a power of 2
+	size_t capacity;
+	size_t count;					// - attributes in slots
+	CAS_ATTRIBUTE_SLOT* open;		// - attribute of the value being read, if any
+	size_t value;					// - arena offset of the value being read
+} CAS_ATTRIBUTES;
+
+typedef struct {
+	enum {
+		CAS1_ENOMEM=-2,
+		CAS1_FAIL=-1,
+		CAS1_READ_ANSWER=0,
+		CAS1_READ_USER,
+		CAS1_YES,
+		CAS1_NO,
+	} state;
+	const char* answer;				// - "yes\n" or "no\n\n", once the first byte is read
+	size_t matched;					// - bytes of answer read
+	int user_read;					// - something followed "yes\n"
+} CAS_CAS1_STATE;
+
+typedef struct {
+	CAS* cas;
+	enum {
+		XML_FAIL=-1,
+		XML_NEED_START_DOC=0,
+		XML_NEED_OPEN_SERVICERESPONSE,
+		XML_NEED_OPEN_AUTHENTICATIONSUCCESS_AUTHENTICATIONFAILURE,
+		XML_NEED_OPEN_USER,
+		XML_READ_USER,
+		XML_NEED_CLOSE_USER,
+		XML_NEED_CLOSE_AUTHENTICATIONSUCCESS,
+		XML_NEED_OPEN_ATTRIBUTE,
+		XML_READ_ATTRIBUTE,
+		XML_READ_FAILUREMESSAGE,
+		XML_NEED_CLOSE_SERVICERESPONSE,
+		XML_NEED_END_DOC,
+		XML_COMPLETE,
+	} xml_state;
+	int depth;						// - elements open, of any namespace
+	int foreign_depth;				// - depth of the element of another namespace being skipped, 0 if none
+	int too_deep;					// - failed on the depth limit
+} CAS_XML_STATE;
+
+#define CAS_JSON_DEPTH_MAX 32
+
+typedef enum {
+	JSON_IN_ROOT=0,
+	JSON_IN_DOCUMENT,
+	JSON_IN_SERVICERESPONSE,
+	JSON_IN_SUCCESS,
+	JSON_IN_FAILURE,
+	JSON_IN_ATTRIBUTES,
+	JSON_IN_ATTRIBUTE,				// - array of values of one attribute
+	JSON_IN_OTHER,					// - anything skipped
+} CAS_JSON_CONTEXT;
+
+typedef struct {
+	enum {
+		JSON_FAIL=-1,
+		JSON_VALUE=0,				// - expecting a value, or ] of an empty array
+		JSON_KEY,					// - expecting a key, or } of an empty object
+		JSON_COLON,
+		JSON_NEXT,					// - expecting , or the end of the container
+		JSON_STRING,
+		JSON_ESCAPE,
+		JSON_UNICODE,
+		JSON_LITERAL,				// - true, false, null or a number
+		JSON_DONE,
+	} state;
+	int depth;
+	char container[CAS_JSON_DEPTH_MAX];			// - { or [ of each open container
+	CAS_JSON_CONTEXT context[CAS_JSON_DEPTH_MAX];
+	int empty;						// - nothing read yet in the innermost container
+	int in_key;						// - the string being read is a key
+	unsigned int unicode;			// - \u escape being read
+	int unicode_digits;
+	unsigned int surrogate;			// - high surrogate awaiting its low one
+	CAS_BUFFER token;				// - string or literal being read
+	CAS_BUFFER key;					// - last key read outside skipped containers
+	int outcome;					// - 1 authenticationSuccess, -1 authenticationFailure
+	int invalid;					// - well-formed, but not a valid response
+	CAS_CODE code;					// - authenticationFailure code
+} CAS_JSON_STATE;
+
 struct CAS {
 	CURL* curl;
+	unsigned int options_version;	// - bumped by every change to the options of curl
+	CAS_POOL* pool;					// - CAS_POOL the handle belongs to, if any
+	char* ssl_ca;					// - CA path or file given to curl, NULL for its default
+	int ssl_validate_server;		// - server certificate validation given to curl
 
 
 	CAS_CODE code;
-	union{
-		char* principal;
-		char* message;
-	};
-	//hashmap? attributes;
+	char* principal;				// - NULL, or the contents of principal_buffer
+	char* message;					// - NULL, or the contents of message_buffer
+	CAS_BUFFER principal_buffer;	// - results of the last validation, kept for reuse
+	CAS_BUFFER message_buffer;
+	CAS_ATTRIBUTES attributes;		// - CAS2 released attributes
 
+	//-- In-flight validation state.  Kept on the handle, rather than on the
+	//--  stack of the validate function, so that a CAS_BATCH can drive many
+	//--  handles at once from a single curl_multi.
+	CAS_PROTOCOL protocol;
+	CAS_BUFFER url;					// - validation URL, kept for reuse
+	CURLM* multi;					// - curl_multi cas->curl is attached to, if any
+	cas_done_callback done;			// - CAS_ASYNC completion callback
+	void* done_userp;
+	CAS_ASYNC* async;				// - CAS_ASYNC in-flight list cas is on, if any
+	CAS* async_next;
+	CAS* async_prev;
+	CAS_CAS1_STATE cas1;			// - CAS1 state machine
+	CAS_BUFFER buffer;				// - CAS2 response buffered for the fast path
+	CAS_XML_STATE xml;				// - CAS2 SAX state machine
+	xmlSAXHandler sax;				// - CAS2 SAX handler, set up once
+	xmlParserCtxtPtr xml_ctx;		// - CAS2 push parser, reset between validations
+	CAS_JSON_STATE json;			// - CAS3 JSON tokenizer
+	int cas2_fastpath;				// - CAS2 responses may bypass libxml2
+	int xml_streaming;				// - CAS2 response is being fed to xml_ctx, not buffered
+	int xml_error;					// - xmlParseChunk failed on a streamed chunk
+	size_t max_response_size;		// - 0 for no limit
+	int max_response_depth;			// - 0 for no limit
+	enum {
+		CAS_ABORT_NONE=0,
+		CAS_ABORT_LIMIT,			// - response exceeded a limit
+		CAS_ABORT_PARSED,			// - response already failed, or was complete before the transfer
+	} abort;						// - why a write callback stopped the transfer
 
+	//-- Singleflight, see casflight.c.  Set while the handle leads a
+	//--  validation other handles may wait on.
+	const char* flight_key;			// - validation URL
+	unsigned int flight_hash;
+	CAS* flight_next;				// - next flight in the same bucket
+	int flight_waiters;				// - handles waiting on this one
+	int flight_landed;				// - result is ready to be copied
+
+	long deadline_ms;				// - time allowed to each validation, 0 for none
+	double deadline_us;				// - cas_clock_us() deadline of the validation in flight, 0 for none
+
+	//-- Failover, see casendpoints.c
+	CAS_ENDPOINTS* endpoints;		// - shared endpoint set, if any
+	long attempt_timeout_ms;		// - time allowed to each attempt, 0 for none
+	CAS_BUFFER endpoint_url;		// - validation URL of the attempt in flight, kept for reuse
+	const char* endpoint_target;	// - validation URL as given, for the next attempt
+	unsigned int endpoint_tried;	// - bit mask of the endpoints tried so far
+	int endpoint_index;				// - endpoint of the attempt in flight, -1 for none
+	int admission_index;			// - endpoint the attempt in flight was admitted to, -1 for none
+	int shed;						// - the last attempt was not admitted
+
+	//-- Hedging, see cashedge.c
+	int hedge_percentile;			// - 0 for no hedging
+	CAS* hedge;						// - handle of the second request, kept for reuse
+	CURLM* hedge_multi;				// - runs both requests, keeps the connections of both
+	double hedge_history[CAS_HEDGE_HISTORY];	// - latencies of the last validations, in microseconds
+	int hedge_samples;
+	int hedge_next;					// - slot of hedge_history to overwrite next
+
+	//-- Local rejection, see casreject.c
+	int ticket_syntax;				// - check tickets against the fields below
+	char* ticket_prefixes;			// - comma-separated, NULL for any
+	unsigned char ticket_charset[32];	// - bitmap of the characters allowed after the prefix
+	int ticket_charset_set;
+	size_t ticket_min;
+	size_t ticket_max;				// - 0 for no limit
+	unsigned long long reject_key;	// - of the validation in flight, to remember it if rejected
+
+	CAS_STATS stats;
+	CAS_TIMINGS timings;			// - of the last validation
+
+};
+
+struct CAS_PREPARED {
+	CAS* cas;
+	CAS_PROTOCOL protocol;
+	CAS_BUFFER url;					// - rendered prefix, followed by the last ticket
+	size_t prefix;					// - length of the rendered prefix
 };
 
+/*******************************************************************************
+ * cas_clock_us: Monotonic clock for parse timings, in microseconds
+ */
+static inline double
+cas_clock_us() {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC,&ts );
+	return( ts.tv_sec*1e6+ts.tv_nsec/1e3 );
+}
+
+/*******************************************************************************
+ * cas_response_admit: Count a chunk of response body against the size limit,
+ *  returning 0 (flagging cas for abort) if it takes the response over
+ */
+static inline int
+cas_response_admit( CAS* cas, size_t size ) {
+	cas->timings.bytes_received+=size;
+	if( cas->max_response_size && cas->timings.bytes_received>cas->max_response_size ) {
+		cas_debug("Response over %lu bytes, aborting",(unsigned long)cas->max_response_size);
+		cas->abort=CAS_ABORT_LIMIT;
+		return( 0 );
+	}
+	return( 1 );
+}
+
+/*******************************************************************************
+ * Protocol start/finish pairs: start sets up cas->curl for a single
+ *  validation of a complete URL, finish interprets the transfer result once
+ *  cas->curl is done. cas_cas*_validate() is simply cas_start(), then
+ *  cas_perform(): curl_easy_perform() and finish, unless singleflight
+ *  hands it the result of an identical validation in flight.  A start may be
+ *  repeated, by cas_retry(), to fail over to another endpoint before finish.  A write
+ *  callback may stop the transfer early by returning 0 with cas->abort set,
+ *  which finish must check before taking CURLE_WRITE_ERROR as a failure.
+ */
+CAS_CODE cas_cas1_start( CAS* cas, const char* url );
+CAS_CODE cas_cas1_finish( CAS* cas, CURLcode status );
+CAS_CODE cas_cas2_start( CAS* cas, const char* url );
+CAS_CODE cas_cas2_finish( CAS* cas, CURLcode status );
+CAS_CODE cas_cas2_parse( CAS* cas, const char* body, size_t size );
+CAS_CODE cas_cas3_start( CAS* cas, const char* url );
+CAS_CODE cas_cas3_finish( CAS* cas, CURLcode status );
+void cas_cas3_reset( CAS* cas );
+void cas_cas3_json( CAS* cas, const char* chunk, size_t size );
+CAS_CODE cas_cas3_result( CAS* cas );
+
+void cas_attributes_clear( CAS_ATTRIBUTES* attributes );
+void cas_attributes_free( CAS_ATTRIBUTES* attributes );
+CAS_CODE cas_attributes_begin( CAS_ATTRIBUTES* attributes, const char* name );
+CAS_CODE cas_attributes_append( CAS_ATTRIBUTES* attributes, const char* chars, size_t size );
+CAS_CODE cas_attributes_end( CAS_ATTRIBUTES* attributes, const char* name );
+CAS_CODE cas_attributes_copy( CAS_ATTRIBUTES* to, const CAS_ATTRIBUTES* from );
+
+CAS_CODE cas_buffer_reserve( CAS_BUFFER* buffer, size_t capacity );
+unsigned int cas_hash( const char* bytes, size_t size );
+void cas_result_clear( CAS* cas );
+CAS_CODE cas_result_append( CAS_BUFFER* buffer, char** result, const char* chars, size_t size );
+CAS_CODE cas_result_set( CAS_BUFFER* buffer, char** result, const char* chars, size_t size );
+CAS_CODE cas_url_prefix( CAS_BUFFER* url, CAS_PROTOCOL protocol, const char* validate_url, const char* escaped_service, int renew );
+CAS_CODE cas_url_ticket( CAS_BUFFER* url, size_t prefix, const char* ticket );
+CAS_CODE cas_start_url( CAS* cas, CAS_PROTOCOL protocol, const char* url, const char* ticket );
+CAS_CODE cas_start_attempt( CAS* cas, CAS_PROTOCOL protocol, const char* url );
+CAS_CODE cas_result_copy( CAS* to, CAS* from );
+
+void cas_async_unlink( CAS* cas );
+
+CAS_CODE cas_start( CAS* cas, CAS_PROTOCOL protocol, char* validate_url, char* escaped_service, char* ticket, int renew );
+CAS_CODE cas_finish( CAS* cas, CURLcode status );
+CAS_CODE cas_perform( CAS* cas, const char* url );
+CAS_CODE cas_perform_attempts( CAS* cas );
+CAS_CODE cas_perform_flight( CAS* cas, const char* url );
+void cas_curl_ssl( CURL* curl, const char* capath, int verify );
+int cas_retry( CAS* cas, CURLcode status );
+CAS_CODE cas_perform_hedged( CAS* cas );
+void cas_hedge_zap( CAS* cas );
+
+const char* cas_endpoints_first( CAS* cas, const char* url );
+const char* cas_endpoints_failover( CAS* cas, CURLcode status );
+const char* cas_endpoints_hedge( CAS* hedge, CAS* cas );
+int cas_endpoints_admit( CAS* cas, int wait );
+void cas_endpoints_release( CAS* cas );
+char** cas_endpoints_urls( CAS_ENDPOINTS* endpoints, const char* url );
+void cas_endpoints_urls_free( char** urls );
+
+CAS_CODE cas_prewarm_handles( CURLM* multi, CAS** handles, int n, const char* url );
 
+CAS_CODE cas_reject( CAS* cas, CAS_PROTOCOL protocol, const char* url, const char* ticket );
+void cas_reject_learn( CAS* cas );
 
+void cas_mem_account( CAS* cas, const CAS_MEM_STATS* mark );
+char* cas_strndup( const char* str, size_t size );
 
 #endif
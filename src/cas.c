@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -20,6 +21,12 @@
  */
 void
 cas_init() {
+	//Counting needs its wrappers handed to libxml2 and libcurl, otherwise they
+	// keep their own allocators
+	if( cas_mem_counting ) {
+		cas_init_mem( NULL,NULL,NULL,NULL,NULL );
+		return;
+	}
 	curl_global_init( CURL_GLOBAL_ALL );
 	LIBXML_TEST_VERSION
 }
@@ -40,7 +47,7 @@ CAS*
 cas_new() {
 	CAS* cas = NULL;
 
-	if((cas = calloc( 1,sizeof( CAS ) ))){
+	if((cas = cas_calloc( 1,sizeof( CAS ) ))){
 		cas->curl = curl_easy_init();
 		curl_easy_setopt(cas->curl,CURLOPT_USERAGENT, PACKAGE_STRING );
 		curl_easy_setopt(cas->curl, CURLOPT_HEADER, 0L); 
@@ -50,6 +57,15 @@ cas_new() {
 		curl_easy_setopt(cas->curl, CURLOPT_MAXREDIRS, 5L);
 		curl_easy_setopt(cas->curl, CURLOPT_REDIR_PROTOCOLS, CURLPROTO_HTTP|CURLPROTO_HTTPS);
 		curl_easy_setopt(cas->curl, CURLOPT_PROTOCOLS, CURLPROTO_HTTP|CURLPROTO_HTTPS|CURLPROTO_FILE);
+		curl_easy_setopt(cas->curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+		curl_easy_setopt(cas->curl, CURLOPT_PRIVATE, cas);
+		curl_easy_setopt(cas->curl, CURLOPT_DEBUGFUNCTION, cas_trace_curl);
+		cas->ssl_validate_server=1;
+		cas->cas2_fastpath=1;
+		cas->max_response_size=CAS_DEFAULT_MAX_RESPONSE_SIZE;
+		cas->max_response_depth=CAS_DEFAULT_MAX_RESPONSE_DEPTH;
+		cas->endpoint_index=-1;
+		cas->admission_index=-1;
 		
 #ifdef DEBUG
 		curl_easy_setopt(cas->curl, CURLOPT_VERBOSE, 1L);
@@ -57,36 +73,85 @@ cas_new() {
 		curl_easy_setopt(cas->curl, CURLOPT_VERBOSE, 0L);
 #endif
 
-		
-	//TODO: SSL Locking Functions
-	////curl_easy_setopt(cas->curl, CURLOPT_SSL_CTX_FUNCTION, cas_curl_ssl_ctx);
-	////curl_easy_setopt(cas->curl, CURLOPT_SSL_CTX_DATA, c);
-
+		//Handles share connections and TLS sessions through a CAS_POOL, see caspool.c
 	}
 
 	return( cas );
 }
 
+/*******************************************************************************
+ * cas_curl_ssl: Give curl the CA path or file capath, if any, and whether to
+ *  validate the server certificate
+ */
 void
-cas_set_ssl_ca( CAS* cas, const char* capath ){
+cas_curl_ssl( CURL* curl, const char* capath, int verify ){
 	struct stat buf;
-	stat(capath, &buf);
-	
-	if(S_ISDIR(buf.st_mode)){
-		curl_easy_setopt(cas->curl, CURLOPT_CAPATH, capath);
-		cas_debug("Setting CAPATH = %s",capath);
-	}else if(S_ISREG(buf.st_mode)){
-		curl_easy_setopt(cas->curl, CURLOPT_CAINFO, capath);
-		cas_debug("Setting CAINFO = %s",capath);
-	}else{
-		cas_debug("I SHOULD NOT BE HERE - Setting SSL %s (%d)",capath, buf.st_mode);
+
+	if(capath){
+		stat(capath, &buf);
+		if(S_ISDIR(buf.st_mode)){
+			curl_easy_setopt(curl, CURLOPT_CAPATH, capath);
+			cas_debug("Setting CAPATH = %s",capath);
+		}else if(S_ISREG(buf.st_mode)){
+			curl_easy_setopt(curl, CURLOPT_CAINFO, capath);
+			cas_debug("Setting CAINFO = %s",capath);
+		}else{
+			cas_debug("I SHOULD NOT BE HERE - Setting SSL %s (%d)",capath, buf.st_mode);
+		}
 	}
+	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, (verify ? 1L : 0L));
+	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, (verify ? 2L : 0L));
+}
+
+void
+cas_set_ssl_ca( CAS* cas, const char* capath ){
+	cas->options_version++;
+	if( cas->ssl_ca ) cas_free( cas->ssl_ca );
+	cas->ssl_ca=( capath ? cas_strdup( capath ) : NULL );
+	cas_curl_ssl( cas->curl,capath,cas->ssl_validate_server );
 }
 
 void
 cas_set_ssl_validate_server( CAS* cas, int verify){
-	curl_easy_setopt(cas->curl, CURLOPT_SSL_VERIFYPEER, (verify ? 1 : 0));
-	curl_easy_setopt(cas->curl, CURLOPT_SSL_VERIFYHOST, (verify ? 2 : 0));
+	cas->options_version++;
+	cas->ssl_validate_server=( verify ? 1 : 0 );
+	curl_easy_setopt(cas->curl, CURLOPT_SSL_VERIFYPEER, (verify ? 1L : 0L));
+	curl_easy_setopt(cas->curl, CURLOPT_SSL_VERIFYHOST, (verify ? 2L : 0L));
+}
+
+void
+cas_set_cas2_fastpath( CAS* cas, int enable ){
+	cas->cas2_fastpath=( enable ? 1 : 0 );
+}
+
+void
+cas_set_http2( CAS* cas, int enable ){
+	cas->options_version++;
+	curl_easy_setopt(cas->curl, CURLOPT_HTTP_VERSION, (enable ? CURL_HTTP_VERSION_2TLS : CURL_HTTP_VERSION_1_1));
+	curl_easy_setopt(cas->curl, CURLOPT_PIPEWAIT, (enable ? 1L : 0L));
+}
+
+void
+cas_set_compression( CAS* cas, int enable ){
+	cas->options_version++;
+	//"" asks for every encoding libcurl was built to decode
+	curl_easy_setopt(cas->curl, CURLOPT_ACCEPT_ENCODING, (enable ? "" : NULL));
+}
+
+void
+cas_set_response_limits( CAS* cas, size_t max_size, int max_depth ){
+	cas->max_response_size=max_size;
+	cas->max_response_depth=( max_depth>0 ? max_depth : 0 );
+}
+
+void
+cas_set_deadline( CAS* cas, long deadline_ms ){
+	cas->deadline_ms=( deadline_ms>0 ? deadline_ms : 0 );
+}
+
+void
+cas_set_hedging( CAS* cas, int percentile ){
+	cas->hedge_percentile=( percentile<=0 ? 0 : percentile<50 ? 50 : percentile>99 ? 99 : percentile );
 }
 
 /*******************************************************************************
@@ -95,19 +160,468 @@ cas_set_ssl_validate_server( CAS* cas, int verify){
 void
 cas_zap( CAS* cas ) {
 	if(cas){
+		if( cas->multi ) curl_multi_remove_handle( cas->multi,cas->curl );
+		if( cas->async ) cas_async_unlink( cas );
+		cas_hedge_zap( cas );
 		if( cas->curl ) curl_easy_cleanup( cas->curl );
-		if( cas->principal ) free( cas->principal );
+		cas_result_clear( cas );
+		if( cas->principal_buffer.contents ) cas_free( cas->principal_buffer.contents );
+		if( cas->message_buffer.contents ) cas_free( cas->message_buffer.contents );
+		if( cas->ticket_prefixes ) cas_free( cas->ticket_prefixes );
+		if( cas->ssl_ca ) cas_free( cas->ssl_ca );
+		if( cas->buffer.contents ) cas_free( cas->buffer.contents );
+		if( cas->url.contents ) cas_free( cas->url.contents );
+		if( cas->endpoint_url.contents ) cas_free( cas->endpoint_url.contents );
+		if( cas->xml_ctx ) xmlFreeParserCtxt( cas->xml_ctx );
+		cas_attributes_free( &cas->attributes );
+		if( cas->json.token.contents ) cas_free( cas->json.token.contents );
+		if( cas->json.key.contents ) cas_free( cas->json.key.contents );
 		
 		cas->curl=NULL;
 		cas->principal=NULL;
 		cas->message=NULL;
 		
-		free( cas );
+		cas_free( cas );
 		
 		cas=NULL;
 	}
 }
 
+/*******************************************************************************
+ * cas_result_clear: Forget the principal and message of the last validation,
+ *  keeping their buffers for the next
+ */
+void
+cas_result_clear( CAS* cas ) {
+	cas->principal=NULL;
+	cas->message=NULL;
+	cas->principal_buffer.size=0;
+	cas->message_buffer.size=0;
+}
+
+/*******************************************************************************
+ * cas_result_append: Append size chars to the principal or message kept in
+ *  buffer, pointing result at it
+ */
+CAS_CODE
+cas_result_append( CAS_BUFFER* buffer, char** result, const char* chars, size_t size ) {
+	if( cas_buffer_reserve( buffer,buffer->size+size+1 )!=CAS_VALIDATION_SUCCESS ) {
+		return( CAS_ENOMEM );
+	}
+	memcpy( &buffer->contents[buffer->size],chars,size );
+	buffer->size+=size;
+	buffer->contents[buffer->size]='\0';
+	*result=buffer->contents;
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_result_set: Replace the principal or message kept in buffer with size
+ *  chars
+ */
+CAS_CODE
+cas_result_set( CAS_BUFFER* buffer, char** result, const char* chars, size_t size ) {
+	buffer->size=0;
+	*result=NULL;
+	return( cas_result_append( buffer,result,chars,size ) );
+}
+
+/*******************************************************************************
+ * cas_result_copy: Replace the result of the last validation on to with a
+ *  copy of the result of from
+ */
+CAS_CODE
+cas_result_copy( CAS* to, CAS* from ) {
+	cas_result_clear( to );
+
+	to->code=from->code;
+	if( from->principal && cas_result_set( &to->principal_buffer,&to->principal,from->principal,from->principal_buffer.size )!=CAS_VALIDATION_SUCCESS ) {
+		to->code=CAS_ENOMEM;
+	} else if( from->message && cas_result_set( &to->message_buffer,&to->message,from->message,from->message_buffer.size )!=CAS_VALIDATION_SUCCESS ) {
+		to->code=CAS_ENOMEM;
+	} else if( cas_attributes_copy( &to->attributes,&from->attributes )!=CAS_VALIDATION_SUCCESS ) {
+		to->code=CAS_ENOMEM;
+	}
+
+	return( to->code );
+}
+
+/*******************************************************************************
+ * cas_buffer_reserve: Grow buffer to hold at least capacity bytes
+ */
+CAS_CODE
+cas_buffer_reserve( CAS_BUFFER* buffer, size_t capacity ) {
+	if( buffer->capacity<capacity ) {
+		size_t grown=( buffer->capacity*2>capacity ? buffer->capacity*2 : capacity );
+		char* contents=cas_realloc( buffer->contents,grown );
+		if(contents==NULL) return(CAS_ENOMEM);
+		buffer->contents=contents;
+		buffer->capacity=grown;
+	}
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_hash: FNV-1a of size bytes
+ */
+unsigned int
+cas_hash( const char* bytes, size_t size ) {
+	unsigned int hash=2166136261u;
+	size_t i;
+
+	for( i=0; i<size; i++ ) {
+		hash^=( unsigned char )bytes[i];
+		hash*=16777619u;
+	}
+	return( hash );
+}
+
+/*******************************************************************************
+ * cas_url_prefix: Render everything of the validation URL but the ticket,
+ *  "<validate_url>?service=<escaped_service>[&renew=true][&format=JSON]&ticket=",
+ *  into url
+ */
+CAS_CODE
+cas_url_prefix( CAS_BUFFER* url, CAS_PROTOCOL protocol, const char* validate_url, const char* escaped_service, int renew ) {
+	size_t validate_size=strlen( validate_url );
+	size_t service_size=strlen( escaped_service );
+	int json=( protocol==CAS_PROTOCOL_CAS3_JSON );
+
+	//9=strlen("?service="), 11=strlen("&renew=true"), 12=strlen("&format=JSON"), 8=strlen("&ticket=")
+	if( cas_buffer_reserve( url,validate_size+9+service_size+( renew?11:0 )+( json?12:0 )+8+1 )!=CAS_VALIDATION_SUCCESS ) {
+		return(CAS_ENOMEM);
+	}
+
+	char* p=url->contents;
+	memcpy( p,validate_url,validate_size ); p+=validate_size;
+	memcpy( p,"?service=",9 ); p+=9;
+	memcpy( p,escaped_service,service_size ); p+=service_size;
+	if(renew) { memcpy( p,"&renew=true",11 ); p+=11; }
+	if(json) { memcpy( p,"&format=JSON",12 ); p+=12; }
+	memcpy( p,"&ticket=",8 ); p+=8;
+	*p='\0';
+
+	url->size=p-url->contents;
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_url_ticket: Replace whatever follows the first prefix bytes of url
+ *  with ticket
+ */
+CAS_CODE
+cas_url_ticket( CAS_BUFFER* url, size_t prefix, const char* ticket ) {
+	size_t ticket_size=strlen( ticket );
+
+	if( cas_buffer_reserve( url,prefix+ticket_size+1 )!=CAS_VALIDATION_SUCCESS ) {
+		return(CAS_ENOMEM);
+	}
+	memcpy( &url->contents[prefix],ticket,ticket_size+1 );
+
+	url->size=prefix+ticket_size;
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_start_attempt: Set up cas->curl for one attempt at a validation of the
+ *  complete URL with the given protocol, within what is left of its deadline
+ */
+CAS_CODE
+cas_start_attempt( CAS* cas, CAS_PROTOCOL protocol, const char* url ) {
+	long timeout_ms=cas->attempt_timeout_ms;
+	CAS_CODE rc;
+
+	memset( &cas->timings,0,sizeof( CAS_TIMINGS ) );
+	cas->abort=CAS_ABORT_NONE;
+
+	if( cas->deadline_us ) {
+		long left_ms=( long )( ( cas->deadline_us-cas_clock_us() )/1e3 );
+		if( left_ms<1 ) left_ms=1;
+		if( timeout_ms==0 || left_ms<timeout_ms ) timeout_ms=left_ms;
+	}
+	curl_easy_setopt( cas->curl,CURLOPT_TIMEOUT_MS,timeout_ms );
+#ifndef DEBUG
+	//curl only hands its messages to cas_trace_curl() when verbose
+	curl_easy_setopt( cas->curl,CURLOPT_VERBOSE,( long )__atomic_load_n( &cas_tracing,__ATOMIC_RELAXED ) );
+#endif
+	cas_debug("Attempt on %s",url);
+
+	switch( protocol ) {
+	case CAS_PROTOCOL_CAS1:
+		rc=cas_cas1_start( cas,url );
+		break;
+	case CAS_PROTOCOL_CAS2:
+	case CAS_PROTOCOL_CAS3:
+		rc=cas_cas2_start( cas,url );
+		break;
+	case CAS_PROTOCOL_CAS3_JSON:
+		rc=cas_cas3_start( cas,url );
+		break;
+	default:
+		return( CAS_INVALID_PARAMETERS );
+	}
+
+	if( rc==CAS_VALIDATION_SUCCESS ) {
+		cas->protocol=protocol;
+	}
+	return( rc );
+}
+
+/*******************************************************************************
+ * cas_start_url: Set up cas->curl for a validation of the complete URL with
+ *  the given protocol, on the best of the handle's endpoints if it has any
+ */
+CAS_CODE
+cas_start_url( CAS* cas, CAS_PROTOCOL protocol, const char* url, const char* ticket ) {
+	CAS_CODE rc;
+
+	if( (rc=cas_reject( cas,protocol,url,ticket ))!=CAS_VALIDATION_SUCCESS ) {
+		return( rc );
+	}
+	cas->deadline_us=( cas->deadline_ms ? cas_clock_us()+cas->deadline_ms*1e3 : 0 );
+	cas->shed=0;
+	if( cas->endpoints && ( url=cas_endpoints_first( cas,url ) )==NULL ) {
+		return( cas->code=CAS_ENOMEM );
+	}
+	return( cas_start_attempt( cas,protocol,url ) );
+}
+
+/*******************************************************************************
+ * cas_retry: Set up the transfer that just ended with status again, on
+ *  another endpoint, if it failed and an endpoint is left.  Returns 1 if the
+ *  transfer is to be performed again, 0 if it is to be finished.
+ */
+int
+cas_retry( CAS* cas, CURLcode status ) {
+	const char* url;
+
+	if( cas->endpoints==NULL || cas->endpoint_index<0 ) {
+		return( 0 );
+	}
+	if( ( url=cas_endpoints_failover( cas,status ) )==NULL ) {
+		return( 0 );
+	}
+	if( cas->deadline_us && cas_clock_us()>=cas->deadline_us ) {
+		return( 0 );
+	}
+
+	cas_debug("Failing over to %s",url);
+	cas->stats.failovers++;
+	if( cas_start_attempt( cas,cas->protocol,url )!=CAS_VALIDATION_SUCCESS || !cas_endpoints_admit( cas,0 ) ) {
+		return( 0 );
+	}
+	//Still the same validation
+	cas->stats.validations--;
+	return( 1 );
+}
+
+/*******************************************************************************
+ * cas_start: Set up cas->curl for a validation of the given protocol, building
+ *  the validation URL in the handle's reusable URL buffer
+ */
+CAS_CODE
+cas_start( CAS* cas, CAS_PROTOCOL protocol, char* validate_url, char* escaped_service, char* ticket, int renew ) {
+	if(!cas || !validate_url || !escaped_service || !ticket) {
+		return(CAS_INVALID_PARAMETERS);
+	}
+
+	if( cas_url_prefix( &cas->url,protocol,validate_url,escaped_service,renew )!=CAS_VALIDATION_SUCCESS
+	 || cas_url_ticket( &cas->url,cas->url.size,ticket )!=CAS_VALIDATION_SUCCESS ) {
+		return(CAS_ENOMEM);
+	}
+
+	return( cas_start_url( cas,protocol,cas->url.contents,ticket ) );
+}
+
+/*******************************************************************************
+ * cas_finish: Resolve the result of a transfer set up by cas_start
+ */
+CAS_CODE
+cas_finish( CAS* cas, CURLcode status ) {
+	CAS_TIMINGS* timings=&cas->timings;
+	double seconds;
+	CAS_CODE rc;
+
+	cas_endpoints_release( cas );
+
+	//Nothing was sent, there is nothing to finish
+	if( cas->shed ) {
+		const char* message="Not admitted by the endpoint, not sent to the CAS server";
+		cas_result_clear( cas );
+		cas_attributes_clear( &cas->attributes );
+		cas_result_set( &cas->message_buffer,&cas->message,message,strlen( message ) );
+		cas->stats.shed++;
+		cas->shed=0;
+		return( cas->code=CAS_OVERLOADED );
+	}
+
+	double start=cas_clock_us();
+	switch( cas->protocol ) {
+	case CAS_PROTOCOL_CAS1:
+		rc=cas_cas1_finish( cas,status );
+		break;
+	case CAS_PROTOCOL_CAS2:
+	case CAS_PROTOCOL_CAS3:
+		rc=cas_cas2_finish( cas,status );
+		break;
+	case CAS_PROTOCOL_CAS3_JSON:
+		rc=cas_cas3_finish( cas,status );
+		break;
+	default:
+		return( cas->code=CAS_FAIL );
+	}
+	timings->parse_us+=cas_clock_us()-start;
+
+	//A 5xx left on the last endpoint is a failure to reach the CAS server,
+	// whatever its error page parsed as
+	long http=0;
+	if( cas->endpoints && cas->endpoint_index>=0 && curl_easy_getinfo( cas->curl,CURLINFO_RESPONSE_CODE,&http )==CURLE_OK && http>=500 ) {
+		char message[64];
+		snprintf( message,sizeof( message ),"The CAS server answered with HTTP status %ld",http );
+		cas_result_clear( cas );
+		cas_attributes_clear( &cas->attributes );
+		cas_result_set( &cas->message_buffer,&cas->message,message,strlen( message ) );
+		rc=cas->code=CAS_CURL_FAILURE;
+	}
+
+	if( rc==CAS_CURL_FAILURE && status==CURLE_OPERATION_TIMEDOUT && cas->deadline_us && cas_clock_us()>=cas->deadline_us-1e3 ) {
+		rc=cas->code=CAS_DEADLINE_EXCEEDED;
+	}
+
+	if( curl_easy_getinfo( cas->curl,CURLINFO_NAMELOOKUP_TIME,&seconds )==CURLE_OK ) timings->namelookup_us=seconds*1e6;
+	if( curl_easy_getinfo( cas->curl,CURLINFO_CONNECT_TIME,&seconds )==CURLE_OK ) timings->connect_us=seconds*1e6;
+	if( curl_easy_getinfo( cas->curl,CURLINFO_APPCONNECT_TIME,&seconds )==CURLE_OK ) timings->appconnect_us=seconds*1e6;
+	if( curl_easy_getinfo( cas->curl,CURLINFO_STARTTRANSFER_TIME,&seconds )==CURLE_OK ) timings->starttransfer_us=seconds*1e6;
+	if( curl_easy_getinfo( cas->curl,CURLINFO_TOTAL_TIME,&seconds )==CURLE_OK ) timings->total_us=seconds*1e6;
+
+	cas_debug("Finished: CURLcode %d, CAS_CODE %d",status,rc);
+
+	return( rc );
+}
+
+/*******************************************************************************
+ * cas_perform_attempts: curl_easy_perform() until an attempt succeeds or
+ *  there is no endpoint left to fail over to, and resolve the result
+ */
+CAS_CODE
+cas_perform_attempts( CAS* cas ) {
+	CURLcode status;
+
+	if( cas->hedge_percentile ) {
+		return( cas_perform_hedged( cas ) );
+	}
+
+	if( !cas_endpoints_admit( cas,1 ) ) {
+		return( cas_finish( cas,CURLE_FAILED_INIT ) );
+	}
+	do {
+		status=curl_easy_perform( cas->curl );
+	} while( cas_retry( cas,status ) );
+
+	return( cas_finish( cas,status ) );
+}
+
+/*******************************************************************************
+ * cas_perform: Perform the transfer set up by cas_start for url and resolve
+ *  its result, or take it from an identical validation in flight
+ */
+CAS_CODE
+cas_perform( CAS* cas, const char* url ) {
+	CAS_MEM_STATS mark;
+	CAS_CODE rc;
+
+	cas_get_mem_thread( &mark );
+	rc=cas_perform_flight( cas,url );
+	cas_reject_learn( cas );
+	cas_mem_account( cas,&mark );
+	return( rc );
+}
+
+/*******************************************************************************
+ * cas_prepare: Create a validator for one validation URL, service, protocol
+ *  and renew flag, with everything but the ticket rendered once
+ */
+CAS_PREPARED*
+cas_prepare( CAS* cas, char* validate_url, char* escaped_service, CAS_PROTOCOL protocol, int renew ) {
+	CAS_PREPARED* prepared=NULL;
+
+	if(!cas || !validate_url || !escaped_service || protocol<CAS_PROTOCOL_CAS1 || protocol>CAS_PROTOCOL_CAS3_JSON) {
+		return( NULL );
+	}
+
+	if((prepared=cas_calloc( 1,sizeof( CAS_PREPARED ) ))){
+		if( cas_url_prefix( &prepared->url,protocol,validate_url,escaped_service,renew )!=CAS_VALIDATION_SUCCESS ) {
+			cas_free( prepared );
+			return( NULL );
+		}
+		prepared->cas=cas;
+		prepared->protocol=protocol;
+		prepared->prefix=prepared->url.size;
+		cas_debug("Prepared %s",prepared->url.contents);
+	}
+
+	return( prepared );
+}
+
+/*******************************************************************************
+ * cas_prepared_validate: Validate ticket with a prepared validator
+ */
+CAS_CODE
+cas_prepared_validate( CAS_PREPARED* prepared, char* ticket ) {
+	if(!prepared || !ticket) {
+		return(CAS_INVALID_PARAMETERS);
+	}
+
+	CAS* cas=prepared->cas;
+	if( cas_url_ticket( &prepared->url,prepared->prefix,ticket )!=CAS_VALIDATION_SUCCESS ) {
+		return( cas->code=CAS_ENOMEM );
+	}
+
+	CAS_CODE rc=cas_start_url( cas,prepared->protocol,prepared->url.contents,ticket );
+	if( rc!=CAS_VALIDATION_SUCCESS ) {
+		return( rc );
+	}
+	return( cas_perform( cas,prepared->url.contents ) );
+}
+
+/*******************************************************************************
+ * cas_prepared_zap: destroy a prepared validator, but not its CAS handle
+ */
+void
+cas_prepared_zap( CAS_PREPARED* prepared ) {
+	if(prepared){
+		if( prepared->url.contents ) cas_free( prepared->url.contents );
+
+		prepared->url.contents=NULL;
+
+		cas_free( prepared );
+	}
+}
+
+/*******************************************************************************
+ * cas_get_code: Retrieve the CAS_CODE of the last validation on this handle
+ */
+CAS_CODE
+cas_get_code( CAS* cas ) {
+	return( cas->code );
+}
+
+/*******************************************************************************
+ * cas_get_stats: Retrieve the counters of this handle
+ */
+void
+cas_get_stats( CAS* cas, CAS_STATS* stats ) {
+	*stats=cas->stats;
+}
+
+/*******************************************************************************
+ * cas_get_timings: Retrieve the phase timings of the last validation
+ */
+void
+cas_get_timings( CAS* cas, CAS_TIMINGS* timings ) {
+	*timings=cas->timings;
+}
+
 /*******************************************************************************
  * cas_get_principal: Retrieve a resolved principal
  */
@@ -117,13 +631,31 @@ cas_get_principal( CAS* cas ) {
 }
 
 /*******************************************************************************
- * cas_get_message: Retrieve a resolved principal
+ * cas_get_message: Retrieve the failure message of the CAS server, or cURL
  */
 char*
 cas_get_message( CAS* cas ) {
 	return( cas->message );
 }
 
+/*******************************************************************************
+ * cas_get_principal_view: Retrieve the principal in place, with its size
+ */
+const char*
+cas_get_principal_view( CAS* cas, size_t* size ) {
+	*size=( cas->principal ? cas->principal_buffer.size : 0 );
+	return( cas->principal );
+}
+
+/*******************************************************************************
+ * cas_get_message_view: Retrieve the message in place, with its size
+ */
+const char*
+cas_get_message_view( CAS* cas, size_t* size ) {
+	*size=( cas->message ? cas->message_buffer.size : 0 );
+	return( cas->message );
+}
+
 /*******************************************************************************
  * cas_code_str: Resolve string from CAS_CODE
  */
@@ -148,6 +680,16 @@ cas_code_str( CAS_CODE code ) {
 		return( "LIBCAS: Server returned invalid response");
 	case CAS2_INVALID_XML:
 		return( "LIBCAS: Server returned unparseable response");
+	case CAS3_INVALID_JSON:
+		return( "LIBCAS: Server returned unparseable JSON response");
+	case CAS_RESPONSE_LIMIT:
+		return( "LIBCAS: Server response exceeded the size or depth limit");
+	case CAS_DEADLINE_EXCEEDED:
+		return( "LIBCAS: Validation did not complete within its deadline");
+	case CAS_SESSION_UNKNOWN:
+		return( "LIBCAS: Session not in the session cache, or expired");
+	case CAS_OVERLOADED:
+		return( "LIBCAS: Validation shed, the CAS server is at capacity");
 	case CAS_CURL_FAILURE:
 		return( "CURL: Error with cURL Subsystem" );
 	case CAS_INVALID_PARAMETERS:
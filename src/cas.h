@@ -32,7 +32,15 @@ cas_destroy();
 #ifndef CAS_H
 #define CAS_H
 
+#include <stddef.h>
+
 typedef struct CAS CAS;
+typedef struct CAS_BATCH CAS_BATCH;
+typedef struct CAS_ASYNC CAS_ASYNC;
+typedef struct CAS_POOL CAS_POOL;
+typedef struct CAS_PREPARED CAS_PREPARED;
+typedef struct CAS_ENDPOINTS CAS_ENDPOINTS;
+typedef struct CAS_SESSIONS CAS_SESSIONS;
 
 typedef enum {
 	CAS_FAIL=-1,				// - Utter Failure, reason unknown
@@ -47,12 +55,167 @@ typedef enum {
 	CAS2_INVALID_XML,			// - XML response invalid
 	CAS_ENOMEM,					// - Out of memory
 	CAS_INVALID_PARAMETERS,		// - Invalid parameters supplied
+	CAS3_INVALID_JSON,			// - JSON response invalid
+	CAS_RESPONSE_LIMIT,			// - Response exceeded the size or depth limit, see cas_set_response_limits()
+	CAS_DEADLINE_EXCEEDED,		// - Validation did not complete within its deadline, see cas_set_deadline()
+	CAS_SESSION_UNKNOWN,		// - Session not in the session cache, or expired, see cas_sessions_get()
+	CAS_OVERLOADED,				// - Validation shed by the admission control of its endpoint, see cas_endpoints_set_admission()
 
 } CAS_CODE;
 
+typedef enum {
+	CAS_PROTOCOL_CAS1=1,		// - CAS1 /validate
+	CAS_PROTOCOL_CAS2,			// - CAS2 /serviceValidate
+	CAS_PROTOCOL_CAS3,			// - CAS3 /p3/serviceValidate, XML response
+	CAS_PROTOCOL_CAS3_JSON,		// - CAS3 /p3/serviceValidate, JSON response
+} CAS_PROTOCOL;
+
+/* Socket events for cas_socket_callback and cas_async_socket_action(), identical to libcurl's */
+#define CAS_POLL_NONE		0	// - (cas_socket_callback) nothing to watch
+#define CAS_POLL_IN			1	// - (cas_socket_callback) watch fd for reading
+#define CAS_POLL_OUT		2	// - (cas_socket_callback) watch fd for writing
+#define CAS_POLL_INOUT		3	// - (cas_socket_callback) watch fd for reading and writing
+#define CAS_POLL_REMOVE		4	// - (cas_socket_callback) stop watching fd
+#define CAS_CSELECT_IN		1	// - (cas_async_socket_action) fd is readable
+#define CAS_CSELECT_OUT		2	// - (cas_async_socket_action) fd is writable
+#define CAS_CSELECT_ERR		4	// - (cas_async_socket_action) fd has an error
+#define CAS_SOCKET_TIMEOUT	-1	// - (cas_async_socket_action) the timer expired, no fd
+
+#define CAS_DEFAULT_MAX_RESPONSE_SIZE	( 1024*1024 )
+#define CAS_DEFAULT_MAX_RESPONSE_DEPTH	16
+
+#define CAS_DEFAULT_ENDPOINT_CONNECT_TIMEOUT_MS	2000
+#define CAS_DEFAULT_BREAKER_FAILURES	3
+#define CAS_DEFAULT_BREAKER_COOLDOWN_MS	5000
+
+#define CAS_DEFAULT_TICKET_CHARSET	"A-Za-z0-9._-"	// - characters of the tickets of common CAS servers, after the prefix
+#define CAS_DEFAULT_NEGATIVE_TTL_MS	300000
+
+#define CAS_DEFAULT_TRACE_EVENTS	1024	// - events each thread keeps, see cas_set_tracing()
+#define CAS_TRACE_MESSAGE_MAX		112		// - size of the longest event message, with its terminating NUL
+
+#define CAS_SESSION_ID_MAX			128	// - size of the longest session ID a CAS_SESSIONS stores, with its terminating NUL
+#define CAS_SESSION_PRINCIPAL_MAX	256	// - size of the longest principal a CAS_SESSIONS stores, with its terminating NUL
+
+typedef struct {
+	unsigned long validations;		// - validations started on the handle
+	unsigned long parser_contexts;	// - CAS2 XML push parsers created by the handle, 1 once a response needed libxml2
+	unsigned long fastpath_responses;	// - CAS2 responses parsed without libxml2
+	unsigned long coalesced;		// - validations answered by an identical one in flight, see cas_set_singleflight()
+	unsigned long failovers;		// - attempts retried on another endpoint, see cas_set_endpoints()
+	unsigned long hedges;			// - second requests sent for slow validations, see cas_set_hedging()
+	unsigned long hedge_wins;		// - validations answered by the second request
+	unsigned long rejected_malformed;	// - validations refused for the syntax of their ticket, see cas_set_ticket_syntax()
+	unsigned long rejected_cached;	// - validations answered by the negative cache, see cas_set_negative_cache()
+	unsigned long shed;				// - validations refused by admission control, see cas_endpoints_set_admission()
+	unsigned long allocations;		// - allocator calls of blocking validations, see cas_set_mem_counting()
+	unsigned long allocated_bytes;	// - bytes they asked for
+} CAS_STATS;
+
+typedef struct {
+	unsigned long allocations;		// - calls to malloc, realloc, calloc and strdup
+	unsigned long bytes;			// - bytes they asked for
+	unsigned long frees;			// - calls to free, of anything but NULL
+} CAS_MEM_STATS;
+
+typedef enum {
+	CAS_ENDPOINT_CLOSED=0,			// - in rotation
+	CAS_ENDPOINT_OPEN,				// - out of rotation after repeated failures, waiting to be probed
+	CAS_ENDPOINT_PROBING,			// - out of rotation, being probed
+} CAS_ENDPOINT_STATE;
+
+typedef struct {
+	const char* url;				// - base URL, valid as long as the CAS_ENDPOINTS
+	CAS_ENDPOINT_STATE state;
+	double latency_us;				// - moving average of attempt latency
+	double error_rate;				// - moving average of failed attempts, 0 to 1
+	unsigned long attempts;
+	unsigned long failures;
+	int in_flight;					// - attempts admitted and not yet complete
+	int queued;						// - validations waiting to be admitted
+	unsigned long shed;				// - attempts refused by admission control
+} CAS_ENDPOINT_STATS;
+
+typedef struct {
+	unsigned long capacity;			// - sessions the cache holds at most
+	unsigned long sessions;			// - live sessions
+	unsigned long hits;				// - lookups that found a live session, by every process
+	unsigned long misses;			// - lookups that did not
+	unsigned long evictions;		// - live sessions dropped to make room for new ones
+} CAS_SESSIONS_STATS;
+
+typedef struct {
+	double namelookup_us;			// - name resolved, from the start of the validation
+	double connect_us;				// - connected to the server, 0 if a connection was reused
+	double appconnect_us;			// - TLS handshake complete, 0 without TLS
+	double starttransfer_us;		// - first byte of the response received
+	double total_us;				// - transfer complete
+	double parse_us;				// - spent by libcas parsing the response, partly within the above
+	unsigned long bytes_received;	// - size of the response body
+} CAS_TIMINGS;
+
+typedef struct {
+	unsigned long sequence;			// - of the event on its thread, from 1; a gap is events lost to the ring wrapping
+	double time_us;					// - monotonic clock, comparable across threads
+	unsigned int thread;			// - ring of the thread that recorded the event, handed on to another thread once it exits
+	const char* function;			// - libcas function that recorded the event
+	int line;
+	char message[CAS_TRACE_MESSAGE_MAX];
+} CAS_TRACE_EVENT;
+
+typedef int (*cas_socket_callback)( int fd, int what, void* userp );
+typedef void (*cas_timer_callback)( long timeout_ms, void* userp );
+typedef void (*cas_done_callback)( CAS* cas, CAS_CODE code, char* principal, void* userp );
+typedef void* (*cas_malloc_callback)( size_t size );
+typedef void (*cas_free_callback)( void* ptr );
+typedef void* (*cas_realloc_callback)( void* ptr, size_t size );
+typedef void* (*cas_calloc_callback)( size_t nmemb, size_t size );
+typedef char* (*cas_strdup_callback)( const char* str );
+typedef void (*cas_trace_callback)( const CAS_TRACE_EVENT* event, void* userp );
+
 void cas_init();
 void cas_destroy();
 
+/**
+ *	Initialize libcas, as cas_init(), with every allocation of libcas, libxml2 and libcurl made through the given functions. Call it once, instead of cas_init() and before any other use of libcas, libxml2 or libcurl in the process, as libxml2 and libcurl only take them before they are initialized: memory allocated with one allocator must not be freed with another.
+ *  @param malloc_fn, free_fn, realloc_fn, calloc_fn, strdup_fn replacements with the semantics of the C library functions, which are used for any NULL. They must be thread-safe.
+ *  @return CAS_VALIDATION_SUCCESS, or CAS_FAIL if libxml2 or libcurl refused them.
+ */
+CAS_CODE cas_init_mem( cas_malloc_callback malloc_fn, cas_free_callback free_fn, cas_realloc_callback realloc_fn, cas_calloc_callback calloc_fn, cas_strdup_callback strdup_fn );
+
+/**
+ *	Enable or disable (default) counting of allocations, from the next cas_init() or cas_init_mem(), which then install wrappers counting the calls and bytes of every thread in front of the allocator. The allocations of each blocking validation (cas_cas1_validate(), cas_cas2_servicevalidate(), cas_cas3_servicevalidate(), cas_prepared_validate()) add up in the allocations and allocated_bytes of CAS_STATS. Those of batches, CAS_ASYNC validations, or anything else are counted with cas_get_mem_thread() before and after.
+ *  @param enable flag (1=true).
+ */
+void cas_set_mem_counting( int enable );
+
+/**
+ *	Retrieve the allocations counted on the calling thread so far, all 0 unless counting was enabled at initialization.
+ *  @param stats receives the counters.
+ */
+void cas_get_mem_thread( CAS_MEM_STATS* stats );
+
+/**
+ *	Enable or disable (default) tracing, at any time and from any thread. While enabled, libcas records what it does (transfers and curl's connection messages, each transition of the CAS2 parser, failovers, results) into a ring of events per thread, without locking or blocking; the oldest events of a thread are overwritten once its ring is full. Disabled, tracing costs a test of a flag.
+ *  @param events events each thread keeps, rounded up to a power of 2, such as CAS_DEFAULT_TRACE_EVENTS; rings created before keep their size. 0 disables tracing, keeping the events recorded so far.
+ */
+void cas_set_tracing( size_t events );
+
+/**
+ *	Pass every event recorded since the last drain to callback, thread by thread in the order each recorded them. Threads keep recording meanwhile; an event overwritten as it is read is skipped. May be called from any thread, one at a time.
+ *  @param callback called with (event, userp) for each event; event is only valid during the call.
+ *  @param userp passed to callback.
+ *  @return the number of events passed.
+ */
+size_t cas_trace_drain( cas_trace_callback callback, void* userp );
+
+/**
+ *	Drain the trace to a file descriptor, as lines of: time_us thread sequence function:line message.
+ *  @param fd file descriptor open for writing, such as 2 for stderr.
+ *  @return the number of events written.
+ */
+size_t cas_trace_dump( int fd );
+
 CAS* cas_new();
 void cas_zap( CAS* cas );
 
@@ -68,12 +231,403 @@ void cas_zap( CAS* cas );
 CAS_CODE cas_cas1_validate( CAS* cas, char* cas1_validate_url, char* escaped_service, char* ticket, int renew);
 CAS_CODE cas_cas2_servicevalidate( CAS* cas, char* cas2_servicevalidate_url, char* escaped_service, char* ticket, int renew);
 
+/**
+ *	Perform CAS3 validation. Released attributes can be fetched with cas_get_attribute() whichever the response format.
+ *  @param cas a CAS handle supplied by cas_new(). cas_get_principal(cas) or cas_get_message(cas) can be used to fetch results of this function call.
+ *  @param cas3_servicevalidate_url the URL for the CAS3 service validation service, usually ending in /p3/serviceValidate.
+ *  @param escaped_service the escaped service name.
+ *  @param ticket the service ticket to be validated.
+ *  @param renew flag (1=true) to specify that the ticket was obtained with renew.
+ *  @param json flag (1=true) to request the response as JSON (format=JSON) rather than XML.
+ *  @return a CAS_CODE representing the status of the request.
+ */
+CAS_CODE cas_cas3_servicevalidate( CAS* cas, char* cas3_servicevalidate_url, char* escaped_service, char* ticket, int renew, int json );
+
+/**
+ *	Prepare a validator for repeated validations against one validation URL and service. The URL up to the ticket is rendered once, so each validation only appends the ticket.
+ *  @param cas a CAS handle supplied by cas_new(), which performs the validations. cas_get_principal(cas) or cas_get_message(cas) can be used to fetch their results.
+ *  @param validate_url the URL for the CAS1 validation, or CAS2 or CAS3 service validation, service.
+ *  @param escaped_service the escaped service name.
+ *  @param protocol CAS_PROTOCOL_CAS1, CAS_PROTOCOL_CAS2, CAS_PROTOCOL_CAS3 or CAS_PROTOCOL_CAS3_JSON.
+ *  @param renew flag (1=true) to specify that tickets were obtained with renew.
+ *  @return a new CAS_PREPARED, or NULL on failure.
+ */
+CAS_PREPARED* cas_prepare( CAS* cas, char* validate_url, char* escaped_service, CAS_PROTOCOL protocol, int renew );
+
+/**
+ *	Perform a validation with a prepared validator.
+ *  @param prepared a CAS_PREPARED supplied by cas_prepare().
+ *  @param ticket the service ticket to be validated.
+ *  @return a CAS_CODE representing the status of the request.
+ */
+CAS_CODE cas_prepared_validate( CAS_PREPARED* prepared, char* ticket );
+
+/**
+ *	Destroy a prepared validator. Its CAS handle is not destroyed.
+ */
+void cas_prepared_zap( CAS_PREPARED* prepared );
+
+/**
+ *	Create a batch for concurrent validation of many tickets on one thread.
+ *  @return a new, empty CAS_BATCH, or NULL on failure.
+ */
+CAS_BATCH* cas_batch_new();
+void cas_batch_zap( CAS_BATCH* batch );
+
+/**
+ *	Cap the number of validations of a batch that are in flight at once.
+ *  @param batch a CAS_BATCH supplied by cas_batch_new().
+ *  @param max_in_flight maximum concurrent transfers, 0 for no limit (default).
+ */
+void cas_batch_set_max_in_flight( CAS_BATCH* batch, long max_in_flight );
+
+/**
+ *	Queue a validation to be run by cas_validate_batch().
+ *  @param batch a CAS_BATCH supplied by cas_batch_new().
+ *  @param cas a CAS handle supplied by cas_new(), which receives the result of this validation. A handle may only be queued once per batch run.
+ *  @param protocol CAS_PROTOCOL_CAS1, CAS_PROTOCOL_CAS2, CAS_PROTOCOL_CAS3 or CAS_PROTOCOL_CAS3_JSON.
+ *  @param validate_url the URL for the CAS1 validation, or CAS2 or CAS3 service validation, service.
+ *  @param escaped_service the escaped service name.
+ *  @param ticket the service ticket to be validated.
+ *  @param renew flag (1=true) to specify that the ticket was obtained with renew.
+ *  @return CAS_VALIDATION_SUCCESS if the validation was queued, otherwise the CAS_CODE of the failure (also left on cas).
+ */
+CAS_CODE cas_batch_add( CAS_BATCH* batch, CAS* cas, CAS_PROTOCOL protocol, char* validate_url, char* escaped_service, char* ticket, int renew );
+
+/**
+ *	Perform all queued validations concurrently, returning once every one has completed. The batch is empty afterwards and may be reused.
+ *  @param batch a CAS_BATCH supplied by cas_batch_new().
+ *  @return CAS_VALIDATION_SUCCESS if the batch ran. The result of each validation is retrieved from its handle with cas_get_code(), cas_get_principal() and cas_get_message().
+ */
+CAS_CODE cas_validate_batch( CAS_BATCH* batch );
+
+/**
+ *	Create a validation context driven by the caller's event loop, in the manner of curl_multi_socket_action().
+ *  @param socket_callback called with (fd, CAS_POLL_*, userp) whenever the events to watch on fd change. Must return 0.
+ *  @param timer_callback called with (timeout_ms, userp) when the single timeout to watch changes; -1 cancels the timeout, 0 asks for cas_async_socket_action(async, CAS_SOCKET_TIMEOUT, 0, ...) as soon as possible.
+ *  @param userp passed to both callbacks.
+ *  @return a new CAS_ASYNC, or NULL on failure.
+ */
+CAS_ASYNC* cas_async_new( cas_socket_callback socket_callback, cas_timer_callback timer_callback, void* userp );
+
+/**
+ *	Destroy a CAS_ASYNC. Validations still in flight are abandoned without calling their completion callback.
+ */
+void cas_async_zap( CAS_ASYNC* async );
+
+/**
+ *	Begin a validation without waiting for it.
+ *  @param async a CAS_ASYNC supplied by cas_async_new().
+ *  @param cas a CAS handle supplied by cas_new(), not already in flight.
+ *  @param protocol CAS_PROTOCOL_CAS1, CAS_PROTOCOL_CAS2, CAS_PROTOCOL_CAS3 or CAS_PROTOCOL_CAS3_JSON.
+ *  @param validate_url the URL for the CAS1 validation, or CAS2 or CAS3 service validation, service.
+ *  @param escaped_service the escaped service name.
+ *  @param ticket the service ticket to be validated.
+ *  @param renew flag (1=true) to specify that the ticket was obtained with renew.
+ *  @param done called from cas_async_socket_action() with (cas, code, principal or NULL, done_userp) once the validation completes.
+ *  @param done_userp passed to done.
+ *  @return CAS_VALIDATION_SUCCESS if the validation was started, otherwise the CAS_CODE of the failure; done is not called in that case.
+ */
+CAS_CODE cas_async_start( CAS_ASYNC* async, CAS* cas, CAS_PROTOCOL protocol, char* validate_url, char* escaped_service, char* ticket, int renew, cas_done_callback done, void* done_userp );
+
+/**
+ *	Drive in-flight validations after the event loop saw activity.
+ *  @param async a CAS_ASYNC supplied by cas_async_new().
+ *  @param fd the ready file descriptor, or CAS_SOCKET_TIMEOUT when the timer expired.
+ *  @param events CAS_CSELECT_* bits describing fd, or 0.
+ *  @param running if not NULL, receives the number of validations still in flight.
+ *  @return CAS_VALIDATION_SUCCESS, or CAS_CURL_FAILURE if the underlying multi handle failed.
+ */
+CAS_CODE cas_async_socket_action( CAS_ASYNC* async, int fd, int events, int* running );
+
+CAS_CODE cas_get_code( CAS* cas );
 char* cas_get_principal( CAS* cas );
 char* cas_get_message( CAS* cas );
 
+/**
+ *	Retrieve the principal, or the failure message, of the last validation in place, with its size. Each is kept in a buffer of the handle, reused by every validation, so it is only valid until the next validation on the handle, or cas_zap(). A handle has a principal or a message, not both.
+ *  @param cas a CAS handle supplied by cas_new().
+ *  @param size receives the size of the principal or message, without its terminating NUL, 0 if there is none.
+ *  @return the principal or message, NUL-terminated, or NULL if there is none.
+ */
+const char* cas_get_principal_view( CAS* cas, size_t* size );
+const char* cas_get_message_view( CAS* cas, size_t* size );
+char* cas_code_str( CAS_CODE code );
+
+/**
+ *	Retrieve a CAS2 attribute released with a successful validation, from the <cas:attributes> block of the response.
+ *  @param cas a CAS handle supplied by cas_new().
+ *  @param name the attribute name, the local name of its element.
+ *  @return the first value of the attribute, or NULL if it was not released. The value belongs to the handle and is valid until its next validation.
+ */
+char* cas_get_attribute( CAS* cas, const char* name );
+
+/**
+ *	Retrieve the next value of a multi-valued attribute.
+ *  @param cas a CAS handle supplied by cas_new().
+ *  @param value a value returned by cas_get_attribute() or cas_get_attribute_next() since the last validation of cas.
+ *  @return the value of the same attribute following value, in document order, or NULL if there is none.
+ */
+char* cas_get_attribute_next( CAS* cas, const char* value );
+
+/**
+ *	Retrieve the number of values released for an attribute.
+ *  @param cas a CAS handle supplied by cas_new().
+ *  @param name the attribute name.
+ *  @return the number of values, 0 if the attribute was not released.
+ */
+size_t cas_get_attribute_count( CAS* cas, const char* name );
+
+/**
+ *	Retrieve the counters of a handle.
+ *  @param cas a CAS handle supplied by cas_new().
+ *  @param stats receives the counters.
+ */
+void cas_get_stats( CAS* cas, CAS_STATS* stats );
+
+/**
+ *	Retrieve the phase timings of the last validation of a handle, as reported by cURL (CURLINFO_*_TIME), along with libcas's own parse time and the response size.
+ *  @param cas a CAS handle supplied by cas_new().
+ *  @param timings receives the timings.
+ */
+void cas_get_timings( CAS* cas, CAS_TIMINGS* timings );
+
 void cas_set_ssl_ca( CAS* cas, const char* capath );
 void cas_set_ssl_validate_server( CAS* cas, int verify);
 
+/**
+ *	Enable (default) or disable the CAS2 fast path, which parses small canonical responses without libxml2 and falls back to libxml2 for anything else.
+ *  @param cas a CAS handle supplied by cas_new().
+ *  @param enable flag (1=true).
+ */
+void cas_set_cas2_fastpath( CAS* cas, int enable );
+
+/**
+ *	Negotiate HTTP/2 with the CAS server (over TLS, by ALPN), or keep to HTTP/1.1 (default). The validations of a CAS_BATCH or CAS_ASYNC on HTTP/2 handles then share connections, many in flight on each, instead of opening a connection for every validation in flight.
+ *  @param cas a CAS handle supplied by cas_new().
+ *  @param enable flag (1=true).
+ */
+void cas_set_http2( CAS* cas, int enable );
+
+/**
+ *	Ask the CAS server for a compressed response, in any encoding libcurl can decode, or not (default). The response is decompressed as it arrives and streamed to the parser; response limits apply to the decompressed response.
+ *  @param cas a CAS handle supplied by cas_new().
+ *  @param enable flag (1=true).
+ */
+void cas_set_compression( CAS* cas, int enable );
+
+/**
+ *	Limit the responses a handle accepts, so that a misbehaving or hostile server cannot tie it up with a never-ending response. A validation whose response exceeds a limit is abandoned as soon as it does, with CAS_RESPONSE_LIMIT.
+ *  @param cas a CAS handle supplied by cas_new().
+ *  @param max_size maximum response body size in bytes, 0 for no limit. Default: CAS_DEFAULT_MAX_RESPONSE_SIZE.
+ *  @param max_depth maximum element nesting of a CAS2 or CAS3 XML response, 0 for no limit. Default: CAS_DEFAULT_MAX_RESPONSE_DEPTH.
+ */
+void cas_set_response_limits( CAS* cas, size_t max_size, int max_depth );
+
+/**
+ *	Refuse tickets of the wrong syntax without asking the CAS server: a validation of one returns CAS2_INVALID_TICKET (CAS1_VALIDATION_NO for CAS1) at once, as the validate functions, cas_batch_add() and cas_async_start() return it. NULL or 0 leaves a part of the syntax unchecked; all of them disable the check (default).
+ *  @param cas a CAS handle supplied by cas_new().
+ *  @param prefixes comma-separated prefixes a ticket must start with, such as "ST-,PT-".
+ *  @param charset characters allowed after the prefix, with ranges such as "a-z", such as CAS_DEFAULT_TICKET_CHARSET.
+ *  @param min_length shortest ticket allowed, prefix included.
+ *  @param max_length longest ticket allowed, prefix included.
+ *  @return CAS_VALIDATION_SUCCESS, CAS_INVALID_PARAMETERS or CAS_ENOMEM.
+ */
+CAS_CODE cas_set_ticket_syntax( CAS* cas, const char* prefixes, const char* charset, size_t min_length, size_t max_length );
+
+/**
+ *	Give every validation on a handle a deadline, counted from the start of the validation and covering every attempt on every endpoint. A validation not complete by its deadline is abandoned with CAS_DEADLINE_EXCEEDED. Set it before each validation for per-call deadlines.
+ *  @param cas a CAS handle supplied by cas_new().
+ *  @param deadline_ms time allowed to each validation in milliseconds, 0 for none (default).
+ */
+void cas_set_deadline( CAS* cas, long deadline_ms );
+
+/**
+ *	Hedge the slow blocking validations of a handle (cas_cas1_validate(), cas_cas2_servicevalidate(), cas_cas3_servicevalidate(), cas_prepared_validate()). When a validation has not been answered within the given percentile of the latencies of the last 64 validations of the handle, the same request is also sent to another endpoint (see cas_set_endpoints()), or again to the same server if there is no other, and the first answer wins; the other transfer is cancelled. A ticket is only good once, so a CAS2_INVALID_TICKET or CAS1_VALIDATION_NO answer never wins while the other request may have been the one to use up the ticket. Hedging starts once the handle has 16 validations of history.
+ *  @param cas a CAS handle supplied by cas_new().
+ *  @param percentile 50 to 99, or 0 to disable hedging (default).
+ */
+void cas_set_hedging( CAS* cas, int percentile );
+
+/**
+ *	Open a connection to the CAS server ahead of the first validation, so that it does not pay for name resolution, connecting and the TLS handshake. A HEAD request of the path of url, without a ticket, is sent to every endpoint of the handle whose breaker is closed (see cas_set_endpoints()), or to url itself; the connection it leaves open is kept for the validations of the handle. Call it again to keep the connection from going idle, or use cas_pool_prewarm() and cas_pool_set_keepalive().
+ *  @param cas a CAS handle supplied by cas_new(), with no validation in flight.
+ *  @param url a validation URL, such as "https://cas.example.edu/cas/serviceValidate".
+ *  @return CAS_VALIDATION_SUCCESS if every endpoint answered, whatever the HTTP status, CAS_CURL_FAILURE if any could not be reached, or CAS_INVALID_PARAMETERS.
+ */
+CAS_CODE cas_prewarm( CAS* cas, const char* url );
+
+/**
+ *	Enable or disable (default) process-wide coalescing of concurrent identical validations. While enabled, a blocking validation (cas_cas1_validate(), cas_cas2_servicevalidate(), cas_cas3_servicevalidate(), cas_prepared_validate()) of the same URL, service, ticket and renew flag as one already in flight on another thread does not go to the CAS server: it waits for the first and receives its CAS_CODE, principal or message, and attributes, or CAS_DEADLINE_EXCEEDED if its own deadline (cas_set_deadline()) passes first. Batches and CAS_ASYNC validations are never coalesced.
+ *  Call it before validating from more than one thread.
+ *  @param enable flag (1=true).
+ */
+void cas_set_singleflight( int enable );
+
+/**
+ *	Enable or disable (default) a process-wide negative cache. A validation the CAS server rejects with CAS2_INVALID_TICKET or CAS1_VALIDATION_NO is remembered for ttl_ms, and the same validation (URL, service, ticket, renew flag and protocol) is meanwhile answered with the same code and no request, as cas_cas2_servicevalidate() and the other validate functions, cas_batch_add() and cas_async_start() return it at once. The cache holds 64-bit hashes in a fixed-size table; once full, entries not used recently are evicted to make room. Call it before validating from more than one thread.
+ *  @param capacity validations remembered at most, 0 to disable the cache.
+ *  @param ttl_ms how long a rejection is remembered, such as CAS_DEFAULT_NEGATIVE_TTL_MS.
+ *  @return CAS_VALIDATION_SUCCESS, CAS_INVALID_PARAMETERS or CAS_ENOMEM.
+ */
+CAS_CODE cas_set_negative_cache( unsigned long capacity, long ttl_ms );
+
+/**
+ *	Create a set of CAS server endpoints to fail over between. A set is thread-safe and may be shared by any number of handles and pools.
+ *  @return a new, empty CAS_ENDPOINTS, or NULL on failure.
+ */
+CAS_ENDPOINTS* cas_endpoints_new();
+
+/**
+ *	Destroy an endpoint set. Every handle using it must have been destroyed with cas_zap(), or given other endpoints, first.
+ */
+void cas_endpoints_zap( CAS_ENDPOINTS* endpoints );
+
+/**
+ *	Add a CAS server to an endpoint set, up to 32.
+ *  @param endpoints a CAS_ENDPOINTS supplied by cas_endpoints_new().
+ *  @param base_url scheme, host and optional port of the server, such as "https://cas2.example.edu:8443".
+ *  @return CAS_VALIDATION_SUCCESS, or CAS_INVALID_PARAMETERS if base_url is not a URL or the set is full.
+ */
+CAS_CODE cas_endpoints_add( CAS_ENDPOINTS* endpoints, const char* base_url );
+
+/**
+ *	Set the timeouts of each attempt on an endpoint, after which the validation moves on to the next endpoint.
+ *  @param endpoints a CAS_ENDPOINTS supplied by cas_endpoints_new().
+ *  @param connect_timeout_ms time allowed to connect, 0 for cURL's default. Default: CAS_DEFAULT_ENDPOINT_CONNECT_TIMEOUT_MS.
+ *  @param attempt_timeout_ms time allowed for the whole attempt, 0 for none (default).
+ */
+void cas_endpoints_set_timeouts( CAS_ENDPOINTS* endpoints, long connect_timeout_ms, long attempt_timeout_ms );
+
+/**
+ *	Set the circuit breaker of every endpoint of a set. After failures consecutive failed attempts an endpoint is taken out of rotation, and probed in the background every cooldown_ms until it answers again. Probes use the CA and server certificate validation of the handle of the first validation on the set.
+ *  @param endpoints a CAS_ENDPOINTS supplied by cas_endpoints_new().
+ *  @param failures consecutive failures that open the breaker, 0 to never open it. Default: CAS_DEFAULT_BREAKER_FAILURES.
+ *  @param cooldown_ms time between probes of an open endpoint. Default: CAS_DEFAULT_BREAKER_COOLDOWN_MS.
+ */
+void cas_endpoints_set_breaker( CAS_ENDPOINTS* endpoints, int failures, long cooldown_ms );
+
+/**
+ *	Set the admission control of every endpoint of a set, so that a slow CAS server is not buried under ever more concurrent requests. Each attempt on an endpoint must take a token from a bucket refilled at rate per second, and find fewer than max_in_flight attempts in flight on it. A blocking validation (cas_cas1_validate(), cas_cas2_servicevalidate(), cas_cas3_servicevalidate(), cas_prepared_validate()) that finds neither waits for them, among at most max_queued others, for queue_timeout_ms or until its deadline; anything else (a failover, a hedge, a validation of a CAS_BATCH or CAS_ASYNC) is admitted at once or not at all. A validation not admitted fails with CAS_OVERLOADED, without failing over, so that the other endpoints do not take the load of the one shedding it. The second request of a hedged validation that is not admitted is simply not sent.
+ *  @param endpoints a CAS_ENDPOINTS supplied by cas_endpoints_new().
+ *  @param rate attempts per second, 0 for no limit (default).
+ *  @param burst tokens the bucket holds, attempts that may start at once after a quiet spell, at least 1.
+ *  @param max_in_flight attempts in flight on an endpoint at once, 0 for no limit (default).
+ *  @param max_queued blocking validations waiting for each endpoint at once, beyond which they are shed, 0 to never wait (default).
+ *  @param queue_timeout_ms time a blocking validation waits to be admitted.
+ */
+void cas_endpoints_set_admission( CAS_ENDPOINTS* endpoints, double rate, int burst, int max_in_flight, int max_queued, long queue_timeout_ms );
+
+/**
+ *	Retrieve the health of an endpoint of a set.
+ *  @param endpoints a CAS_ENDPOINTS supplied by cas_endpoints_new().
+ *  @param index the endpoint, in the order they were added from 0.
+ *  @param stats receives the health of the endpoint.
+ *  @return CAS_VALIDATION_SUCCESS, or CAS_INVALID_PARAMETERS if there is no such endpoint.
+ */
+CAS_CODE cas_endpoints_get_stats( CAS_ENDPOINTS* endpoints, int index, CAS_ENDPOINT_STATS* stats );
+
+/**
+ *	Validate on the endpoints of a set (or NULL, the default, for exactly the URL given). The scheme, host and port of every validation URL are replaced by those of the endpoint with the lowest latency, weighted by error rate, whose breaker is closed. If it cannot be reached, times out or answers with a 5xx status, the validation is retried on the next best endpoint until none is left, and only then fails with CAS_CURL_FAILURE. Applies to every kind of validation.
+ *  @param cas a CAS handle supplied by cas_new().
+ *  @param endpoints a CAS_ENDPOINTS supplied by cas_endpoints_new(), which must outlive the handle, or NULL.
+ */
+void cas_set_endpoints( CAS* cas, CAS_ENDPOINTS* endpoints );
+
+/**
+ *	Create a session cache in shared memory, mapping session IDs to the principal they were validated for, so that every worker process of a host sees the sessions any of them validated. With path NULL the cache is anonymous shared memory, shared with the processes forked afterwards: create it in the parent, next to cas_init(), before forking the workers. With a path, the cache is a file that any process mapping it shares, created and sized by the first (on tmpfs, such as /dev/shm, it never touches a disk); capacity then only applies to a new file. The cache is a fixed size: once full, sessions not used recently are evicted to make room.
+ *  @param path file of the cache, or NULL for anonymous shared memory.
+ *  @param capacity sessions to hold, rounded up to a multiple of 8. Each takes about 400 bytes.
+ *  @return a new CAS_SESSIONS, or NULL on failure (including a file that is not a session cache of this version of libcas).
+ */
+CAS_SESSIONS* cas_sessions_new( const char* path, size_t capacity );
+
+/**
+ *	Detach from a session cache. The cache lives on in the other processes sharing it, and in its file if it has one.
+ */
+void cas_sessions_zap( CAS_SESSIONS* sessions );
+
+/**
+ *	Store the principal of a session, replacing any it had. May be called from any thread of any process sharing the cache.
+ *  @param sessions a CAS_SESSIONS supplied by cas_sessions_new().
+ *  @param session_id the session ID, shorter than CAS_SESSION_ID_MAX.
+ *  @param principal the principal, such as cas_get_principal() after a successful validation, shorter than CAS_SESSION_PRINCIPAL_MAX.
+ *  @param ttl_seconds time until the session expires.
+ *  @return CAS_VALIDATION_SUCCESS, or CAS_INVALID_PARAMETERS.
+ */
+CAS_CODE cas_sessions_put( CAS_SESSIONS* sessions, const char* session_id, const char* principal, long ttl_seconds );
+
+/**
+ *	Look up the principal of a session. May be called from any thread of any process sharing the cache.
+ *  @param sessions a CAS_SESSIONS supplied by cas_sessions_new().
+ *  @param session_id the session ID.
+ *  @param principal receives the principal.
+ *  @param size size of principal; CAS_SESSION_PRINCIPAL_MAX always suffices.
+ *  @return CAS_VALIDATION_SUCCESS, CAS_SESSION_UNKNOWN if the session is not in the cache or has expired, or CAS_INVALID_PARAMETERS.
+ */
+CAS_CODE cas_sessions_get( CAS_SESSIONS* sessions, const char* session_id, char* principal, size_t size );
+
+/**
+ *	Forget a session, such as on logout.
+ */
+void cas_sessions_remove( CAS_SESSIONS* sessions, const char* session_id );
+
+/**
+ *	Retrieve the counters of a session cache, summed over every process sharing it.
+ *  @return CAS_VALIDATION_SUCCESS, or CAS_INVALID_PARAMETERS.
+ */
+CAS_CODE cas_sessions_get_stats( CAS_SESSIONS* sessions, CAS_SESSIONS_STATS* stats );
+
+/**
+ *	Create a thread-safe pool of CAS handles. Handles from one pool share DNS cache, TLS sessions and connections.
+ *  @return a new, empty CAS_POOL, or NULL on failure.
+ */
+CAS_POOL* cas_pool_new();
+
+/**
+ *	Destroy a pool and its idle handles. Every handle taken from the pool must have been returned with cas_pool_put() (or destroyed with cas_zap()) first.
+ */
+void cas_pool_zap( CAS_POOL* pool );
+
+/**
+ *	Take a handle from the pool. May be called from any thread.
+ *  @param pool a CAS_POOL supplied by cas_pool_new().
+ *  @return a CAS handle for use by the calling thread until returned with cas_pool_put(), or NULL on failure.
+ */
+CAS* cas_pool_get( CAS_POOL* pool );
+
+/**
+ *	Return a handle taken with cas_pool_get() to the pool. May be called from any thread.
+ */
+void cas_pool_put( CAS_POOL* pool, CAS* cas );
+
+/**
+ *	Set the certificate authority, or the server certificate validation flag, of every handle the pool hands out. See cas_set_ssl_ca() and cas_set_ssl_validate_server().
+ */
+void cas_pool_set_ssl_ca( CAS_POOL* pool, const char* capath );
+void cas_pool_set_ssl_validate_server( CAS_POOL* pool, int verify );
+
+/**
+ *	Set the endpoints of every handle the pool hands out. See cas_set_endpoints().
+ */
+void cas_pool_set_endpoints( CAS_POOL* pool, CAS_ENDPOINTS* endpoints );
+
+/**
+ *	Prewarm a pool: n handles each open a connection to every endpoint at once, as cas_prewarm() does, then go back to the pool idle, so that n validations at once find a live connection waiting. Set the SSL options and endpoints of the pool first. May be called from any thread.
+ *  @param pool a CAS_POOL supplied by cas_pool_new().
+ *  @param url a validation URL, such as "https://cas.example.edu/cas/serviceValidate".
+ *  @param n number of connections to open to each endpoint.
+ *  @return CAS_VALIDATION_SUCCESS if every endpoint answered every request, CAS_CURL_FAILURE if any could not be reached, or CAS_INVALID_PARAMETERS.
+ */
+CAS_CODE cas_pool_prewarm( CAS_POOL* pool, const char* url, int n );
+
+/**
+ *	Keep the connections of cas_pool_prewarm() alive: a background thread warms them again every interval through the handles idle at the time, so that neither the server nor cURL closes them for being idle. Pick an interval below the keep-alive timeout of the CAS server.
+ *  @param pool a CAS_POOL supplied by cas_pool_new().
+ *  @param interval_ms time between rounds, 0 to stop (default).
+ */
+void cas_pool_set_keepalive( CAS_POOL* pool, long interval_ms );
+
 #endif
 
 #ifdef DEBUG
@@ -8,99 +8,167 @@
 #include "cas.h"
 #include "cas-int.h"
 
-typedef struct {
-	size_t size;
-	char* contents;
-} CAS_BUFFER;
+/*******************************************************************************
+ * cas1 response state machine, driven a chunk at a time as the response
+ *  arrives.  A CAS1 response is "yes\n<principal>\n" or "no\n\n", so the
+ *  answer is known from its first line and the principal is complete at the
+ *  end of the second; nothing after that is read.  The principal is kept in
+ *  the handle's principal buffer, which is reused, so once warm a CAS1
+ *  validation allocates nothing.
+ *
+ * [READ_ANSWER, "yes\n"] -> [READ_USER, NULL]
+ * [READ_ANSWER, "no\n\n"] -> [NO, NULL]
+ * [READ_ANSWER, other] -> [FAIL, NULL]
+ * [READ_USER, '\n' or '\0'] -> [YES, NULL]
+ * [READ_USER, other] -> [READ_USER, append(principal)]
+ */
+static void
+cas_cas1_parse( CAS* cas, const char* chunk, size_t size ) {
+	CAS_CAS1_STATE* cas1=&cas->cas1;
+	const char* p=chunk;
+	const char* end=chunk+size;
+
+	while( p<end && cas1->state==CAS1_READ_ANSWER ) {
+		if( cas1->answer==NULL ) {
+			cas1->answer=( *p=='y' ? "yes\n" : *p=='n' ? "no\n\n" : NULL );
+			if( cas1->answer==NULL ) {
+				cas1->state=CAS1_FAIL;
+				return;
+			}
+		}
+		if( *p++!=cas1->answer[cas1->matched++] ) {
+			cas1->state=CAS1_FAIL;
+		} else if( cas1->answer[cas1->matched]=='\0' ) {
+			cas1->state=( cas1->answer[0]=='y' ? CAS1_READ_USER : CAS1_NO );
+		}
+	}
+
+	if( p<end && cas1->state==CAS1_READ_USER ) {
+		const char* user=p;
+		while( p<end && *p!='\n' && *p!='\0' ) p++;
+
+		//The principal is only pointed at once complete, by finish
+		char* principal;
+		if( cas_result_append( &cas->principal_buffer,&principal,user,p-user )!=CAS_VALIDATION_SUCCESS ) {
+			cas1->state=CAS1_ENOMEM;
+			return;
+		}
+		cas1->user_read=1;
+
+		if( p<end ) {
+			cas1->state=CAS1_YES;
+		}
+	}
+}
 
 /*******************************************************************************
  * cas1_curl_callback: cURL callback accepting received data
  */
 static size_t
-cas_cas1_curl_callback( char* ptr, size_t size, size_t nmemb, CAS_BUFFER* buffer ) {
+cas_cas1_curl_callback( char* chunk, size_t size, size_t nmemb, CAS* cas ) {
 	size_t write_size=size*nmemb;
-	
-	void* tmp=buffer->contents;
-	if((buffer->contents=realloc( buffer->contents, buffer->size+write_size ))){
-		memcpy( &buffer->contents[buffer->size],ptr,write_size );
-
-		buffer->size=buffer->size+write_size;
-		return( write_size );
-	}else{
-		free(tmp);
-		return(0);
+	CAS_CAS1_STATE* cas1=&cas->cas1;
+
+	if( !cas_response_admit( cas,write_size ) ) {
+		return( 0 );
+	}
+
+	//Once the answer is known the rest of the response is not waited for
+	if( cas1->state!=CAS1_READ_ANSWER && cas1->state!=CAS1_READ_USER ) {
+		cas->abort=CAS_ABORT_PARSED;
+		return( 0 );
 	}
+
+	double start=cas_clock_us();
+	cas_cas1_parse( cas,chunk,write_size );
+	cas->timings.parse_us+=cas_clock_us()-start;
+
+	if( cas1->state==CAS1_FAIL || cas1->state==CAS1_ENOMEM ) {
+		cas->abort=CAS_ABORT_PARSED;
+		return( 0 );
+	}
+	return( write_size );
 }
 
 /*******************************************************************************
- * cas_cas1_validate: Perform CAS1 validation protocol, parsing cas->buffer
- *  to obtain principal and store it in cas->principal.
+ * cas_cas1_start: Set up cas->curl for CAS1 validation of the complete
+ *  validation URL, without performing it
  */
 CAS_CODE
-cas_cas1_validate( CAS* cas, char* cas1_validate_url, char* escaped_service, char* ticket, int renew) {
-	if(!cas && cas1_validate_url && escaped_service && ticket) {
-		return(CAS_INVALID_PARAMETERS);
-	}
-	CAS_BUFFER buffer= {0,NULL};
-	
-	buffer.contents=malloc( 1*sizeof( char ) );
-	if(buffer.contents==NULL){
-		return(CAS_ENOMEM);
-	}
-	strcpy( buffer.contents,"" );
+cas_cas1_start( CAS* cas, const char* url ) {
+	cas_result_clear( cas );
+	cas_attributes_clear( &cas->attributes );
+	cas->code=CAS_FAIL;
+	cas->stats.validations++;
+
+	cas->cas1.state=CAS1_READ_ANSWER;
+	cas->cas1.answer=NULL;
+	cas->cas1.matched=0;
+	cas->cas1.user_read=0;
+
+	cas_debug("URL: %s",url);
+	//Setup curl connection, cURL keeps its own copy of the URL
+	curl_easy_setopt( cas->curl,CURLOPT_URL, url );
+
+	//Set response handler
+	curl_easy_setopt( cas->curl,CURLOPT_WRITEFUNCTION, ( curl_write_callback )cas_cas1_curl_callback );
+
+	//Pass state to response handler
+	curl_easy_setopt( cas->curl,CURLOPT_WRITEDATA, cas );
+
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_cas1_finish: Resolve the CAS_CODE from the state machine once the
+ *  transfer is complete, pointing cas->principal at the principal read.
+ */
+CAS_CODE
+cas_cas1_finish( CAS* cas, CURLcode status ) {
+	CAS_CAS1_STATE* cas1=&cas->cas1;
 	CAS_CODE rc=CAS_FAIL;
 
-	//Build URL for validation
-	//18=strlen("?service=")+strlen("&ticket=")+1
-	//11=strlen("&renew=true")
-	char* url;
-	if(url=calloc( strlen( cas1_validate_url )+strlen( escaped_service )+strlen( ticket )+( renew?29:18 ),sizeof( char ) )){
-		strcpy( url,cas1_validate_url );
-		strcat( url,"?service=" );
-		strcat( url,escaped_service );
-		strcat( url,"&ticket=" );
-		strcat( url,ticket );
-		if(renew) strcat( url, "&renew=true");
-
-		cas_debug("URL: (%d) %s",urllen,url);
-		//Setup curl connection
-		curl_easy_setopt( cas->curl,CURLOPT_URL, url );
-
-		//Set response handler
-		curl_easy_setopt( cas->curl,CURLOPT_WRITEFUNCTION, ( curl_write_callback )cas_cas1_curl_callback );
-
-		//Pass state to response handler
-		curl_easy_setopt( cas->curl,CURLOPT_WRITEDATA, &buffer );
-
-		int status=curl_easy_perform( cas->curl );
-		if( status==0 ) {
-			if( ( buffer.size )==4 && strncmp( buffer.contents,"no\n\n",4 )==0 ) {
-				rc=CAS1_VALIDATION_NO;
-			} else if( buffer.size>4 && strncmp( buffer.contents,"yes\n",4 )==0 ) {
-				int i;
-				for( i=0; ( buffer.contents[4+i]!='\0' && buffer.contents[4+i]!='\n' && i<=buffer.size ); i++ );
-				
-				void* tmp=cas->principal;
-				cas->principal=realloc( cas->principal,( i )*sizeof( char ) );
-				if(cas->principal==NULL){
-					free(tmp);
-					return(CAS_ENOMEM);
-				}
-				strncpy( cas->principal,&buffer.contents[4],i );
-				cas->principal[buffer.size-4]='\0';
+	if( status==CURLE_OK || ( status==CURLE_WRITE_ERROR && cas->abort==CAS_ABORT_PARSED ) ) {
+		switch( cas1->state ) {
+		case CAS1_NO:
+			rc=CAS1_VALIDATION_NO;
+			break;
+		case CAS1_YES:
+		case CAS1_READ_USER: //-- Principal without its newline
+			if( cas1->user_read ) {
+				cas->principal=cas->principal_buffer.contents;
 				rc=CAS_VALIDATION_SUCCESS;
-			}else{
+			} else {
 				rc=CAS_INVALID_RESPONSE;
 			}
-		} else {
-			rc=CAS_CURL_FAILURE;
-			cas->message=strdup(curl_easy_strerror(status));
+			break;
+		case CAS1_ENOMEM:
+			rc=CAS_ENOMEM;
+			break;
+		default:
+			rc=CAS_INVALID_RESPONSE;
 		}
-		
-		
-		free( buffer.contents );
+	} else if( status==CURLE_WRITE_ERROR && cas->abort==CAS_ABORT_LIMIT ) {
+		rc=CAS_RESPONSE_LIMIT;
+	} else {
+		rc=CAS_CURL_FAILURE;
+		const char* message=curl_easy_strerror(status);
+		cas_result_set(&cas->message_buffer,&cas->message,message,strlen(message));
+	}
+
+	cas->code=rc;
+	return( rc );
+}
+
+/*******************************************************************************
+ * cas_cas1_validate: Perform CAS1 validation protocol, the state machine
+ *  reading the principal into cas->principal_buffer as the response arrives.
+ */
+CAS_CODE
+cas_cas1_validate( CAS* cas, char* cas1_validate_url, char* escaped_service, char* ticket, int renew) {
+	CAS_CODE rc=cas_start( cas,CAS_PROTOCOL_CAS1,cas1_validate_url,escaped_service,ticket,renew );
+	if( rc!=CAS_VALIDATION_SUCCESS ) {
 		return( rc );
-	}else{ //ENOMEM for url calloc
-		return(CAS_ENOMEM);
 	}
+	return( cas_perform( cas,cas->url.contents ) );
 }
@@ -4,7 +4,9 @@
  * CAS2 protocol handler
  * 
  * Why SAX instead of DOM?:
- * - Easy to prevent attack by never-ending XML (TODO)
+ * - Easy to prevent attack by never-ending XML: the response size and element
+ *   depth are limited, and a streamed response is cut off as soon as the
+ *   state machine fails, or once it is complete and the server keeps sending
  * - Easy to validate XML without an XML schema, and only as much as necessary
  * - I like hand- graphing and coding simple state machines
  */
@@ -29,6 +31,14 @@
  * 
  * [NEED_CLOSEAUTHENTICATIONSUCCESS_WS, WS] -> [NEED_CLOSEAUTHENTICATIONSUCCESS_WS, NULL]
  * [NEED_CLOSEAUTHENTICATIONSUCCESS_WS, CLOSEAUTHENTICATIONSUCCESS] -> [NEED_CLOSESERVICERESPONSE_WS,NULL]
+ * [NEED_CLOSEAUTHENTICATIONSUCCESS_WS, OPENATTRIBUTES] -> [NEED_OPENATTRIBUTE_CLOSEATTRIBUTES_WS, NULL]
+ *
+ * [NEED_OPENATTRIBUTE_CLOSEATTRIBUTES_WS, WS] -> [NEED_OPENATTRIBUTE_CLOSEATTRIBUTES_WS, NULL]
+ * [NEED_OPENATTRIBUTE_CLOSEATTRIBUTES_WS, OPEN<name>] -> [NEED_ATTRIBUTECHARACTERS_CLOSE<name>, begin(attributes,name)]
+ * [NEED_OPENATTRIBUTE_CLOSEATTRIBUTES_WS, CLOSEATTRIBUTES] -> [NEED_CLOSEAUTHENTICATIONSUCCESS_WS, NULL]
+ *
+ * [NEED_ATTRIBUTECHARACTERS_CLOSE<name>, CHARACTERS] -> [NEED_ATTRIBUTECHARACTERS_CLOSE<name>, append(attributes,CHARACTERS)]
+ * [NEED_ATTRIBUTECHARACTERS_CLOSE<name>, CLOSE<name>] -> [NEED_OPENATTRIBUTE_CLOSEATTRIBUTES_WS, end(attributes,name)]
  *
  * [NEED_FAILUREMESSAGE, CHARACTERS] -> [NEED_FAILUREMESSAGE, append(message, CHARACTERS)]
  * [NEED_FAILUREMESSAGE, CLOSEAUTHENTICATIONFAILURE] -> [NEED_CLOSESERVICERESPONSE,NULL]
@@ -39,10 +49,14 @@
  * 
  * [NEED_ENDDOC_WS,WS] -> [NEED_ENDDOC_WS,NULL]
  * [NEED_ENDDOC_WS,ENDDOC] -> [COMPLETE,COMPLETE]
+ *
+ * Elements of any other namespace are skipped, along with everything in them,
+ * wherever they appear.
  */
 
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 #include <curl/curl.h>
 #include <libxml/parser.h>
@@ -55,32 +69,66 @@
 #include "cas.h"
 #include "cas-int.h"
 
-typedef struct {
-	CAS* cas;
-	enum {
-		XML_FAIL=-1,
-		XML_NEED_START_DOC=0,
-		XML_NEED_OPEN_SERVICERESPONSE,
-		XML_NEED_OPEN_AUTHENTICATIONSUCCESS_AUTHENTICATIONFAILURE,
-		XML_NEED_OPEN_USER,
-		XML_READ_USER,
-		XML_NEED_CLOSE_USER,
-		XML_NEED_CLOSE_AUTHENTICATIONSUCCESS,
-		XML_READ_FAILUREMESSAGE,
-		XML_NEED_CLOSE_SERVICERESPONSE,
-		XML_NEED_END_DOC,
-		XML_COMPLETE,
-	} xml_state;
-} CAS_XML_STATE;
+#define CAS2_NAMESPACE "http://www.yale.edu/tp/cas"
 
+//Responses up to this size are buffered for the fast path, larger ones are
+// streamed into libxml2 as they arrive
+#define CAS2_FASTPATH_MAX 8192
+#define CAS2_FASTPATH_NAME_MAX 64
+#define CAS2_FASTPATH_DEPTH_MAX 16
+
+static CAS_CODE cas_cas2_parser( CAS* cas );
 
 /*******************************************************************************
  * cas2_curl_callback: cURL callback accepting received data
  */
 static size_t
-cas_cas2_curl_callback( char* chunk, size_t size, size_t nmemb, xmlParserCtxtPtr ctx ) {
+cas_cas2_curl_callback( char* chunk, size_t size, size_t nmemb, CAS* cas ) {
 	size_t write_size=size*nmemb;
-	xmlParseChunk( ctx,chunk,write_size,0 );
+
+	if( !cas_response_admit( cas,write_size ) ) {
+		return( 0 );
+	}
+	if( !cas->xml_streaming ) {
+		if( cas->buffer.size+write_size<=CAS2_FASTPATH_MAX ) {
+			if( cas_buffer_reserve( &cas->buffer,cas->buffer.size+write_size+1 )!=CAS_VALIDATION_SUCCESS ) {
+				return( 0 );
+			}
+			memcpy( &cas->buffer.contents[cas->buffer.size],chunk,write_size );
+			cas->buffer.size+=write_size;
+			return( write_size );
+		}
+
+		//Too large for the fast path: hand over what was buffered and stream the rest
+		cas_debug("Streaming to libxml2 after %lu bytes",(unsigned long)cas->buffer.size);
+		cas->xml_streaming=1;
+		if( cas_cas2_parser( cas )!=CAS_VALIDATION_SUCCESS ) {
+			return( 0 );
+		}
+		if( cas->buffer.size ) {
+			double start=cas_clock_us();
+			if( xmlParseChunk( cas->xml_ctx,cas->buffer.contents,cas->buffer.size,0 )!=0 ) cas->xml_error=1;
+			cas->timings.parse_us+=cas_clock_us()-start;
+			cas->buffer.size=0;
+		}
+	}
+
+	//Once the root element is closed nothing more can change the result, so
+	// a server that keeps sending is cut off rather than waited for
+	if( cas->xml.xml_state==XML_NEED_END_DOC ) {
+		cas->abort=CAS_ABORT_PARSED;
+		return( 0 );
+	}
+
+	double start=cas_clock_us();
+	if( !cas->xml_error && xmlParseChunk( cas->xml_ctx,chunk,write_size,0 )!=0 ) cas->xml_error=1;
+	cas->timings.parse_us+=cas_clock_us()-start;
+
+	if( cas->xml_error || cas->xml.xml_state==XML_FAIL ) {
+		cas_debug("Response failed, aborting (%d)",cas->xml.xml_state);
+		cas->abort=CAS_ABORT_PARSED;
+		return( 0 );
+	}
 	return( write_size );
 }
 
@@ -186,6 +234,67 @@ cas_cas2_end_cas_user( CAS_XML_STATE* ctx, const xmlChar* localname, const xmlCh
 	}
 }
 
+static void
+cas_cas2_start_cas_attributes( CAS_XML_STATE* ctx, const xmlChar* localname, const xmlChar* prefix,const xmlChar* URI,int nb_namespaces,const xmlChar** namespaces,int nb_attributes,int nb_defaulted,const xmlChar** attributes ) {
+	switch(ctx->xml_state){
+	case XML_NEED_CLOSE_AUTHENTICATIONSUCCESS:
+		cas_debug( "XML_NEED_CLOSE_AUTHENTICATIONSUCCESS->XML_NEED_OPEN_ATTRIBUTE" );
+		ctx->xml_state=XML_NEED_OPEN_ATTRIBUTE;
+		break;
+	default:
+		ctx->xml_state=XML_FAIL;
+		cas_debug( "XML_FAIL:(%d)",ctx->xml_state );
+	}
+}
+
+static void
+cas_cas2_end_cas_attributes( CAS_XML_STATE* ctx, const xmlChar* localname, const xmlChar* prefix, const xmlChar* URI ) {
+	switch(ctx->xml_state){
+	case XML_NEED_OPEN_ATTRIBUTE:
+		cas_debug( "XML_NEED_OPEN_ATTRIBUTE->XML_NEED_CLOSE_AUTHENTICATIONSUCCESS" );
+		ctx->xml_state=XML_NEED_CLOSE_AUTHENTICATIONSUCCESS;
+		break;
+	default:
+		ctx->xml_state=XML_FAIL;
+		cas_debug( "XML_FAIL:(%d)",ctx->xml_state );
+	}
+}
+
+//Every element inside <cas:attributes> is an attribute, whatever its name
+static void
+cas_cas2_start_cas_attribute( CAS_XML_STATE* ctx, const xmlChar* localname, const xmlChar* prefix,const xmlChar* URI,int nb_namespaces,const xmlChar** namespaces,int nb_attributes,int nb_defaulted,const xmlChar** attributes ) {
+	switch(ctx->xml_state){
+	case XML_NEED_OPEN_ATTRIBUTE:
+		cas_debug( "XML_NEED_OPEN_ATTRIBUTE->XML_READ_ATTRIBUTE" );
+		if( cas_attributes_begin( &ctx->cas->attributes,( const char* )localname )==CAS_VALIDATION_SUCCESS ) {
+			ctx->xml_state=XML_READ_ATTRIBUTE;
+		} else {
+			ctx->xml_state=XML_FAIL;
+		}
+		break;
+	default:
+		ctx->xml_state=XML_FAIL;
+		cas_debug( "XML_FAIL:(%d)",ctx->xml_state );
+	}
+}
+
+static void
+cas_cas2_end_cas_attribute( CAS_XML_STATE* ctx, const xmlChar* localname, const xmlChar* prefix, const xmlChar* URI ) {
+	switch(ctx->xml_state){
+	case XML_READ_ATTRIBUTE:
+		cas_debug( "XML_READ_ATTRIBUTE->XML_NEED_OPEN_ATTRIBUTE" );
+		if( cas_attributes_end( &ctx->cas->attributes,( const char* )localname )==CAS_VALIDATION_SUCCESS ) {
+			ctx->xml_state=XML_NEED_OPEN_ATTRIBUTE;
+		} else {
+			ctx->xml_state=XML_FAIL;
+		}
+		break;
+	default:
+		ctx->xml_state=XML_FAIL;
+		cas_debug( "XML_FAIL:(%d)",ctx->xml_state );
+	}
+}
+
 static void
 cas_cas2_end_cas_authenticationSuccess( CAS_XML_STATE* ctx, const xmlChar* localname, const xmlChar* prefix, const xmlChar* URI ) {
 	switch(ctx->xml_state){
@@ -229,8 +338,22 @@ cas_cas2_end_cas_serviceResponse( CAS_XML_STATE* ctx, const xmlChar* localname,
 static void
 cas_cas2_startElementNs( CAS_XML_STATE* ctx, const xmlChar* localname, const xmlChar* prefix,const xmlChar* URI,int nb_namespaces,const xmlChar** namespaces,int nb_attributes,int nb_defaulted,const xmlChar** attributes ) {
 	cas_debug( "(%d) <(%s)%s:%s>",ctx->xml_state,prefix,URI,localname );
-	if( strncasecmp( "http://www.yale.edu/tp/cas", URI, 26 )==0 ) {
-		if ( strncasecmp( "serviceResponse",localname,15 )==0 ) {
+	if( ++ctx->depth>ctx->cas->max_response_depth && ctx->cas->max_response_depth ) {
+		cas_debug( "XML_FAIL: deeper than %d",ctx->cas->max_response_depth );
+		ctx->xml_state=XML_FAIL;
+		ctx->too_deep=1;
+		return;
+	}
+	if( ctx->foreign_depth ) {
+		return;
+	}
+	if( URI==NULL || strncasecmp( "http://www.yale.edu/tp/cas", URI, 26 )!=0 ) {
+		cas_debug( "Skipping <%s> of another namespace",localname );
+		ctx->foreign_depth=ctx->depth;
+	} else {
+		if ( ctx->xml_state==XML_NEED_OPEN_ATTRIBUTE || ctx->xml_state==XML_READ_ATTRIBUTE ) {
+			cas_cas2_start_cas_attribute( ctx,localname,prefix,URI,nb_namespaces,namespaces,nb_attributes,nb_defaulted, attributes );
+		} else if ( strncasecmp( "serviceResponse",localname,15 )==0 ) {
 			cas_cas2_start_cas_serviceResponse( ctx,localname,prefix,URI,nb_namespaces,namespaces,nb_attributes,nb_defaulted, attributes );
 		} else if ( strncasecmp( "authenticationSuccess",localname,21 )==0 ) {
 			cas_cas2_start_cas_authenticationSuccess( ctx,localname,prefix,URI,nb_namespaces,namespaces,nb_attributes,nb_defaulted, attributes );
@@ -238,6 +361,8 @@ cas_cas2_startElementNs( CAS_XML_STATE* ctx, const xmlChar* localname, const xml
 			cas_cas2_start_cas_authenticationFailure( ctx,localname,prefix,URI,nb_namespaces,namespaces,nb_attributes,nb_defaulted, attributes );
 		} else if ( strncasecmp( "user",localname,4 )==0 ) {
 			cas_cas2_start_cas_user( ctx,localname,prefix,URI,nb_namespaces,namespaces,nb_attributes,nb_defaulted, attributes );
+		} else if ( strncasecmp( "attributes",localname,11 )==0 ) {
+			cas_cas2_start_cas_attributes( ctx,localname,prefix,URI,nb_namespaces,namespaces,nb_attributes,nb_defaulted, attributes );
 		} else {
 			ctx->xml_state=XML_FAIL;
 			cas_debug( "XML_FAIL:(%d)",ctx->xml_state );
@@ -248,8 +373,17 @@ cas_cas2_startElementNs( CAS_XML_STATE* ctx, const xmlChar* localname, const xml
 static void
 cas_cas2_endElementNs( CAS_XML_STATE* ctx, const xmlChar* localname, const xmlChar* prefix, const xmlChar* URI ) {
 	cas_debug( "(%d) </(%s)%s:%s>",ctx->xml_state,prefix,URI,localname );
-	if( strncasecmp( "http://www.yale.edu/tp/cas", URI, 26 )==0 ) {
-		if ( strncasecmp( "serviceResponse",localname,15 )==0 ) {
+	if( ctx->foreign_depth ) {
+		if( ctx->depth--==ctx->foreign_depth ) {
+			ctx->foreign_depth=0;
+		}
+		return;
+	}
+	ctx->depth--;
+	if( URI && strncasecmp( "http://www.yale.edu/tp/cas", URI, 26 )==0 ) {
+		if ( ctx->xml_state==XML_READ_ATTRIBUTE ) {
+			cas_cas2_end_cas_attribute( ctx,localname,prefix,URI );
+		} else if ( strncasecmp( "serviceResponse",localname,15 )==0 ) {
 			cas_cas2_end_cas_serviceResponse( ctx,localname,prefix,URI );
 		} else if ( strncasecmp( "authenticationSuccess",localname,21 )==0 ) {
 			cas_cas2_end_cas_authenticationSuccess( ctx,localname,prefix,URI );
@@ -257,6 +391,8 @@ cas_cas2_endElementNs( CAS_XML_STATE* ctx, const xmlChar* localname, const xmlCh
 			cas_cas2_end_cas_authenticationFailure( ctx,localname,prefix,URI );
 		} else if ( strncasecmp( "user",localname,4 )==0 ) {
 			cas_cas2_end_cas_user( ctx,localname,prefix,URI );
+		} else if ( strncasecmp( "attributes",localname,11 )==0 ) {
+			cas_cas2_end_cas_attributes( ctx,localname,prefix,URI );
 		} else {
 			ctx->xml_state=XML_FAIL;
 			cas_debug( "XML_FAIL:(%d)",ctx->xml_state );
@@ -267,41 +403,26 @@ cas_cas2_endElementNs( CAS_XML_STATE* ctx, const xmlChar* localname, const xmlCh
 static void
 cas_cas2_characters( CAS_XML_STATE* ctx, const xmlChar* ch, int len ) {
 	int i;
+	if( ctx->foreign_depth ) {
+		return;
+	}
 	switch( ctx->xml_state ) {
 	case XML_READ_USER:
-		if( !ctx->cas->principal ) {
-			ctx->cas->principal=calloc( len+1,sizeof( char ) );
-			if(ctx->cas->principal==NULL) return;
-			strncpy( ctx->cas->principal,ch,len );
-			ctx->cas->principal[len]='\0';
-		} else {
-			void* tmp=ctx->cas->principal;
-			ctx->cas->principal=realloc( ctx->cas->principal,strlen( ctx->cas->principal )+len+1 );
-			if(ctx->cas->principal==NULL){
-				free(tmp);
-				return;
-			}
-			strncat( ctx->cas->principal,ch,len );
+		if( cas_result_append( &ctx->cas->principal_buffer,&ctx->cas->principal,( const char* )ch,len )!=CAS_VALIDATION_SUCCESS ) {
+			ctx->xml_state=XML_FAIL;
 		}
 	break;
 	case XML_READ_FAILUREMESSAGE:
-		if( !ctx->cas->message ) {
-			ctx->cas->message=calloc( len+1,sizeof( char ) );
-			if(ctx->cas->message==NULL) return;
-			strncpy( ctx->cas->message,ch,len );
-			ctx->cas->message[len]='\0';
-		} else {
-			
-			void* tmp=ctx->cas->message;
-			ctx->cas->message=realloc( ctx->cas->message,strlen( ctx->cas->message )+len+1 );
-			if(ctx->cas->message==NULL){
-				free(tmp);
-				return;
-			}
-			strncat( ctx->cas->message,ch,len );
-		}	
+		if( cas_result_append( &ctx->cas->message_buffer,&ctx->cas->message,( const char* )ch,len )!=CAS_VALIDATION_SUCCESS ) {
+			ctx->xml_state=XML_FAIL;
+		}
 		cas_debug("MESSAGE=%s",ctx->cas->message);
 	break;
+	case XML_READ_ATTRIBUTE:
+		if( cas_attributes_append( &ctx->cas->attributes,( const char* )ch,len )!=CAS_VALIDATION_SUCCESS ) {
+			ctx->xml_state=XML_FAIL;
+		}
+	break;
 	default: //If unexpected characters are not whitespace, XML_FAIL
 		for( i=0; i<len; i++ ) {
 			if( !isspace( ch[i] ) ) ctx->xml_state=XML_FAIL;
@@ -321,70 +442,303 @@ cas_cas2_endDocument( CAS_XML_STATE* ctx ) {
 }
 
 /*******************************************************************************
- * cas_cas2_servicevalidate: Perform CAS2 validation protocol
+ * cas2 fast path: a scanner for the canonical CAS2 response documents, driving
+ *  the SAX handlers above directly from the buffered response without libxml2
+ *  or any allocation.  It only accepts the plain subset that CAS servers
+ *  actually send: one namespace prefix declared on the root, elements in that
+ *  namespace, the authenticationFailure code attribute, and ASCII text without
+ *  entities or CRs.  Anything else (XML declaration, comments, CDATA, default
+ *  namespaces, self-closing tags, a closing tag that does not match the open
+ *  element, ...) returns -1 and the caller falls back to libxml2 for the whole
+ *  document.
  */
-CAS_CODE
-cas_cas2_servicevalidate( CAS* cas, char* cas2_servicevalidate_url, char* escaped_service, char* ticket, int renew) {
-	if(!cas && cas2_servicevalidate_url && escaped_service && ticket) {
-		return(CAS_INVALID_PARAMETERS);
-	}
-	if(cas->principal) { free(cas->principal);cas->principal=NULL;}
-	
-	xmlSAXHandlerPtr sax=calloc( 1,sizeof( xmlSAXHandler ) );
-	if(sax==NULL) return(CAS_ENOMEM);
-	sax->initialized=XML_SAX2_MAGIC;
-
-	sax->startElementNs=( startElementNsSAX2Func )cas_cas2_startElementNs;
-	sax->endElementNs=( endElementNsSAX2Func )cas_cas2_endElementNs;
-	sax->characters=( charactersSAXFunc )cas_cas2_characters;
-	sax->startDocument=( startDocumentSAXFunc )cas_cas2_startDocument;
-	sax->endDocument=( endDocumentSAXFunc )cas_cas2_endDocument;
-	CAS_XML_STATE state= {cas,XML_NEED_START_DOC};
-
-	xmlParserCtxtPtr ctx=xmlCreatePushParserCtxt( sax, &state, NULL,0,NULL );
-	xmlCtxtUseOptions( ctx,XML_PARSE_NOBLANKS );
-
-//Build URL for validation
-	//18=strlen("?service=")+strlen("&ticket=")+1
-	//11=strlen("&renew=true")
-	char* url;
-	if(url=calloc( strlen( cas2_servicevalidate_url )+strlen( escaped_service )+strlen( ticket )+( renew?29:18 ),sizeof( char ) )){
-		strcpy( url,cas2_servicevalidate_url );
-		strcat( url,"?service=" );
-		strcat( url,escaped_service );
-		strcat( url,"&ticket=" );
-		strcat( url,ticket );
-		if(renew) strcat( url, "&renew=true");
-
-		//Setup curl connection
-		curl_easy_setopt( cas->curl,CURLOPT_URL, url );
-
-		//Set response handler
-		curl_easy_setopt( cas->curl,CURLOPT_WRITEFUNCTION, ( curl_write_callback )cas_cas2_curl_callback );
-
-		//Pass state to response handler
-		curl_easy_setopt( cas->curl,CURLOPT_WRITEDATA, ctx );
-		int curl_status=curl_easy_perform( cas->curl );
-
-		int xmlParseError = xmlParseChunk( ctx,NULL,0,1 );
-		
-		free(sax);
-		free(url);
-		xmlFreeParserCtxt(ctx);
-		if(curl_status==0){
-			if( state.xml_state==XML_COMPLETE ) {
-				return( cas->code );
-			}else if(xmlParseError){
-				return(CAS2_INVALID_XML);
-			}else{
-				return(CAS_INVALID_RESPONSE);
+static int
+cas_cas2_fast_namechar( char c ) {
+	return( ( c>='a' && c<='z' ) || ( c>='A' && c<='Z' ) || ( c>='0' && c<='9' ) || c=='_' || c=='-' || c=='.' );
+}
+
+static int
+cas_cas2_fast_textchar( char c ) {
+	return( ( c>=0x20 && c<0x7f && c!='<' && c!='&' ) || c=='\t' || c=='\n' );
+}
+
+static int
+cas_cas2_fast( CAS* cas, const char* p, size_t size ) {
+	CAS_XML_STATE* ctx=&cas->xml;
+	const char* end=p+size;
+	const xmlChar* URI=( const xmlChar* )CAS2_NAMESPACE;
+	char prefix[CAS2_FASTPATH_NAME_MAX+1]={0};
+	char localname[CAS2_FASTPATH_NAME_MAX+1];
+	const char* open_names[CAS2_FASTPATH_DEPTH_MAX];
+	size_t open_sizes[CAS2_FASTPATH_DEPTH_MAX];
+	int depth=0;
+	int root_done=0;
+
+	cas_cas2_startDocument( ctx );
+
+	while( p<end ) {
+		if( *p!='<' ) {
+			//Character data
+			const char* text=p;
+			while( p<end && cas_cas2_fast_textchar( *p ) ) p++;
+			if( p<end && *p!='<' ) return( -1 );
+
+			if( depth>0 ) {
+				cas_cas2_characters( ctx,( const xmlChar* )text,p-text );
+			} else {
+				while( text<p ) if( !isspace( *text++ ) ) return( -1 );
+			}
+		} else {
+			//Tag: <prefix:localname attributes> or </prefix:localname>
+			int closing=0;
+			const char* code=NULL;
+			const char* code_end=NULL;
+			int nb_attributes=0;
+
+			if( root_done ) return( -1 );
+			if( ++p<end && *p=='/' ) { closing=1; p++; }
+
+			const char* name=p;
+			while( p<end && cas_cas2_fast_namechar( *p ) ) p++;
+			size_t prefix_size=p-name;
+			if( p>=end || *p!=':' || prefix_size==0 || prefix_size>CAS2_FASTPATH_NAME_MAX ) return( -1 );
+			const char* local=++p;
+			while( p<end && cas_cas2_fast_namechar( *p ) ) p++;
+			size_t local_size=p-local;
+			if( local_size==0 || local_size>CAS2_FASTPATH_NAME_MAX ) return( -1 );
+			memcpy( localname,local,local_size );
+			localname[local_size]='\0';
+
+			if( depth==0 && !closing ) {
+				memcpy( prefix,name,prefix_size );
+				prefix[prefix_size]='\0';
+			} else if( strlen( prefix )!=prefix_size || memcmp( prefix,name,prefix_size )!=0 ) {
+				return( -1 );
 			}
+
+			//Attributes: xmlns:<prefix> on the root, code on anything else
+			for( ;; ) {
+				while( p<end && isspace( *p ) ) p++;
+				if( p>=end ) return( -1 );
+				if( *p=='>' ) { p++; break; }
+				if( closing ) return( -1 );
+
+				const char* attr=p;
+				while( p<end && ( cas_cas2_fast_namechar( *p ) || *p==':' ) ) p++;
+				size_t attr_size=p-attr;
+				while( p<end && isspace( *p ) ) p++;
+				if( p>=end || *p!='=' ) return( -1 );
+				p++;
+				while( p<end && isspace( *p ) ) p++;
+				if( p>=end || ( *p!='\'' && *p!='"' ) ) return( -1 );
+				char quote=*p++;
+				const char* value=p;
+				while( p<end && *p!=quote && cas_cas2_fast_textchar( *p ) ) p++;
+				if( p>=end || *p!=quote ) return( -1 );
+				size_t value_size=p-value;
+				p++;
+
+				if( depth==0 && attr_size==6+prefix_size && strncmp( attr,"xmlns:",6 )==0 && memcmp( attr+6,prefix,prefix_size )==0 ) {
+					if( value_size!=strlen( CAS2_NAMESPACE ) || memcmp( value,CAS2_NAMESPACE,value_size )!=0 ) return( -1 );
+					URI=NULL;
+				} else if( depth>0 && attr_size==4 && strncmp( attr,"code",4 )==0 && !code ) {
+					code=value;
+					code_end=value+value_size;
+					nb_attributes=1;
+				} else {
+					return( -1 );
+				}
+			}
+
+			//The root must declare the prefix as the CAS namespace
+			if( depth==0 && !closing ) {
+				if( URI ) return( -1 );
+				URI=( const xmlChar* )CAS2_NAMESPACE;
+			}
+
+			if( closing ) {
+				//The SAX handlers compare names case-insensitively, libxml2 does not
+				if( depth==0 || open_sizes[depth-1]!=local_size || memcmp( open_names[depth-1],local,local_size )!=0 ) return( -1 );
+				cas_cas2_endElementNs( ctx,( const xmlChar* )localname,( const xmlChar* )prefix,URI );
+				if( --depth==0 ) root_done=1;
+			} else {
+				const xmlChar* attributes[5]={ ( const xmlChar* )"code",NULL,NULL,( const xmlChar* )code,( const xmlChar* )code_end };
+				if( depth>=CAS2_FASTPATH_DEPTH_MAX ) return( -1 );
+				cas_cas2_startElementNs( ctx,( const xmlChar* )localname,( const xmlChar* )prefix,URI,0,NULL,nb_attributes,0,attributes );
+				open_names[depth]=local;
+				open_sizes[depth]=local_size;
+				depth++;
+			}
+		}
+
+		if( ctx->xml_state==XML_FAIL ) return( -1 );
+	}
+
+	if( !root_done ) return( -1 );
+	cas_cas2_endDocument( ctx );
+
+	return( ctx->xml_state==XML_COMPLETE ? 0 : -1 );
+}
+
+/*******************************************************************************
+ * cas_cas2_reset: Clear the result and state machine of cas
+ */
+static void
+cas_cas2_reset( CAS* cas ) {
+	cas_result_clear( cas );
+	cas_attributes_clear( &cas->attributes );
+	cas->code=CAS_VALIDATION_SUCCESS;
+
+	cas->xml.cas=cas;
+	cas->xml.xml_state=XML_NEED_START_DOC;
+	cas->xml.depth=0;
+	cas->xml.foreign_depth=0;
+	cas->xml.too_deep=0;
+	cas->xml_error=0;
+}
+
+/*******************************************************************************
+ * cas_cas2_parser: Make the SAX push parser ready for a response, creating it
+ *  on first use.  Resetting it allocates, so it is only done when a response
+ *  is actually handed to libxml2, never for one the fast path parses.
+ */
+static CAS_CODE
+cas_cas2_parser( CAS* cas ) {
+	//The SAX handler and push parser live as long as the handle; after the
+	// first response the parser is only reset
+	if(cas->xml_ctx && xmlCtxtResetPush( cas->xml_ctx,NULL,0,NULL,NULL )!=0) {
+		xmlFreeParserCtxt(cas->xml_ctx);
+		cas->xml_ctx=NULL;
+	}
+	if(cas->xml_ctx==NULL) {
+		memset( &cas->sax,0,sizeof( xmlSAXHandler ) );
+		cas->sax.initialized=XML_SAX2_MAGIC;
+
+		cas->sax.startElementNs=( startElementNsSAX2Func )cas_cas2_startElementNs;
+		cas->sax.endElementNs=( endElementNsSAX2Func )cas_cas2_endElementNs;
+		cas->sax.characters=( charactersSAXFunc )cas_cas2_characters;
+		cas->sax.startDocument=( startDocumentSAXFunc )cas_cas2_startDocument;
+		cas->sax.endDocument=( endDocumentSAXFunc )cas_cas2_endDocument;
+
+		if((cas->xml_ctx=xmlCreatePushParserCtxt( &cas->sax, &cas->xml, NULL,0,NULL ))==NULL){
+			return(CAS_ENOMEM);
+		}
+		xmlCtxtUseOptions( cas->xml_ctx,XML_PARSE_NOBLANKS );
+		cas->stats.parser_contexts++;
+	}
+
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_cas2_result: Resolve the CAS_CODE from the state machine
+ */
+static CAS_CODE
+cas_cas2_result( CAS* cas, int xmlParseError ) {
+	if( cas->xml.xml_state==XML_COMPLETE ) {
+		return( cas->code );
+	}else if( cas->xml.too_deep ){
+		return( CAS_RESPONSE_LIMIT );
+	}else if( xmlParseError || cas->xml_error ){
+		return(CAS2_INVALID_XML);
+	}else{
+		return(CAS_INVALID_RESPONSE);
+	}
+}
+
+/*******************************************************************************
+ * cas_cas2_parse: Parse a complete CAS2 response, with the fast path if
+ *  enabled and libxml2 if not or if the fast path gives up.
+ */
+CAS_CODE
+cas_cas2_parse( CAS* cas, const char* body, size_t size ) {
+	CAS_CODE rc;
+
+	cas_cas2_reset( cas );
+	if( cas->cas2_fastpath && cas_cas2_fast( cas,body,size )==0 ) {
+		cas->stats.fastpath_responses++;
+		return( cas->code );
+	}
+
+	//Start over with libxml2
+	if( cas->cas2_fastpath ) {
+		cas_cas2_reset( cas );
+	}
+	if( ( rc=cas_cas2_parser( cas ) )!=CAS_VALIDATION_SUCCESS ) {
+		return( rc );
+	}
+	int xmlParseError = xmlParseChunk( cas->xml_ctx,body,size,1 );
+
+	return( cas_cas2_result( cas,xmlParseError ) );
+}
+
+/*******************************************************************************
+ * cas_cas2_start: Set up cas->curl and clear the state machine for CAS2
+ *  validation of the complete validation URL, without performing it
+ */
+CAS_CODE
+cas_cas2_start( CAS* cas, const char* url ) {
+	cas_cas2_reset( cas );
+	cas->stats.validations++;
+
+	//Buffer the response for the fast path, or stream it straight to libxml2
+	cas->buffer.size=0;
+	cas->xml_streaming=!cas->cas2_fastpath;
+	if( cas->xml_streaming ) {
+		CAS_CODE rc=cas_cas2_parser( cas );
+		if( rc!=CAS_VALIDATION_SUCCESS ) {
+			return( rc );
+		}
+	}
+
+	//Setup curl connection, cURL keeps its own copy of the URL
+	curl_easy_setopt( cas->curl,CURLOPT_URL, url );
+
+	//Set response handler
+	curl_easy_setopt( cas->curl,CURLOPT_WRITEFUNCTION, ( curl_write_callback )cas_cas2_curl_callback );
+
+	//Pass state to response handler
+	curl_easy_setopt( cas->curl,CURLOPT_WRITEDATA, cas );
+
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_cas2_finish: Parse the buffered response, or terminate the push parser,
+ *  once the transfer is complete and resolve the CAS_CODE from the state
+ *  machine.
+ */
+CAS_CODE
+cas_cas2_finish( CAS* cas, CURLcode curl_status ) {
+	CAS_CODE rc=CAS_FAIL;
+
+	if(curl_status==CURLE_OK || ( curl_status==CURLE_WRITE_ERROR && cas->abort==CAS_ABORT_PARSED )){
+		if( cas->xml_streaming ) {
+			int xmlParseError = xmlParseChunk( cas->xml_ctx,NULL,0,1 );
+			rc=cas_cas2_result( cas,xmlParseError );
 		} else {
-			if(cas->message) { free(cas->message);}
-			cas->message=strdup(curl_easy_strerror(curl_status));
-			return(CAS_CURL_FAILURE);
+			rc=cas_cas2_parse( cas,cas->buffer.contents,cas->buffer.size );
 		}
-	}else{ //ENOMEM for url calloc
-		return(CAS_ENOMEM);
+	} else if( curl_status==CURLE_WRITE_ERROR && cas->abort==CAS_ABORT_LIMIT ) {
+		rc=CAS_RESPONSE_LIMIT;
+	} else {
+		const char* message=curl_easy_strerror(curl_status);
+		cas_result_set(&cas->message_buffer,&cas->message,message,strlen(message));
+		rc=CAS_CURL_FAILURE;
+	}
+
+	cas->code=rc;
+	return( rc );
+}
+
+/*******************************************************************************
+ * cas_cas2_servicevalidate: Perform CAS2 validation protocol
+ */
+CAS_CODE
+cas_cas2_servicevalidate( CAS* cas, char* cas2_servicevalidate_url, char* escaped_service, char* ticket, int renew) {
+	CAS_CODE rc=cas_start( cas,CAS_PROTOCOL_CAS2,cas2_servicevalidate_url,escaped_service,ticket,renew );
+	if( rc!=CAS_VALIDATION_SUCCESS ) {
+		return( rc );
 	}
+	return( cas_perform( cas,cas->url.contents ) );
 }
@@ -0,0 +1,549 @@
+/*******************************************************************************
+ * cas3.c
+ *
+ * CAS3 protocol handler, JSON responses
+ *
+ * CAS3 /p3/serviceValidate answers with the CAS2 XML document (extended with
+ * <cas:attributes>), which cas2.c parses, or with its JSON equivalent when
+ * asked for format=JSON:
+ *
+ * {"serviceResponse":{"authenticationSuccess":{"user":"...","attributes":{"name":["value",...],...}}}}
+ * {"serviceResponse":{"authenticationFailure":{"code":"INVALID_TICKET","description":"..."}}}
+ *
+ * The JSON is read incrementally from the cURL write callback, one chunk at a
+ * time, by a byte-level tokenizer that never builds a tree.  Each container
+ * opened records what it is in the response (serviceResponse,
+ * authenticationSuccess, attributes, ...), so that each complete string or
+ * literal can be routed straight to the principal, failure code, message or
+ * attribute map.  Anything the response does not need (proxyGrantingTicket,
+ * proxies, unknown members) is tokenized and skipped.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <curl/curl.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cas.h"
+#include "cas-int.h"
+
+/*******************************************************************************
+ * cas_cas3_json_push: Append bytes to the string or literal being read
+ */
+static int
+cas_cas3_json_push( CAS_JSON_STATE* json, const char* bytes, size_t size ) {
+	if( cas_buffer_reserve( &json->token,json->token.size+size+1 )!=CAS_VALIDATION_SUCCESS ) {
+		json->state=JSON_FAIL;
+		return( -1 );
+	}
+	memcpy( &json->token.contents[json->token.size],bytes,size );
+	json->token.size+=size;
+	json->token.contents[json->token.size]='\0';
+	return( 0 );
+}
+
+/*******************************************************************************
+ * cas_cas3_json_key_is: Compare the current key of interest
+ */
+static int
+cas_cas3_json_key_is( CAS_JSON_STATE* json, const char* key ) {
+	size_t size=strlen( key );
+	return( json->key.size==size && memcmp( json->key.contents,key,size )==0 );
+}
+
+/*******************************************************************************
+ * cas_cas3_json_context: What a container opened in the current one is
+ */
+static CAS_JSON_CONTEXT
+cas_cas3_json_context( CAS_JSON_STATE* json, char container ) {
+	CAS_JSON_CONTEXT parent=( json->depth ? json->context[json->depth-1] : JSON_IN_ROOT );
+
+	switch( parent ) {
+	case JSON_IN_ROOT:
+		if( container=='{' ) return( JSON_IN_DOCUMENT );
+		break;
+	case JSON_IN_DOCUMENT:
+		if( container=='{' && cas_cas3_json_key_is( json,"serviceResponse" ) ) return( JSON_IN_SERVICERESPONSE );
+		break;
+	case JSON_IN_SERVICERESPONSE:
+		if( container=='{' && cas_cas3_json_key_is( json,"authenticationSuccess" ) ) {
+			if( json->outcome ) json->invalid=1;
+			json->outcome=1;
+			return( JSON_IN_SUCCESS );
+		}
+		if( container=='{' && cas_cas3_json_key_is( json,"authenticationFailure" ) ) {
+			if( json->outcome ) json->invalid=1;
+			json->outcome=-1;
+			return( JSON_IN_FAILURE );
+		}
+		break;
+	case JSON_IN_SUCCESS:
+		if( container=='{' && cas_cas3_json_key_is( json,"attributes" ) ) return( JSON_IN_ATTRIBUTES );
+		break;
+	case JSON_IN_ATTRIBUTES:
+		if( container=='[' ) return( JSON_IN_ATTRIBUTE );
+		break;
+	default:
+		break;
+	}
+	return( JSON_IN_OTHER );
+}
+
+/*******************************************************************************
+ * cas_cas3_json_code: Resolve an authenticationFailure code
+ */
+static CAS_CODE
+cas_cas3_json_code( const char* code ) {
+	if( strcmp( code,"INVALID_REQUEST" )==0 ) {
+		return( CAS2_INVALID_REQUEST );
+	} else if( strcmp( code,"INVALID_TICKET" )==0 || strcmp( code,"INVALID_TICKET_SPEC" )==0 ) {
+		return( CAS2_INVALID_TICKET );
+	} else if( strcmp( code,"INVALID_SERVICE" )==0 ) {
+		return( CAS2_INVALID_SERVICE );
+	} else if( strcmp( code,"INTERNAL_ERROR" )==0 ) {
+		return( CAS2_INTERNAL_ERROR );
+	}
+	return( CAS_INVALID_RESPONSE );
+}
+
+/*******************************************************************************
+ * cas_cas3_json_attribute: Add the token read as a value of the current
+ *  attribute
+ */
+static void
+cas_cas3_json_attribute( CAS* cas ) {
+	CAS_JSON_STATE* json=&cas->json;
+
+	if( json->key.size==0 ) {
+		return;
+	}
+	if( cas_attributes_begin( &cas->attributes,json->key.contents )!=CAS_VALIDATION_SUCCESS
+	 || cas_attributes_append( &cas->attributes,json->token.contents,json->token.size )!=CAS_VALIDATION_SUCCESS
+	 || cas_attributes_end( &cas->attributes,json->key.contents )!=CAS_VALIDATION_SUCCESS ) {
+		json->invalid=1;
+	}
+}
+
+/*******************************************************************************
+ * cas_cas3_json_scalar: Route a complete string or literal by where it is in
+ *  the response
+ */
+static void
+cas_cas3_json_scalar( CAS* cas, int string ) {
+	CAS_JSON_STATE* json=&cas->json;
+	CAS_JSON_CONTEXT context=( json->depth ? json->context[json->depth-1] : JSON_IN_ROOT );
+
+	switch( context ) {
+	case JSON_IN_SUCCESS:
+		if( string && cas_cas3_json_key_is( json,"user" ) ) {
+			if( cas_result_set( &cas->principal_buffer,&cas->principal,json->token.contents,json->token.size )!=CAS_VALIDATION_SUCCESS ) {
+				json->invalid=1;
+			}
+		}
+		break;
+	case JSON_IN_FAILURE:
+		if( string && cas_cas3_json_key_is( json,"code" ) ) {
+			json->code=cas_cas3_json_code( json->token.contents );
+		} else if( string && cas_cas3_json_key_is( json,"description" ) ) {
+			if( cas_result_set( &cas->message_buffer,&cas->message,json->token.contents,json->token.size )!=CAS_VALIDATION_SUCCESS ) {
+				json->invalid=1;
+			}
+		}
+		break;
+	case JSON_IN_ATTRIBUTES:
+	case JSON_IN_ATTRIBUTE:
+		if( string || strcmp( json->token.contents,"null" )!=0 ) {
+			cas_cas3_json_attribute( cas );
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/*******************************************************************************
+ * cas_cas3_json_literal: Check and route a complete true, false, null or number
+ */
+static void
+cas_cas3_json_literal( CAS* cas ) {
+	CAS_JSON_STATE* json=&cas->json;
+	const char* p=json->token.contents;
+
+	if( strcmp( p,"true" )!=0 && strcmp( p,"false" )!=0 && strcmp( p,"null" )!=0 ) {
+		//-?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+		if( *p=='-' ) p++;
+		if( *p=='0' ) {
+			p++;
+		} else if( *p>='1' && *p<='9' ) {
+			while( *p>='0' && *p<='9' ) p++;
+		} else {
+			json->state=JSON_FAIL;
+			return;
+		}
+		if( *p=='.' ) {
+			if( *++p<'0' || *p>'9' ) { json->state=JSON_FAIL; return; }
+			while( *p>='0' && *p<='9' ) p++;
+		}
+		if( *p=='e' || *p=='E' ) {
+			if( *++p=='+' || *p=='-' ) p++;
+			if( *p<'0' || *p>'9' ) { json->state=JSON_FAIL; return; }
+			while( *p>='0' && *p<='9' ) p++;
+		}
+		if( *p!='\0' ) {
+			json->state=JSON_FAIL;
+			return;
+		}
+	}
+	cas_cas3_json_scalar( cas,0 );
+}
+
+/*******************************************************************************
+ * cas_cas3_json_value_done: Move on once a value is complete
+ */
+static void
+cas_cas3_json_value_done( CAS_JSON_STATE* json ) {
+	json->state=( json->depth ? JSON_NEXT : JSON_DONE );
+}
+
+/*******************************************************************************
+ * cas_cas3_json_utf8: Append a code point read from a \u escape as UTF-8
+ */
+static void
+cas_cas3_json_utf8( CAS_JSON_STATE* json, unsigned int c ) {
+	char utf8[4];
+	size_t size;
+
+	if( c<0x80 ) {
+		utf8[0]=c; size=1;
+	} else if( c<0x800 ) {
+		utf8[0]=0xc0|( c>>6 ); utf8[1]=0x80|( c&0x3f ); size=2;
+	} else if( c<0x10000 ) {
+		utf8[0]=0xe0|( c>>12 ); utf8[1]=0x80|( ( c>>6 )&0x3f ); utf8[2]=0x80|( c&0x3f ); size=3;
+	} else {
+		utf8[0]=0xf0|( c>>18 ); utf8[1]=0x80|( ( c>>12 )&0x3f ); utf8[2]=0x80|( ( c>>6 )&0x3f ); utf8[3]=0x80|( c&0x3f ); size=4;
+	}
+	cas_cas3_json_push( json,utf8,size );
+}
+
+/*******************************************************************************
+ * cas_cas3_json_unpaired: Replace a high surrogate that was not followed by a
+ *  low one with U+FFFD
+ */
+static void
+cas_cas3_json_unpaired( CAS_JSON_STATE* json ) {
+	json->surrogate=0;
+	cas_cas3_json_utf8( json,0xfffd );
+}
+
+/*******************************************************************************
+ * cas_cas3_json: Feed the next chunk of a JSON response to the tokenizer
+ */
+void
+cas_cas3_json( CAS* cas, const char* chunk, size_t size ) {
+	CAS_JSON_STATE* json=&cas->json;
+	const char* p=chunk;
+	const char* end=chunk+size;
+
+	while( p<end && json->state!=JSON_FAIL ) {
+		char c=*p;
+
+		switch( json->state ) {
+		case JSON_STRING: {
+			//Copy the run of plain characters in one go
+			const char* run=p;
+			while( p<end && *p!='"' && *p!='\\' && ( unsigned char )*p>=0x20 ) p++;
+			if( p==run && p<end && *p=='\\' ) {
+				//Maybe the low surrogate of a pending high one
+				p++;
+				json->state=JSON_ESCAPE;
+				break;
+			}
+			if( json->surrogate && ( p>run || p<end ) ) {
+				cas_cas3_json_unpaired( json );
+			}
+			if( p>run && cas_cas3_json_push( json,run,p-run )!=0 ) {
+				break;
+			}
+			if( p==end ) break;
+
+			c=*p++;
+			if( c=='\\' ) {
+				json->state=JSON_ESCAPE;
+			} else if( c!='"' ) {
+				json->state=JSON_FAIL;
+			} else if( json->in_key ) {
+				CAS_JSON_CONTEXT context=( json->depth ? json->context[json->depth-1] : JSON_IN_ROOT );
+				if( context!=JSON_IN_OTHER ) {
+					if( cas_buffer_reserve( &json->key,json->token.size+1 )!=CAS_VALIDATION_SUCCESS ) {
+						json->state=JSON_FAIL;
+						break;
+					}
+					memcpy( json->key.contents,json->token.contents,json->token.size+1 );
+					json->key.size=json->token.size;
+				}
+				json->state=JSON_COLON;
+			} else {
+				cas_cas3_json_scalar( cas,1 );
+				cas_cas3_json_value_done( json );
+			}
+			break;
+		}
+		case JSON_ESCAPE:
+			p++;
+			json->state=JSON_STRING;
+			if( c=='u' ) {
+				json->state=JSON_UNICODE;
+				json->unicode=0;
+				json->unicode_digits=0;
+				break;
+			}
+			if( json->surrogate ) {
+				cas_cas3_json_unpaired( json );
+			}
+			switch( c ) {
+			case '"': case '\\': case '/': cas_cas3_json_push( json,&c,1 ); break;
+			case 'b': cas_cas3_json_push( json,"\b",1 ); break;
+			case 'f': cas_cas3_json_push( json,"\f",1 ); break;
+			case 'n': cas_cas3_json_push( json,"\n",1 ); break;
+			case 'r': cas_cas3_json_push( json,"\r",1 ); break;
+			case 't': cas_cas3_json_push( json,"\t",1 ); break;
+			default: json->state=JSON_FAIL;
+			}
+			break;
+		case JSON_UNICODE:
+			p++;
+			if( c>='0' && c<='9' ) {
+				json->unicode=( json->unicode<<4 )|( c-'0' );
+			} else if( ( c|0x20 )>='a' && ( c|0x20 )<='f' ) {
+				json->unicode=( json->unicode<<4 )|( ( c|0x20 )-'a'+10 );
+			} else {
+				json->state=JSON_FAIL;
+				break;
+			}
+			if( ++json->unicode_digits<4 ) break;
+
+			json->state=JSON_STRING;
+			if( json->unicode>=0xdc00 && json->unicode<0xe000 && json->surrogate ) {
+				cas_cas3_json_utf8( json,0x10000+( ( json->surrogate-0xd800 )<<10 )+( json->unicode-0xdc00 ) );
+				json->surrogate=0;
+				break;
+			}
+			if( json->surrogate ) {
+				cas_cas3_json_unpaired( json );
+			}
+			if( json->unicode>=0xd800 && json->unicode<0xdc00 ) {
+				//High surrogate, normally followed by a low one
+				json->surrogate=json->unicode;
+			} else if( json->unicode>=0xdc00 && json->unicode<0xe000 ) {
+				cas_cas3_json_utf8( json,0xfffd );
+			} else {
+				cas_cas3_json_utf8( json,json->unicode );
+			}
+			break;
+		case JSON_LITERAL: {
+			const char* run=p;
+			while( p<end && ( ( *p>='a' && *p<='z' ) || ( *p>='A' && *p<='Z' ) || ( *p>='0' && *p<='9' ) || *p=='.' || *p=='+' || *p=='-' ) ) p++;
+			if( p>run && cas_cas3_json_push( json,run,p-run )!=0 ) break;
+			if( p==end ) break;
+
+			//The character ending the literal is read again as structure
+			cas_cas3_json_literal( cas );
+			if( json->state!=JSON_FAIL ) cas_cas3_json_value_done( json );
+			break;
+		}
+		default:
+			p++;
+			if( c==' ' || c=='\t' || c=='\n' || c=='\r' ) {
+				break;
+			}
+			switch( json->state ) {
+			case JSON_VALUE:
+				if( c=='{' || c=='[' ) {
+					if( json->depth==CAS_JSON_DEPTH_MAX ) {
+						json->state=JSON_FAIL;
+						break;
+					}
+					CAS_JSON_CONTEXT context=cas_cas3_json_context( json,c );
+					json->container[json->depth]=c;
+					json->context[json->depth]=context;
+					json->depth++;
+					json->state=( c=='{' ? JSON_KEY : JSON_VALUE );
+					json->empty=1;
+				} else if( c=='"' ) {
+					json->token.size=0;
+					json->in_key=0;
+					json->state=JSON_STRING;
+				} else if( c==']' && json->empty && json->depth && json->container[json->depth-1]=='[' ) {
+					json->depth--;
+					cas_cas3_json_value_done( json );
+				} else if( c=='-' || ( c>='0' && c<='9' ) || ( c>='a' && c<='z' ) ) {
+					json->token.size=0;
+					cas_cas3_json_push( json,&c,1 );
+					if( json->state!=JSON_FAIL ) json->state=JSON_LITERAL;
+				} else {
+					json->state=JSON_FAIL;
+				}
+				break;
+			case JSON_KEY:
+				if( c=='"' ) {
+					json->token.size=0;
+					json->in_key=1;
+					json->state=JSON_STRING;
+				} else if( c=='}' && json->empty ) {
+					json->depth--;
+					cas_cas3_json_value_done( json );
+				} else {
+					json->state=JSON_FAIL;
+				}
+				break;
+			case JSON_COLON:
+				json->state=( c==':' ? JSON_VALUE : JSON_FAIL );
+				json->empty=0;
+				break;
+			case JSON_NEXT:
+				if( c==',' ) {
+					json->state=( json->container[json->depth-1]=='{' ? JSON_KEY : JSON_VALUE );
+					json->empty=0;
+				} else if( ( c=='}' || c==']' ) && c==json->container[json->depth-1]+2 ) {
+					//'{'+2=='}' and '['+2==']'
+					json->depth--;
+					cas_cas3_json_value_done( json );
+				} else {
+					json->state=JSON_FAIL;
+				}
+				break;
+			default:
+				json->state=JSON_FAIL;
+			}
+		}
+	}
+}
+
+/*******************************************************************************
+ * cas_cas3_curl_callback: cURL callback accepting received data
+ */
+static size_t
+cas_cas3_curl_callback( char* chunk, size_t size, size_t nmemb, CAS* cas ) {
+	size_t write_size=size*nmemb;
+
+	if( !cas_response_admit( cas,write_size ) ) {
+		return( 0 );
+	}
+
+	double start=cas_clock_us();
+	cas_cas3_json( cas,chunk,write_size );
+	cas->timings.parse_us+=cas_clock_us()-start;
+
+	//Only whitespace may follow the document, whichever chunk it arrives in;
+	// a server that keeps sending it is bounded by the response size limit
+	if( cas->json.state==JSON_FAIL ) {
+		cas->abort=CAS_ABORT_PARSED;
+		return( 0 );
+	}
+	return( write_size );
+}
+
+/*******************************************************************************
+ * cas_cas3_reset: Clear the result of cas and the JSON tokenizer
+ */
+void
+cas_cas3_reset( CAS* cas ) {
+	CAS_JSON_STATE* json=&cas->json;
+
+	cas_result_clear( cas );
+	cas_attributes_clear( &cas->attributes );
+	cas->code=CAS_VALIDATION_SUCCESS;
+
+	json->state=JSON_VALUE;
+	json->depth=0;
+	json->empty=0;
+	json->in_key=0;
+	json->surrogate=0;
+	json->outcome=0;
+	json->invalid=0;
+	json->code=CAS_INVALID_RESPONSE;
+	json->token.size=0;
+	json->key.size=0;
+}
+
+/*******************************************************************************
+ * cas_cas3_result: Resolve the CAS_CODE once the whole response was read
+ */
+CAS_CODE
+cas_cas3_result( CAS* cas ) {
+	CAS_JSON_STATE* json=&cas->json;
+
+	//A number as the whole document only ends with the document
+	if( json->state==JSON_LITERAL && json->depth==0 ) {
+		cas_cas3_json_literal( cas );
+		if( json->state!=JSON_FAIL ) json->state=JSON_DONE;
+	}
+
+	if( json->state!=JSON_DONE ) {
+		return( CAS3_INVALID_JSON );
+	} else if( json->invalid || json->outcome==0 ) {
+		return( CAS_INVALID_RESPONSE );
+	} else if( json->outcome>0 ) {
+		return( cas->principal ? CAS_VALIDATION_SUCCESS : CAS_INVALID_RESPONSE );
+	} else {
+		return( json->code );
+	}
+}
+
+/*******************************************************************************
+ * cas_cas3_start: Set up cas->curl and reset the JSON tokenizer for CAS3
+ *  validation of the complete validation URL, without performing it
+ */
+CAS_CODE
+cas_cas3_start( CAS* cas, const char* url ) {
+	cas_cas3_reset( cas );
+	cas->stats.validations++;
+
+	//Setup curl connection, cURL keeps its own copy of the URL
+	curl_easy_setopt( cas->curl,CURLOPT_URL, url );
+
+	//Set response handler
+	curl_easy_setopt( cas->curl,CURLOPT_WRITEFUNCTION, ( curl_write_callback )cas_cas3_curl_callback );
+
+	//Pass state to response handler
+	curl_easy_setopt( cas->curl,CURLOPT_WRITEDATA, cas );
+
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_cas3_finish: Resolve the CAS_CODE once the transfer is complete
+ */
+CAS_CODE
+cas_cas3_finish( CAS* cas, CURLcode curl_status ) {
+	CAS_CODE rc=CAS_FAIL;
+
+	if(curl_status==CURLE_OK || ( curl_status==CURLE_WRITE_ERROR && cas->abort==CAS_ABORT_PARSED )){
+		rc=cas_cas3_result( cas );
+	} else if( curl_status==CURLE_WRITE_ERROR && cas->abort==CAS_ABORT_LIMIT ) {
+		rc=CAS_RESPONSE_LIMIT;
+	} else {
+		const char* message=curl_easy_strerror(curl_status);
+		cas_result_set(&cas->message_buffer,&cas->message,message,strlen(message));
+		rc=CAS_CURL_FAILURE;
+	}
+
+	cas->code=rc;
+	return( rc );
+}
+
+/*******************************************************************************
+ * cas_cas3_servicevalidate: Perform CAS3 validation protocol
+ */
+CAS_CODE
+cas_cas3_servicevalidate( CAS* cas, char* cas3_servicevalidate_url, char* escaped_service, char* ticket, int renew, int json ) {
+	CAS_CODE rc=cas_start( cas,( json ? CAS_PROTOCOL_CAS3_JSON : CAS_PROTOCOL_CAS3 ),cas3_servicevalidate_url,escaped_service,ticket,renew );
+	if( rc!=CAS_VALIDATION_SUCCESS ) {
+		return( rc );
+	}
+	return( cas_perform( cas,cas->url.contents ) );
+}
@@ -0,0 +1,272 @@
+/*******************************************************************************
+ * casattr.c
+ *
+ * CAS2 released attributes
+ *
+ * Attribute names and values are appended to a per-handle arena as the
+ * response is parsed, and indexed by an open-addressing hash table of slots,
+ * one per distinct attribute name.  Both are kept on the handle and only
+ * cleared between validations, so once warm a validation allocates nothing
+ * for its attributes, and lookups hand out pointers into the arena.
+ *
+ * Arena layout, with every value preceded by the arena offset of the next
+ * value of the same attribute (0 for none):
+ *
+ *   [name\0] [next][value\0] [next][value\0] [name\0] [next][value\0] ...
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cas.h"
+#include "cas-int.h"
+
+#define CAS_ATTRIBUTES_MIN_CAPACITY 16
+
+/*******************************************************************************
+ * cas_attributes_slot: Find the slot for name, or the empty slot it belongs in
+ */
+static CAS_ATTRIBUTE_SLOT*
+cas_attributes_slot( CAS_ATTRIBUTES* attributes, const char* name, size_t size, unsigned int hash ) {
+	size_t mask=attributes->capacity-1;
+	size_t i=hash&mask;
+
+	for( ;; i=( i+1 )&mask ) {
+		CAS_ATTRIBUTE_SLOT* slot=&attributes->slots[i];
+		if( slot->name_size==0 ) {
+			return( slot );
+		}
+		if( slot->hash==hash && slot->name_size==size && memcmp( &attributes->arena.contents[slot->name],name,size )==0 ) {
+			return( slot );
+		}
+	}
+}
+
+/*******************************************************************************
+ * cas_attributes_grow: Double the slot table, keeping it at most half full
+ */
+static CAS_CODE
+cas_attributes_grow( CAS_ATTRIBUTES* attributes ) {
+	size_t capacity=( attributes->capacity ? attributes->capacity*2 : CAS_ATTRIBUTES_MIN_CAPACITY );
+	CAS_ATTRIBUTE_SLOT* old=attributes->slots;
+	size_t old_capacity=attributes->capacity;
+	size_t i;
+
+	if((attributes->slots=cas_calloc( capacity,sizeof( CAS_ATTRIBUTE_SLOT ) ))==NULL) {
+		attributes->slots=old;
+		return( CAS_ENOMEM );
+	}
+	attributes->capacity=capacity;
+
+	for( i=0; i<old_capacity; i++ ) {
+		if( old[i].name_size ) {
+			size_t j=old[i].hash&( capacity-1 );
+			while( attributes->slots[j].name_size ) j=( j+1 )&( capacity-1 );
+			attributes->slots[j]=old[i];
+		}
+	}
+	if( old ) cas_free( old );
+
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_attributes_push: Append bytes to the arena, returning their offset
+ */
+static CAS_CODE
+cas_attributes_push( CAS_ATTRIBUTES* attributes, const void* bytes, size_t size, size_t* offset ) {
+	CAS_BUFFER* arena=&attributes->arena;
+
+	if( cas_buffer_reserve( arena,arena->size+size )!=CAS_VALIDATION_SUCCESS ) {
+		return( CAS_ENOMEM );
+	}
+	if( offset ) *offset=arena->size;
+	memcpy( &arena->contents[arena->size],bytes,size );
+	arena->size+=size;
+
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_attributes_clear: Forget every attribute, keeping the memory for reuse
+ */
+void
+cas_attributes_clear( CAS_ATTRIBUTES* attributes ) {
+	if( attributes->count ) {
+		memset( attributes->slots,0,attributes->capacity*sizeof( CAS_ATTRIBUTE_SLOT ) );
+		attributes->count=0;
+	}
+	attributes->arena.size=0;
+	attributes->open=NULL;
+}
+
+/*******************************************************************************
+ * cas_attributes_free: Release the memory of the attribute map
+ */
+void
+cas_attributes_free( CAS_ATTRIBUTES* attributes ) {
+	if( attributes->slots ) cas_free( attributes->slots );
+	if( attributes->arena.contents ) cas_free( attributes->arena.contents );
+	memset( attributes,0,sizeof( CAS_ATTRIBUTES ) );
+}
+
+/*******************************************************************************
+ * cas_attributes_begin: Start a new value of attribute name, adding the
+ *  attribute if it is not yet known
+ */
+CAS_CODE
+cas_attributes_begin( CAS_ATTRIBUTES* attributes, const char* name ) {
+	size_t size=strlen( name );
+	unsigned int hash=cas_hash( name,size );
+	size_t next=0;
+
+	if( size==0 ) {
+		return( CAS_INVALID_PARAMETERS );
+	}
+	if( ( attributes->count+1 )*2>attributes->capacity && cas_attributes_grow( attributes )!=CAS_VALIDATION_SUCCESS ) {
+		return( CAS_ENOMEM );
+	}
+
+	CAS_ATTRIBUTE_SLOT* slot=cas_attributes_slot( attributes,name,size,hash );
+	if( slot->name_size==0 ) {
+		if( cas_attributes_push( attributes,name,size+1,&slot->name )!=CAS_VALIDATION_SUCCESS ) {
+			return( CAS_ENOMEM );
+		}
+		slot->hash=hash;
+		slot->name_size=size;
+		attributes->count++;
+	}
+
+	if( cas_attributes_push( attributes,&next,sizeof( next ),&attributes->value )!=CAS_VALIDATION_SUCCESS ) {
+		return( CAS_ENOMEM );
+	}
+	attributes->open=slot;
+
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_attributes_append: Append characters to the value being read
+ */
+CAS_CODE
+cas_attributes_append( CAS_ATTRIBUTES* attributes, const char* chars, size_t size ) {
+	if( attributes->open==NULL ) {
+		return( CAS_FAIL );
+	}
+	return( cas_attributes_push( attributes,chars,size,NULL ) );
+}
+
+/*******************************************************************************
+ * cas_attributes_end: Complete the value being read, which must have been
+ *  begun for the same name
+ */
+CAS_CODE
+cas_attributes_end( CAS_ATTRIBUTES* attributes, const char* name ) {
+	CAS_ATTRIBUTE_SLOT* slot=attributes->open;
+
+	if( slot==NULL || strlen( name )!=slot->name_size || memcmp( &attributes->arena.contents[slot->name],name,slot->name_size )!=0 ) {
+		return( CAS_FAIL );
+	}
+	if( cas_attributes_push( attributes,"",1,NULL )!=CAS_VALIDATION_SUCCESS ) {
+		return( CAS_ENOMEM );
+	}
+
+	//Link the value after the last one of the attribute
+	if( slot->values==0 ) {
+		slot->first=attributes->value;
+	} else {
+		memcpy( &attributes->arena.contents[slot->last],&attributes->value,sizeof( size_t ) );
+	}
+	slot->last=attributes->value;
+	slot->values++;
+	attributes->open=NULL;
+
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_attributes_find: Look up the slot of a complete attribute
+ */
+static CAS_ATTRIBUTE_SLOT*
+cas_attributes_find( CAS* cas, const char* name ) {
+	CAS_ATTRIBUTES* attributes=&cas->attributes;
+
+	if( cas->code!=CAS_VALIDATION_SUCCESS || attributes->count==0 || name==NULL ) {
+		return( NULL );
+	}
+	size_t size=strlen( name );
+	CAS_ATTRIBUTE_SLOT* slot=cas_attributes_slot( attributes,name,size,cas_hash( name,size ) );
+
+	return( slot->values ? slot : NULL );
+}
+
+/*******************************************************************************
+ * cas_attributes_copy: Replace the attributes of to with a copy of those of from
+ */
+CAS_CODE
+cas_attributes_copy( CAS_ATTRIBUTES* to, const CAS_ATTRIBUTES* from ) {
+	cas_attributes_clear( to );
+	if( from->count==0 ) {
+		return( CAS_VALIDATION_SUCCESS );
+	}
+
+	//Slot positions depend on the capacity, so the table is copied as is
+	if( to->capacity!=from->capacity ) {
+		CAS_ATTRIBUTE_SLOT* slots=cas_malloc( from->capacity*sizeof( CAS_ATTRIBUTE_SLOT ) );
+		if( slots==NULL ) {
+			return( CAS_ENOMEM );
+		}
+		if( to->slots ) cas_free( to->slots );
+		to->slots=slots;
+		to->capacity=from->capacity;
+	}
+	if( cas_buffer_reserve( &to->arena,from->arena.size )!=CAS_VALIDATION_SUCCESS ) {
+		return( CAS_ENOMEM );
+	}
+	memcpy( to->slots,from->slots,from->capacity*sizeof( CAS_ATTRIBUTE_SLOT ) );
+	memcpy( to->arena.contents,from->arena.contents,from->arena.size );
+	to->arena.size=from->arena.size;
+	to->count=from->count;
+
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_get_attribute: Retrieve the first value of a released attribute
+ */
+char*
+cas_get_attribute( CAS* cas, const char* name ) {
+	CAS_ATTRIBUTE_SLOT* slot=cas_attributes_find( cas,name );
+
+	return( slot ? &cas->attributes.arena.contents[slot->first+sizeof( size_t )] : NULL );
+}
+
+/*******************************************************************************
+ * cas_get_attribute_next: Retrieve the value following value of the same
+ *  attribute
+ */
+char*
+cas_get_attribute_next( CAS* cas, const char* value ) {
+	size_t next;
+
+	if( value==NULL ) {
+		return( NULL );
+	}
+	memcpy( &next,value-sizeof( size_t ),sizeof( size_t ) );
+
+	return( next ? &cas->attributes.arena.contents[next+sizeof( size_t )] : NULL );
+}
+
+/*******************************************************************************
+ * cas_get_attribute_count: Retrieve the number of values of an attribute
+ */
+size_t
+cas_get_attribute_count( CAS* cas, const char* name ) {
+	CAS_ATTRIBUTE_SLOT* slot=cas_attributes_find( cas,name );
+
+	return( slot ? slot->values : 0 );
+}
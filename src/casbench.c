@@ -0,0 +1,469 @@
+/*******************************************************************************
+ * casbench.c
+ *
+ * End-to-end validation benchmark, run by "make bench".  Starts the mock CAS
+ * server of casmock.c in-process, then for each protocol and thread count has
+ * every thread validate tickets back to back on its own prepared validator
+ * for a fixed time, and reports validations/sec, latency percentiles, heap
+ * allocations per validation, requests the server saw per validation, and
+ * connections it accepted.
+ * Every thread validates the same ticket, so with -c (singleflight) they
+ * coalesce.  With -b, every thread instead keeps a CAS_BATCH of validations
+ * in flight, which is where HTTP/2 (-2) can multiplex them over one
+ * connection rather than one connection each.  With -e, every thread fails
+ * over between several mock servers, one of which -d slows down or takes
+ * down halfway through each run.  -W changes how threads start: cold, with
+ * no warm up at all, or from handles of a CAS_POOL prewarmed with one
+ * connection per validation in flight; first(us) is then the latency of a
+ * first validation.
+ *
+ * Allocations are counted by libcas (cas_set_mem_counting), across libcas,
+ * libxml2 and libcurl, only on the benchmark threads, and only once warm:
+ * the connection is made and every buffer of the handle is allocated by a
+ * first, uncounted validation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cas.h"
+#include "casmock.h"
+
+#define BENCH_MOCKS_MAX 8
+
+typedef enum {
+	BENCH_WARMUP_VALIDATION=0,		// - an uncounted first validation
+	BENCH_WARMUP_NONE,
+	BENCH_WARMUP_PREWARM,			// - handles of a prewarmed CAS_POOL
+} BENCH_WARMUP;
+
+typedef struct {
+	CAS_PROTOCOL protocol;
+	char url[128];
+	int https;
+	int http2;
+	int compression;
+	int batch;						// - validations per batch, 0 for one at a time
+	int hedging;
+	long deadline_ms;
+	CAS_ENDPOINTS* endpoints;		// - the mock servers, if more than one
+	BENCH_WARMUP warmup;
+	CAS_POOL* pool;					// - prewarmed pool to take handles from, if any
+	double seconds;
+	pthread_barrier_t* start;
+
+	//-- Results
+	double* latencies;				// - microseconds
+	size_t count;
+	size_t capacity;
+	unsigned long allocations;
+	unsigned long allocated_bytes;
+	unsigned long errors;
+} BENCH_THREAD;
+
+static double
+now() {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC,&ts );
+	return( ts.tv_sec+ts.tv_nsec/1e9 );
+}
+
+static int
+compare( const void* a, const void* b ) {
+	double x=*( const double* )a;
+	double y=*( const double* )b;
+	return( ( x>y )-( x<y ) );
+}
+
+static unsigned long
+mocks_requests( CAS_MOCK** mocks, int count ) {
+	unsigned long requests=0;
+	int i;
+	for( i=0; i<count; i++ ) requests+=cas_mock_requests( mocks[i] );
+	return( requests );
+}
+
+static unsigned long
+mocks_connections( CAS_MOCK** mocks, int count ) {
+	unsigned long connections=0;
+	int i;
+	for( i=0; i<count; i++ ) connections+=cas_mock_connections( mocks[i] );
+	return( connections );
+}
+
+static CAS*
+bench_handle( BENCH_THREAD* thread ) {
+	CAS* cas=( thread->pool ? cas_pool_get( thread->pool ) : cas_new() );
+	if( thread->https ) cas_set_ssl_validate_server( cas,0 );
+	cas_set_http2( cas,thread->http2 );
+	cas_set_compression( cas,thread->compression );
+	cas_set_endpoints( cas,thread->endpoints );
+	cas_set_hedging( cas,thread->hedging );
+	cas_set_deadline( cas,thread->deadline_ms );
+	return( cas );
+}
+
+static void
+bench_release( BENCH_THREAD* thread, CAS* cas ) {
+	if( thread->pool ) {
+		cas_pool_put( thread->pool,cas );
+	} else {
+		cas_zap( cas );
+	}
+}
+
+static void
+bench_record( BENCH_THREAD* thread, double latency ) {
+	if( thread->count==thread->capacity ) {
+		thread->capacity=( thread->capacity ? thread->capacity*2 : 4096 );
+		thread->latencies=realloc( thread->latencies,thread->capacity*sizeof( double ) );
+	}
+	thread->latencies[thread->count++]=latency;
+}
+
+static void
+bench_count( BENCH_THREAD* thread, const CAS_MEM_STATS* before ) {
+	CAS_MEM_STATS after;
+	cas_get_mem_thread( &after );
+	thread->allocations+=after.allocations-before->allocations;
+	thread->allocated_bytes+=after.bytes-before->bytes;
+}
+
+static void*
+bench_batch_thread( BENCH_THREAD* thread ) {
+	CAS** handles=calloc( thread->batch,sizeof( CAS* ) );
+	CAS_BATCH* batch=cas_batch_new();
+	int round;
+	int i;
+
+	for( i=0; i<thread->batch; i++ ) {
+		handles[i]=bench_handle( thread );
+	}
+
+	//Warm up: connect, and size every buffer of the handles
+	for( round=( thread->warmup==BENCH_WARMUP_VALIDATION ? 0 : 1 ); round<2; round++ ) {
+		if( round==1 ) {
+			pthread_barrier_wait( thread->start );
+		}
+		double end=now()+thread->seconds;
+		double t=now();
+
+		do {
+			CAS_MEM_STATS before;
+			cas_get_mem_thread( &before );
+			for( i=0; i<thread->batch; i++ ) {
+				cas_batch_add( batch,handles[i],thread->protocol,thread->url,"http%3a%2f%2flocalhost%2f",( round ? "ST-1-bench" : "ST-1-warmup" ),0 );
+			}
+			cas_validate_batch( batch );
+			if( round ) bench_count( thread,&before );
+			double done=now();
+			for( i=0; i<thread->batch; i++ ) {
+				if( cas_get_code( handles[i] )!=CAS_VALIDATION_SUCCESS ) thread->errors++;
+				if( round ) bench_record( thread,( done-t )*1e6 );
+			}
+			t=done;
+		} while( round && t<end );
+	}
+
+	cas_batch_zap( batch );
+	for( i=0; i<thread->batch; i++ ) {
+		bench_release( thread,handles[i] );
+	}
+	free( handles );
+	return( NULL );
+}
+
+static void*
+bench_thread( BENCH_THREAD* thread ) {
+	if( thread->batch ) {
+		return( bench_batch_thread( thread ) );
+	}
+
+	CAS* cas=bench_handle( thread );
+	CAS_PREPARED* prepared=cas_prepare( cas,thread->url,"http%3a%2f%2flocalhost%2f",thread->protocol,0 );
+
+	//Warm up: connect, and size every buffer of the handle
+	if( thread->warmup==BENCH_WARMUP_VALIDATION && cas_prepared_validate( prepared,"ST-1-warmup" )!=CAS_VALIDATION_SUCCESS ) {
+		thread->errors++;
+	}
+
+	pthread_barrier_wait( thread->start );
+	double end=now()+thread->seconds;
+	double t=now();
+
+	while( t<end ) {
+		CAS_MEM_STATS before;
+		cas_get_mem_thread( &before );
+		CAS_CODE code=cas_prepared_validate( prepared,"ST-1-bench" );
+		bench_count( thread,&before );
+		double done=now();
+		if( code!=CAS_VALIDATION_SUCCESS ) thread->errors++;
+		bench_record( thread,( done-t )*1e6 );
+		t=done;
+	}
+
+	cas_prepared_zap( prepared );
+	bench_release( thread,cas );
+	return( NULL );
+}
+
+static void
+usage() {
+	fprintf( stderr,"%s\n","\n\
+casbench [-t <threads>[,<threads>...]] [-s <seconds>] [-l <latency_us>] [-p <cas1|cas2|cas3json>] [-k] [-2] [-z] [-a <attributes>] [-b <in_flight>] [-c] [-e <servers> [-d <slow|down>]] [-T <percent>,<latency_us>] [-H <percentile>] [-D <deadline_ms>] [-W <cold|prewarm>]\n\
+\n\
+-t : Thread counts to run.  Default: 1,2,4,8\n\
+-s : Seconds per run.  Default: 1\n\
+-l : Mock server latency per response, in microseconds.  Default: 0\n\
+-p : Protocol to run, may be repeated.  Default: cas1 and cas2\n\
+-k : Serve and validate over HTTPS\n\
+-2 : Negotiate HTTP/2 (cas_set_http2), with -k\n\
+-z : Ask for gzipped responses (cas_set_compression)\n\
+-a : Attributes released by each successful CAS2/CAS3 response.  Default: 0\n\
+-b : Have each thread validate <in_flight> tickets at a time with a CAS_BATCH\n\
+-c : Coalesce the identical validations of the threads (cas_set_singleflight)\n\
+-e : Run <servers> mock servers, up to 8, and fail over between them (cas_set_endpoints)\n\
+-d : Halfway through each run, slow the first server down by 50 ms, or take it down\n\
+-T : Delay <percent> of the responses, at random, by <latency_us> instead\n\
+-H : Hedge validations slower than <percentile> of recent ones (cas_set_hedging)\n\
+-D : Give every validation a deadline (cas_set_deadline)\n\
+-W : Start threads without warming up, or with handles of a prewarmed CAS_POOL (cas_pool_prewarm)\n\
+	" );
+}
+
+int
+main( int argc, char** argv ) {
+	CAS_MOCK_CONFIG config={ 0 };
+	int compression=0;
+	int batch=0;
+	int mock_count=1;
+	int hedging=0;
+	long deadline_ms=0;
+	BENCH_WARMUP warmup=BENCH_WARMUP_VALIDATION;
+	char* degrade=NULL;
+	char* threads_list="1,2,4,8";
+	double seconds=1;
+	CAS_PROTOCOL protocols[3];
+	int protocol_count=0;
+	int i;
+
+	for( i=1; i<argc; i++ ) {
+		if( strcmp( argv[i],"-t" )==0 && i+1<argc ) {
+			threads_list=argv[++i];
+		} else if( strcmp( argv[i],"-s" )==0 && i+1<argc ) {
+			seconds=atof( argv[++i] );
+		} else if( strcmp( argv[i],"-l" )==0 && i+1<argc ) {
+			config.latency_us=atol( argv[++i] );
+		} else if( strcmp( argv[i],"-p" )==0 && i+1<argc && protocol_count<3 ) {
+			i++;
+			if( strcmp( argv[i],"cas1" )==0 ) {
+				protocols[protocol_count++]=CAS_PROTOCOL_CAS1;
+			} else if( strcmp( argv[i],"cas2" )==0 ) {
+				protocols[protocol_count++]=CAS_PROTOCOL_CAS2;
+			} else if( strcmp( argv[i],"cas3json" )==0 ) {
+				protocols[protocol_count++]=CAS_PROTOCOL_CAS3_JSON;
+			} else {
+				usage();
+				return( 1 );
+			}
+		} else if( strcmp( argv[i],"-k" )==0 ) {
+			config.https=1;
+		} else if( strcmp( argv[i],"-2" )==0 ) {
+			config.http2=1;
+		} else if( strcmp( argv[i],"-z" )==0 ) {
+			compression=1;
+		} else if( strcmp( argv[i],"-a" )==0 && i+1<argc ) {
+			config.attributes=atoi( argv[++i] );
+		} else if( strcmp( argv[i],"-b" )==0 && i+1<argc ) {
+			batch=atoi( argv[++i] );
+		} else if( strcmp( argv[i],"-c" )==0 ) {
+			cas_set_singleflight( 1 );
+		} else if( strcmp( argv[i],"-e" )==0 && i+1<argc ) {
+			mock_count=atoi( argv[++i] );
+			if( mock_count<1 || mock_count>BENCH_MOCKS_MAX ) {
+				usage();
+				return( 1 );
+			}
+		} else if( strcmp( argv[i],"-T" )==0 && i+1<argc && strchr( argv[i+1],',' ) ) {
+			config.tail_percent=atoi( argv[++i] );
+			config.tail_latency_us=atol( strchr( argv[i],',' )+1 );
+		} else if( strcmp( argv[i],"-H" )==0 && i+1<argc ) {
+			hedging=atoi( argv[++i] );
+		} else if( strcmp( argv[i],"-D" )==0 && i+1<argc ) {
+			deadline_ms=atol( argv[++i] );
+		} else if( strcmp( argv[i],"-W" )==0 && i+1<argc && ( strcmp( argv[i+1],"cold" )==0 || strcmp( argv[i+1],"prewarm" )==0 ) ) {
+			warmup=( strcmp( argv[++i],"cold" )==0 ? BENCH_WARMUP_NONE : BENCH_WARMUP_PREWARM );
+		} else if( strcmp( argv[i],"-d" )==0 && i+1<argc && ( strcmp( argv[i+1],"slow" )==0 || strcmp( argv[i+1],"down" )==0 ) ) {
+			degrade=argv[++i];
+		} else {
+			usage();
+			return( 1 );
+		}
+	}
+	if( protocol_count==0 ) {
+		protocols[protocol_count++]=CAS_PROTOCOL_CAS1;
+		protocols[protocol_count++]=CAS_PROTOCOL_CAS2;
+	}
+
+	//Cancelled and timed out validations leave the mock servers writing to closed connections
+	signal( SIGPIPE,SIG_IGN );
+
+	cas_set_mem_counting( 1 );
+	cas_init();
+	CAS_MOCK* mocks[BENCH_MOCKS_MAX];
+	for( i=0; i<mock_count; i++ ) {
+		if((mocks[i]=cas_mock_start( &config ))==NULL) {
+			fprintf( stderr,"Could not start the mock CAS server\n" );
+			return( 1 );
+		}
+	}
+	CAS_MOCK* mock=mocks[0];
+
+	printf( "%s, %ld us server latency, %.1f s per run, %s%s, %d attributes",cas_mock_url( mock ),config.latency_us,seconds,( config.http2 ? "HTTP/2" : "HTTP/1.1" ),( compression ? " gzip" : "" ),config.attributes );
+	if( batch ) printf( ", %d in flight per thread",batch );
+	if( config.tail_percent ) printf( ", %d%% at %ld us",config.tail_percent,config.tail_latency_us );
+	if( hedging ) printf( ", hedged at p%d",hedging );
+	if( deadline_ms ) printf( ", %ld ms deadline",deadline_ms );
+	if( warmup!=BENCH_WARMUP_VALIDATION ) printf( ", %s start",( warmup==BENCH_WARMUP_NONE ? "cold" : "prewarmed" ) );
+	if( mock_count>1 ) printf( ", %d servers%s%s",mock_count,( degrade ? ", first one going " : "" ),( degrade ? degrade : "" ) );
+	printf( "\n%-9s %7s %13s %9s %9s %9s %9s %12s %11s %10s %5s %7s\n","protocol","threads","validations/s","first(us)","p50(us)","p99(us)","p999(us)","allocs/valid","bytes/valid","reqs/valid","conns","errors" );
+
+	int p;
+	for( p=0; p<protocol_count; p++ ) {
+		char* list=strdup( threads_list );
+		char* saveptr=NULL;
+		char* item;
+
+		for( item=strtok_r( list,",",&saveptr ); item; item=strtok_r( NULL,",",&saveptr ) ) {
+			int n=atoi( item );
+			if( n<=0 ) continue;
+
+			BENCH_THREAD* threads=calloc( n,sizeof( BENCH_THREAD ) );
+			pthread_t* ids=calloc( n,sizeof( pthread_t ) );
+			pthread_barrier_t start;
+			pthread_barrier_init( &start,NULL,n+1 );
+			//Connections are counted from before the warm up, so also those kept open
+			unsigned long connections=mocks_connections( mocks,mock_count );
+
+			//A new endpoint set, with fresh health, for every run
+			CAS_ENDPOINTS* endpoints=NULL;
+			if( mock_count>1 ) {
+				endpoints=cas_endpoints_new();
+				for( i=0; i<mock_count; i++ ) {
+					char base[64];
+					snprintf( base,sizeof( base ),"%s",cas_mock_url( mocks[i] ) );
+					*strrchr( base,'/' )='\0';
+					cas_endpoints_add( endpoints,base );
+				}
+				cas_endpoints_set_breaker( endpoints,CAS_DEFAULT_BREAKER_FAILURES,( long )( seconds*250 ) );
+			}
+
+			char url[128];
+			snprintf( url,sizeof( url ),"%s%s",cas_mock_url( mock ),( protocols[p]==CAS_PROTOCOL_CAS1 ? "/validate" : protocols[p]==CAS_PROTOCOL_CAS2 ? "/serviceValidate" : "/p3/serviceValidate" ) );
+
+			//A new pool for every run, with a connection per validation in flight
+			CAS_POOL* pool=NULL;
+			if( warmup==BENCH_WARMUP_PREWARM ) {
+				pool=cas_pool_new();
+				if( config.https ) cas_pool_set_ssl_validate_server( pool,0 );
+				cas_pool_set_endpoints( pool,endpoints );
+				if( cas_pool_prewarm( pool,url,n*( batch ? batch : 1 ) )!=CAS_VALIDATION_SUCCESS ) {
+					fprintf( stderr,"Could not prewarm the pool\n" );
+				}
+			}
+
+			for( i=0; i<n; i++ ) {
+				threads[i].protocol=protocols[p];
+				strcpy( threads[i].url,url );
+				threads[i].https=config.https;
+				threads[i].http2=config.http2;
+				threads[i].compression=compression;
+				threads[i].batch=batch;
+				threads[i].endpoints=endpoints;
+				threads[i].hedging=hedging;
+				threads[i].deadline_ms=deadline_ms;
+				threads[i].warmup=warmup;
+				threads[i].pool=pool;
+				threads[i].seconds=seconds;
+				threads[i].start=&start;
+				pthread_create( &ids[i],NULL,( void*(*)( void* ) )bench_thread,&threads[i] );
+			}
+			pthread_barrier_wait( &start );
+			double began=now();
+			unsigned long requests=mocks_requests( mocks,mock_count );
+			if( degrade ) {
+				struct timespec half={ ( time_t )( seconds/2 ),( long )( ( seconds/2-( time_t )( seconds/2 ) )*1e9 ) };
+				nanosleep( &half,NULL );
+				if( strcmp( degrade,"slow" )==0 ) {
+					cas_mock_set_latency( mock,config.latency_us+50000 );
+				} else {
+					cas_mock_set_down( mock,1 );
+				}
+			}
+			for( i=0; i<n; i++ ) {
+				pthread_join( ids[i],NULL );
+			}
+			double elapsed=now()-began;
+			cas_mock_set_latency( mock,config.latency_us );
+			cas_mock_set_down( mock,0 );
+			requests=mocks_requests( mocks,mock_count )-requests;
+			connections=mocks_connections( mocks,mock_count )-connections;
+
+			//Merge the latencies of every thread
+			size_t count=0;
+			unsigned long allocs=0;
+			unsigned long bytes=0;
+			unsigned long errors=0;
+			double first=0;
+			for( i=0; i<n; i++ ) {
+				if( threads[i].count ) first+=threads[i].latencies[0]/n;
+				count+=threads[i].count;
+				allocs+=threads[i].allocations;
+				bytes+=threads[i].allocated_bytes;
+				errors+=threads[i].errors;
+			}
+			double* latencies=malloc( ( count ? count : 1 )*sizeof( double ) );
+			size_t offset=0;
+			for( i=0; i<n; i++ ) {
+				if( threads[i].count ) memcpy( &latencies[offset],threads[i].latencies,threads[i].count*sizeof( double ) );
+				offset+=threads[i].count;
+				free( threads[i].latencies );
+			}
+			qsort( latencies,count,sizeof( double ),compare );
+
+			if( count ) {
+				printf( "%-9s %7d %13.0f %9.1f %9.1f %9.1f %9.1f ",( protocols[p]==CAS_PROTOCOL_CAS1 ? "cas1" : protocols[p]==CAS_PROTOCOL_CAS2 ? "cas2" : "cas3json" ),n,count/elapsed,first,latencies[count/2],latencies[count*99/100],latencies[count*999/1000] );
+				printf( "%12.2f %11.0f",( double )allocs/count,( double )bytes/count );
+				printf( " %10.2f %5lu %7lu\n",( double )requests/count,connections,errors );
+			}
+			for( i=0; endpoints && i<mock_count; i++ ) {
+				CAS_ENDPOINT_STATS health;
+				cas_endpoints_get_stats( endpoints,i,&health );
+				printf( "  %-26s %-7s attempts=%lu failures=%lu latency_us=%.0f error_rate=%.2f\n",health.url,( health.state==CAS_ENDPOINT_CLOSED ? "closed" : health.state==CAS_ENDPOINT_OPEN ? "open" : "probing" ),health.attempts,health.failures,health.latency_us,health.error_rate );
+			}
+			cas_pool_zap( pool );
+			cas_endpoints_zap( endpoints );
+
+			free( latencies );
+			pthread_barrier_destroy( &start );
+			free( ids );
+			free( threads );
+		}
+		free( list );
+	}
+
+	for( i=0; i<mock_count; i++ ) {
+		cas_mock_stop( mocks[i] );
+	}
+	cas_destroy();
+
+	return( 0 );
+}
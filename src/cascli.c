@@ -1,19 +1,574 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include "cas.h"
 
+#define CASCLI_SESSION_TTL 3600
+#define CASCLI_REQUEST_MAX 8192				// - longest request line of --serve
+#define CASCLI_SERVE_PREWARM 4				// - connections --serve opens to each CAS server ahead of time
+#define CASCLI_SERVE_KEEPALIVE_MS 30000L
+#define CASCLI_BATCH_JOBS 8					// - default concurrency of --batch
+#define CASCLI_BATCH_WINDOW 64				// - results --batch holds back per job, waiting for earlier lines
+#define CASCLI_CODES 64						// - CAS_CODEs counted by --batch
+#define CASCLI_TICKET_MAX 256				// - longest ticket -x lets through, the most CAS servers issue
+
+//-- Settings of every handle, from the command line
+typedef struct {
+	char* ca_location;
+	int ca_verify;
+	char* limits;
+	int http2;
+	int compression;
+	CAS_ENDPOINTS* endpoints;
+	long deadline;
+	int hedging;
+	char* ticket_prefixes;
+} CASCLI_CONFIG;
+
+typedef struct {
+	int fd;
+	CAS_POOL* pool;
+	const CASCLI_CONFIG* config;
+} CASCLI_CONNECTION;
+
+//-- One line of --batch, done once validated, until written out in input order
+typedef struct {
+	int done;
+	CAS_CODE code;
+	char* text;
+} CASCLI_RESULT;
+
+typedef struct {
+	FILE* in;
+	CAS_POOL* pool;
+	const CASCLI_CONFIG* config;
+	CAS_PROTOCOL protocol;
+	int renew;
+	int tagged;						// - write results as they complete, after their line number
+	pthread_mutex_t lock;
+	pthread_cond_t written;
+	unsigned long lines;			// - lines read
+	unsigned long writes;			// - results written
+	unsigned long window;
+	CASCLI_RESULT* results;			// - ring of window results, from writes on
+	CAS_CODE rc;					// - first failure written
+	unsigned long codes[CASCLI_CODES];
+} CASCLI_BATCH;
+
+static volatile sig_atomic_t stopping=0;
+static volatile sig_atomic_t trace_toggle=0;
+static volatile sig_atomic_t trace_dump=0;
+
 void
 usage() {
 	fprintf(stderr,"%s\n","\n\
-casvalidate [-p <(cas1)|cas2>] [-r] [-k] [-c </path/to/CA>] <validation_url> <escaped_service> <ST>\n\
+casvalidate [--serve <socket> [<validation_url>] | --connect <socket>] [--batch <file|-> [-j <jobs>] [-t]] [-p <(cas1)|cas2|cas3|cas3json>] [-r] [-k] [-s] [-a <attribute>] [-l <max_bytes>[,<max_depth>]] [-2] [-z] [-e <base_url> ... [-A <rate>[,<burst>[,<max_in_flight>[,<max_queued>,<queue_timeout_ms>]]]]] [-d <deadline_ms>] [-H <percentile>] [-w] [-n <entries>] [-x <prefixes>] [-S <session_cache> -i <session_id>] [-T] [-c </path/to/CA>] <validation_url> <escaped_service> <ST> [<ST>...]\n\
 \n\
--p : CAS Protocol - cas1, cas2.  Default: cas1\n\
+--serve   : Serve validations on a Unix domain socket until killed, from a pool of handles kept warm.  One request per line:\n\
+            <cas1|cas2|cas3|cas3json> <validation_url> <escaped_service> <ST> [renew]\n\
+            answered by one line: <CAS_CODE> <principal, or message>.  Connections are served concurrently.\n\
+            With <validation_url>, connections to each CAS server are opened ahead of time and kept alive.\n\
+            SIGUSR1 turns tracing on or off, SIGUSR2 writes the trace recorded so far to stderr.\n\
+--connect : Validate through a cascli --serve rather than in-process.  Takes -p, -r and the arguments of a validation.\n\
+--batch   : Validate each line of a file, or of stdin for -, on a pool of handles:\n\
+            [<cas1|cas2|cas3|cas3json>] <validation_url> <escaped_service> <ST> [renew]\n\
+            writing <CAS_CODE> <principal, or message> for each, in input order, then a summary to stderr.\n\
+            The protocol defaults to -p, and renew to -r.\n\
+-j : Validations in flight at once for --batch.  Default: 8\n\
+-t : Write the results of --batch as they complete, each after the number of its line.\n\
+-p : CAS Protocol - cas1, cas2, cas3 (XML response), cas3json (JSON response).  Default: cas1\n\
 -r : CAS Renew\n\
 -k : Disable CAS server certificate validation. Certificate validation enabled if not specified.\n\
+-s : Print handle statistics, and the timings of the last validation, to stderr after validation, with the allocations of the validations.\n\
+-a : Print each value of a CAS2/CAS3 attribute, as <attribute>=<value>, after the principal.\n\
+-l : Response size and XML depth limits, 0 for none.  Default: libcas's defaults\n\
+-2 : Negotiate HTTP/2 with the CAS server, if it and libcurl support it.\n\
+-z : Ask for a compressed response.\n\
+-d : Deadline of each validation, in milliseconds.\n\
+-H : Hedge validations slower than this percentile of the previous ones.\n\
+-e : CAS server to fail over between, may be repeated.  Replaces the scheme, host and port of <validation_url>.\n\
+-A : Admission control of each -e endpoint: attempts per second (0 for any) and burst, attempts in flight (0 for any),\n\
+     and validations waiting to be admitted and for how long, in milliseconds.  Validations over these fail with CAS_OVERLOADED.\n\
+-w : Prewarm the connection to each CAS server before validating.\n\
+-n : Remember up to this many validations the CAS server rejected, and answer them again without it.\n\
+-x : Refuse tickets not of one of these comma-separated prefixes, such as ST-,PT-, or not of the usual characters and length, without the CAS server.\n\
+-S : Session cache file, shared with every other process using it.  With -i, a session found in it is not validated again.\n\
+-i : Session ID to look up in the session cache, and to store the principal of the first ticket validated under.\n\
+-T : Trace libcas, and write the trace to stderr after validating.\n\
 -c : Path to certificate authority, must be either a file for the correct CA, or a directory of CA files as expected by OpenSSL.  Relevant only if server validation is enabled (-C on, the default). Default: use libcurl's default.\n\
 	");
 }
 
+/*******************************************************************************
+ * configure: Apply the settings of the command line to a handle
+ */
+static void
+configure( CAS* cas, const CASCLI_CONFIG* config ) {
+	if(config->ca_verify){
+		if(config->ca_location){
+			cas_set_ssl_ca(cas,config->ca_location);
+		}
+		cas_set_ssl_validate_server(cas,1);
+	}else{
+		cas_set_ssl_validate_server(cas,0);
+	}
+	if(config->limits){
+		char* depth=strchr(config->limits,',');
+		cas_set_response_limits(cas,strtoul(config->limits,NULL,10),(depth?atoi(depth+1):CAS_DEFAULT_MAX_RESPONSE_DEPTH));
+	}
+	cas_set_http2(cas,config->http2);
+	cas_set_compression(cas,config->compression);
+	cas_set_endpoints(cas,config->endpoints);
+	cas_set_deadline(cas,config->deadline);
+	cas_set_hedging(cas,config->hedging);
+	if(config->ticket_prefixes){
+		cas_set_ticket_syntax(cas,config->ticket_prefixes,CAS_DEFAULT_TICKET_CHARSET,0,CASCLI_TICKET_MAX);
+	}
+}
+
+/*******************************************************************************
+ * protocol_code: The CAS_PROTOCOL of a protocol name, 0 if unknown
+ */
+static CAS_PROTOCOL
+protocol_code( const char* name ) {
+	if(strcmp(name,"cas1")==0){
+		return(CAS_PROTOCOL_CAS1);
+	}else if(strcmp(name,"cas2")==0){
+		return(CAS_PROTOCOL_CAS2);
+	}else if(strcmp(name,"cas3")==0){
+		return(CAS_PROTOCOL_CAS3);
+	}else if(strcmp(name,"cas3json")==0){
+		return(CAS_PROTOCOL_CAS3_JSON);
+	}
+	return(0);
+}
+
+/*******************************************************************************
+ * validate: Validate a ticket with the validate function of a protocol
+ */
+static CAS_CODE
+validate( CAS* cas, CAS_PROTOCOL protocol, char* url, char* service, char* ticket, int renew ) {
+	switch( protocol ) {
+	case CAS_PROTOCOL_CAS1:
+		return( cas_cas1_validate( cas,url,service,ticket,renew ) );
+	case CAS_PROTOCOL_CAS2:
+		return( cas_cas2_servicevalidate( cas,url,service,ticket,renew ) );
+	case CAS_PROTOCOL_CAS3:
+		return( cas_cas3_servicevalidate( cas,url,service,ticket,renew,0 ) );
+	case CAS_PROTOCOL_CAS3_JSON:
+		return( cas_cas3_servicevalidate( cas,url,service,ticket,renew,1 ) );
+	}
+	return( CAS_INVALID_PARAMETERS );
+}
+
+/*******************************************************************************
+ * reply: Answer a request of --serve with a line: the code, then the
+ *  principal or message on one line
+ */
+static void
+reply( FILE* out, CAS_CODE code, const char* text ) {
+	fprintf( out,"%d ",code );
+	for( ; text && *text; text++ ) {
+		fputc( ( *text=='\r' || *text=='\n' ? ' ' : *text ),out );
+	}
+	fputc( '\n',out );
+}
+
+/*******************************************************************************
+ * request: Validate the request of a line
+ *  [<protocol>] <validation_url> <escaped_service> <ticket> [renew]
+ *  for --serve and --batch, with protocol when the line names none.  text is
+ *  left on the principal or message, valid until the next validation of cas.
+ */
+static CAS_CODE
+request( CAS* cas, char* line, CAS_PROTOCOL protocol, int renew, const char** text ) {
+	char* saveptr=NULL;
+	char* token[6];
+	int n=0;
+	char* url;
+	char* service;
+	char* ticket;
+	CAS_CODE code;
+
+	//One token more than a request has is enough to tell it is bad
+	while( n<6 && (token[n]=strtok_r( ( n ? NULL : line )," \t\r\n",&saveptr )) ) {
+		n++;
+	}
+	if( n>0 && protocol_code( token[0] ) ) {
+		protocol=protocol_code( token[0] );
+		n--;
+		memmove( token,token+1,n*sizeof( char* ) );
+	}
+	if( n==4 && strcmp( token[3],"renew" )==0 ) {
+		renew=1;
+		n--;
+	}
+	if( n!=3 || protocol==0 ) {
+		*text="Bad request";
+		return( CAS_INVALID_PARAMETERS );
+	}
+	url=token[0];
+	service=token[1];
+	ticket=token[2];
+
+	code=validate( cas,protocol,url,service,ticket,renew );
+	if( code==CAS_VALIDATION_SUCCESS ) {
+		*text=cas_get_principal( cas );
+	} else {
+		*text=( cas_get_message( cas ) ? cas_get_message( cas ) : cas_code_str( code ) );
+	}
+	return( code );
+}
+
+/*******************************************************************************
+ * pool_new: A pool of handles sharing connections, for the command line
+ */
+static CAS_POOL*
+pool_new( const CASCLI_CONFIG* config ) {
+	CAS_POOL* pool=cas_pool_new();
+	if( pool ) {
+		if(config->ca_verify){
+			if(config->ca_location) cas_pool_set_ssl_ca( pool,config->ca_location );
+		}else{
+			cas_pool_set_ssl_validate_server( pool,0 );
+		}
+		cas_pool_set_endpoints( pool,config->endpoints );
+	}
+	return( pool );
+}
+
+/*******************************************************************************
+ * serve_connection: Thread answering the requests of one --serve client, one
+ *  line at a time, on a handle of the pool, until it hangs up
+ */
+static void*
+serve_connection( CASCLI_CONNECTION* connection ) {
+	FILE* in=fdopen( connection->fd,"r" );
+	int fd=dup( connection->fd );
+	FILE* out=( fd>=0 ? fdopen( fd,"w" ) : NULL );
+	CAS* cas=cas_pool_get( connection->pool );
+	char line[CASCLI_REQUEST_MAX];
+
+	if( in && out && cas ) {
+		configure( cas,connection->config );
+		while( fgets( line,sizeof( line ),in ) ) {
+			const char* text;
+			//Requests of the broker name their protocol
+			CAS_CODE code=request( cas,line,0,0,&text );
+			reply( out,code,text );
+			fflush( out );
+		}
+	}
+
+	if( cas ) cas_pool_put( connection->pool,cas );
+	if( out ) fclose( out ); else if( fd>=0 ) close( fd );
+	if( in ) fclose( in ); else close( connection->fd );
+	free( connection );
+	return( NULL );
+}
+
+static void
+stop( int signal ) {
+	stopping=1;
+}
+
+static void
+trace( int signal ) {
+	if( signal==SIGUSR1 ) trace_toggle=1; else trace_dump=1;
+}
+
+/*******************************************************************************
+ * serve: Serve validations on a Unix domain socket until SIGINT or SIGTERM,
+ *  a thread per connection, from a pool of handles
+ */
+static int
+serve( const char* path, char* prewarm_url, const CASCLI_CONFIG* config, int tracing ) {
+	struct sockaddr_un address;
+	struct sigaction action;
+	struct stat st;
+	pthread_attr_t attr;
+	int listener;
+
+	if( strlen( path )>=sizeof( address.sun_path ) ) {
+		fprintf( stderr,"Socket path too long: %s\n",path );
+		return( CAS_INVALID_PARAMETERS );
+	}
+	memset( &address,0,sizeof( address ) );
+	address.sun_family=AF_UNIX;
+	strcpy( address.sun_path,path );
+
+	//-- Replace the socket of a server gone, never anything else
+	if( stat( path,&st )==0 && S_ISSOCK( st.st_mode ) ) {
+		unlink( path );
+	}
+	if( (listener=socket( AF_UNIX,SOCK_STREAM,0 ))<0
+	 || bind( listener,( struct sockaddr* )&address,sizeof( address ) )!=0
+	 || listen( listener,128 )!=0 ) {
+		fprintf( stderr,"Could not listen on %s: %s\n",path,strerror( errno ) );
+		return( CAS_FAIL );
+	}
+
+	//-- Clients may hang up before they are answered; SIGINT and SIGTERM interrupt accept()
+	signal( SIGPIPE,SIG_IGN );
+	memset( &action,0,sizeof( action ) );
+	action.sa_handler=stop;
+	sigaction( SIGINT,&action,NULL );
+	sigaction( SIGTERM,&action,NULL );
+	action.sa_handler=trace;
+	sigaction( SIGUSR1,&action,NULL );
+	sigaction( SIGUSR2,&action,NULL );
+
+	CAS_POOL* pool=pool_new( config );
+	if( prewarm_url ) {
+		CAS_CODE code=cas_pool_prewarm( pool,prewarm_url,CASCLI_SERVE_PREWARM );
+		if( code!=CAS_VALIDATION_SUCCESS ) {
+			fprintf( stderr,"(%d) %s: prewarming %s\n",code,cas_code_str( code ),prewarm_url );
+		}
+		cas_pool_set_keepalive( pool,CASCLI_SERVE_KEEPALIVE_MS );
+	}
+
+	pthread_attr_init( &attr );
+	pthread_attr_setdetachstate( &attr,PTHREAD_CREATE_DETACHED );
+	while( !stopping ) {
+		pthread_t thread;
+		int fd=accept( listener,NULL,NULL );
+		if( trace_toggle ) {
+			trace_toggle=0;
+			tracing=!tracing;
+			cas_set_tracing( tracing ? CAS_DEFAULT_TRACE_EVENTS : 0 );
+		}
+		if( trace_dump ) {
+			trace_dump=0;
+			cas_trace_dump( STDERR_FILENO );
+		}
+		if( fd<0 ) {
+			if( errno!=EINTR && errno!=ECONNABORTED ) {
+				fprintf( stderr,"accept: %s\n",strerror( errno ) );
+			}
+			continue;
+		}
+		CASCLI_CONNECTION* connection=calloc( 1,sizeof( CASCLI_CONNECTION ) );
+		if( connection==NULL ) {
+			close( fd );
+			continue;
+		}
+		connection->fd=fd;
+		connection->pool=pool;
+		connection->config=config;
+		if( pthread_create( &thread,&attr,( void*(*)( void* ) )serve_connection,connection )!=0 ) {
+			close( fd );
+			free( connection );
+		}
+	}
+	pthread_attr_destroy( &attr );
+
+	//-- Connections may still be in flight on handles of the pool, which is left to exit()
+	close( listener );
+	unlink( path );
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * batch_write: Write out a result of --batch, with the lock held
+ */
+static void
+batch_write( CASCLI_BATCH* batch, unsigned long line, CAS_CODE code, const char* text ) {
+	if( batch->tagged ) {
+		fprintf( stdout,"%lu ",line+1 );
+	}
+	reply( stdout,code,text );
+	if( code>=0 && code<CASCLI_CODES ) {
+		batch->codes[code]++;
+	}
+	if( code!=CAS_VALIDATION_SUCCESS && batch->rc==CAS_VALIDATION_SUCCESS ) {
+		batch->rc=code;
+	}
+}
+
+/*******************************************************************************
+ * batch_job: Thread validating lines of --batch, as they are read, on one
+ *  handle of the pool, until the input runs out
+ */
+static void*
+batch_job( CASCLI_BATCH* batch ) {
+	CAS* cas=cas_pool_get( batch->pool );
+	char* line=NULL;
+	size_t size=0;
+
+	if( cas==NULL ) {
+		return( NULL );
+	}
+	configure( cas,batch->config );
+	for( ;; ) {
+		unsigned long number;
+		const char* text;
+		CAS_CODE code;
+		CASCLI_RESULT* result;
+
+		pthread_mutex_lock( &batch->lock );
+		if( getline( &line,&size,batch->in )<0 ) {
+			pthread_mutex_unlock( &batch->lock );
+			break;
+		}
+		number=batch->lines++;
+		pthread_mutex_unlock( &batch->lock );
+
+		code=request( cas,line,batch->protocol,batch->renew,&text );
+
+		pthread_mutex_lock( &batch->lock );
+		if( batch->tagged ) {
+			batch_write( batch,number,code,text );
+			pthread_mutex_unlock( &batch->lock );
+			continue;
+		}
+
+		//-- Hold the result until every earlier line is written, then write
+		//--  out all the results in order from the oldest
+		while( number>=batch->writes+batch->window ) {
+			pthread_cond_wait( &batch->written,&batch->lock );
+		}
+		result=&batch->results[number%batch->window];
+		result->code=code;
+		result->text=strdup( text );
+		result->done=1;
+		for( result=&batch->results[batch->writes%batch->window]; result->done; result=&batch->results[batch->writes%batch->window] ) {
+			batch_write( batch,batch->writes,result->code,( result->text ? result->text : "" ) );
+			free( result->text );
+			result->text=NULL;
+			result->done=0;
+			batch->writes++;
+		}
+		pthread_cond_broadcast( &batch->written );
+		pthread_mutex_unlock( &batch->lock );
+	}
+
+	free( line );
+	cas_pool_put( batch->pool,cas );
+	return( NULL );
+}
+
+/*******************************************************************************
+ * batch: Validate each line of in with jobs validations in flight, writing
+ *  the results to stdout and a summary to stderr.  Returns the first failure.
+ */
+static CAS_CODE
+batch( FILE* in, int jobs, int tagged, CAS_PROTOCOL protocol, int renew, const CASCLI_CONFIG* config ) {
+	CASCLI_BATCH batch;
+	struct timespec start, end;
+	pthread_t* threads;
+	double seconds;
+	int started;
+	int i;
+
+	memset( &batch,0,sizeof( batch ) );
+	batch.in=in;
+	batch.config=config;
+	batch.protocol=protocol;
+	batch.renew=renew;
+	batch.tagged=tagged;
+	batch.window=( unsigned long )jobs*CASCLI_BATCH_WINDOW;
+	batch.rc=CAS_VALIDATION_SUCCESS;
+	batch.pool=pool_new( config );
+	batch.results=calloc( batch.window,sizeof( CASCLI_RESULT ) );
+	threads=calloc( jobs,sizeof( pthread_t ) );
+	if( batch.pool==NULL || batch.results==NULL || threads==NULL ) {
+		cas_pool_zap( batch.pool );
+		free( batch.results );
+		free( threads );
+		return( CAS_ENOMEM );
+	}
+	pthread_mutex_init( &batch.lock,NULL );
+	pthread_cond_init( &batch.written,NULL );
+
+	clock_gettime( CLOCK_MONOTONIC,&start );
+	for( started=0; started<jobs; started++ ) {
+		if( pthread_create( &threads[started],NULL,( void*(*)( void* ) )batch_job,&batch )!=0 ) {
+			break;
+		}
+	}
+	for( i=0; i<started; i++ ) {
+		pthread_join( threads[i],NULL );
+	}
+	clock_gettime( CLOCK_MONOTONIC,&end );
+	fflush( stdout );
+
+	seconds=( end.tv_sec-start.tv_sec )+( end.tv_nsec-start.tv_nsec )/1e9;
+	fprintf( stderr,"validations=%lu jobs=%d seconds=%.3f validations_per_second=%.0f\n",batch.lines,started,seconds,( seconds>0 ? batch.lines/seconds : 0 ) );
+	for( i=0; i<CASCLI_CODES; i++ ) {
+		if( batch.codes[i] ) {
+			fprintf( stderr,"(%d) %s: %lu\n",i,cas_code_str( i ),batch.codes[i] );
+		}
+	}
+	if( started==0 ) {
+		batch.rc=CAS_FAIL;
+	}
+
+	pthread_cond_destroy( &batch.written );
+	pthread_mutex_destroy( &batch.lock );
+	cas_pool_zap( batch.pool );
+	free( batch.results );
+	free( threads );
+	return( batch.rc );
+}
+
+/*******************************************************************************
+ * client: Validate each ticket through a cascli --serve, printing the results
+ *  as an in-process validation would.  Returns the first failure.
+ */
+static CAS_CODE
+client( const char* path, char* protocol, char* url, char* service, char** tickets, int count, int renew ) {
+	struct sockaddr_un address;
+	CAS_CODE rc=CAS_VALIDATION_SUCCESS;
+	char line[CASCLI_REQUEST_MAX];
+	FILE* in;
+	int fd;
+	int i;
+
+	memset( &address,0,sizeof( address ) );
+	address.sun_family=AF_UNIX;
+	strncpy( address.sun_path,path,sizeof( address.sun_path )-1 );
+	if( (fd=socket( AF_UNIX,SOCK_STREAM,0 ))<0 || connect( fd,( struct sockaddr* )&address,sizeof( address ) )!=0 ) {
+		fprintf( stderr,"Could not connect to %s: %s\n",path,strerror( errno ) );
+		if( fd>=0 ) close( fd );
+		return( CAS_FAIL );
+	}
+	if( (in=fdopen( fd,"r+" ))==NULL ) {
+		close( fd );
+		return( CAS_ENOMEM );
+	}
+
+	for( i=0; i<count; i++ ) {
+		CAS_CODE code=CAS_FAIL;
+		char* text="";
+
+		fprintf( in,"%s %s %s %s%s\n",protocol,url,service,tickets[i],( renew ? " renew" : "" ) );
+		fflush( in );
+		if( fgets( line,sizeof( line ),in ) ) {
+			line[strcspn( line,"\n" )]='\0';
+			code=strtol( line,&text,10 );
+			if( *text==' ' ) text++;
+		}
+
+		if( code==CAS_VALIDATION_SUCCESS ) {
+			fprintf( stdout,"%s\n",text );
+		} else {
+			fprintf( stderr,"(%d) %s: %s\n",code,cas_code_str( code ),text );
+			if( rc==CAS_VALIDATION_SUCCESS ) rc=code;
+		}
+	}
+
+	fclose( in );
+	return( rc );
+}
+
 int
 main( int argc, char** argv ) {
 	CAS_CODE code=CAS_FAIL;
@@ -21,6 +576,27 @@ main( int argc, char** argv ) {
 	int cas_renew=0;
 	char* cas_ca_location=NULL;
 	int cas_ca_verify=1;
+	int cas_stats=0;
+	char* cas_attribute=NULL;
+	char* cas_limits=NULL;
+	int cas_http2=0;
+	int cas_compression=0;
+	CAS_ENDPOINTS* cas_endpoints=NULL;
+	long cas_deadline=0;
+	int cas_hedging=0;
+	int cas_prewarming=0;
+	char* cas_admission=NULL;
+	unsigned long cas_negative=0;
+	char* cas_ticket_prefixes=NULL;
+	char* cas_session_cache=NULL;
+	char* cas_session_id=NULL;
+	CAS_SESSIONS* cas_sessions=NULL;
+	char* cas_serve=NULL;
+	char* cas_connect=NULL;
+	char* cas_batch=NULL;
+	int cas_jobs=CASCLI_BATCH_JOBS;
+	int cas_tagged=0;
+	int cas_tracing=0;
 	char* cas_validation_url;
 	char* cas_escaped_service;
 	char* cas_service_ticket;
@@ -36,6 +612,10 @@ main( int argc, char** argv ) {
 				protocol=argv[i];
 			}else if(strcmp(argv[i],"cas2")==0){
 				protocol=argv[i];
+			}else if(strcmp(argv[i],"cas3")==0){
+				protocol=argv[i];
+			}else if(strcmp(argv[i],"cas3json")==0){
+				protocol=argv[i];
 			}else{
 				fprintf(stderr,"Unknown protocol %s\n",argv[i]);
 				usage();
@@ -48,6 +628,65 @@ main( int argc, char** argv ) {
 			cas_ca_location=argv[i];
 		}else if(strcmp(argv[i],"-k")==0){
 			cas_ca_verify=0;
+		}else if(strcmp(argv[i],"-s")==0){
+			cas_stats=1;
+		}else if(strcmp(argv[i],"-a")==0){
+			i++;
+			cas_attribute=argv[i];
+		}else if(strcmp(argv[i],"-l")==0){
+			i++;
+			cas_limits=argv[i];
+		}else if(strcmp(argv[i],"-2")==0){
+			cas_http2=1;
+		}else if(strcmp(argv[i],"-z")==0){
+			cas_compression=1;
+		}else if(strcmp(argv[i],"-d")==0){
+			i++;
+			cas_deadline=atol(argv[i]);
+		}else if(strcmp(argv[i],"-H")==0){
+			i++;
+			cas_hedging=atoi(argv[i]);
+		}else if(strcmp(argv[i],"--serve")==0){
+			i++;
+			cas_serve=argv[i];
+		}else if(strcmp(argv[i],"--connect")==0){
+			i++;
+			cas_connect=argv[i];
+		}else if(strcmp(argv[i],"--batch")==0){
+			i++;
+			cas_batch=argv[i];
+		}else if(strcmp(argv[i],"-j")==0){
+			i++;
+			cas_jobs=atoi(argv[i]);
+		}else if(strcmp(argv[i],"-t")==0){
+			cas_tagged=1;
+		}else if(strcmp(argv[i],"-T")==0){
+			cas_tracing=1;
+		}else if(strcmp(argv[i],"-S")==0){
+			i++;
+			cas_session_cache=argv[i];
+		}else if(strcmp(argv[i],"-i")==0){
+			i++;
+			cas_session_id=argv[i];
+		}else if(strcmp(argv[i],"-n")==0){
+			i++;
+			cas_negative=strtoul(argv[i],NULL,10);
+		}else if(strcmp(argv[i],"-x")==0){
+			i++;
+			cas_ticket_prefixes=argv[i];
+		}else if(strcmp(argv[i],"-A")==0){
+			i++;
+			cas_admission=argv[i];
+		}else if(strcmp(argv[i],"-w")==0){
+			cas_prewarming=1;
+		}else if(strcmp(argv[i],"-e")==0){
+			i++;
+			if(cas_endpoints==NULL) cas_endpoints=cas_endpoints_new();
+			if(cas_endpoints_add(cas_endpoints,argv[i])!=CAS_VALIDATION_SUCCESS){
+				fprintf(stderr,"Bad endpoint %s\n",argv[i]);
+				usage();
+				return(CAS_FAIL);
+			}
 		}else{
 			fprintf(stderr,"Unknown option %s\n",argv[i]);
 			usage();
@@ -55,46 +694,152 @@ main( int argc, char** argv ) {
 		}
 		i++;
 	}
+
+	if(cas_admission){
+		double rate=0;
+		int burst=1,max_in_flight=0,max_queued=0;
+		long queue_timeout=0;
+		if(cas_endpoints==NULL || sscanf(cas_admission,"%lf,%d,%d,%d,%ld",&rate,&burst,&max_in_flight,&max_queued,&queue_timeout)<1){
+			fprintf(stderr,"Bad admission control %s, or no -e\n",cas_admission);
+			usage();
+			return(CAS_FAIL);
+		}
+		cas_endpoints_set_admission(cas_endpoints,rate,burst,max_in_flight,max_queued,queue_timeout);
+	}
+
+	if(cas_tracing){
+		cas_set_tracing(CAS_DEFAULT_TRACE_EVENTS);
+	}
+
+	CASCLI_CONFIG config={ cas_ca_location,cas_ca_verify,cas_limits,cas_http2,cas_compression,cas_endpoints,cas_deadline,cas_hedging,cas_ticket_prefixes };
+	if( cas_serve ) {
+		if( (argc-i)>1 ) {
+			fprintf(stderr,"Too many arguments %d-%d\n",argc,i);
+			usage();
+			return(CAS_FAIL);
+		}
+		cas_init();
+		cas_set_negative_cache( cas_negative,CAS_DEFAULT_NEGATIVE_TTL_MS );
+		code=serve( cas_serve,( i<argc ? argv[i] : NULL ),&config,cas_tracing );
+		cas_destroy();
+		return( code );
+	}
+	if( cas_batch ) {
+		FILE* in=( strcmp( cas_batch,"-" )==0 ? stdin : fopen( cas_batch,"r" ) );
+		if( i<argc || cas_jobs<1 || in==NULL ) {
+			if( in==NULL ) fprintf(stderr,"Could not open %s\n",cas_batch);
+			usage();
+			return(CAS_FAIL);
+		}
+		cas_init();
+		cas_set_negative_cache( cas_negative,CAS_DEFAULT_NEGATIVE_TTL_MS );
+		code=batch( in,cas_jobs,cas_tagged,protocol_code( protocol ),cas_renew,&config );
+		if( cas_tracing ) cas_trace_dump( STDERR_FILENO );
+		cas_endpoints_zap( cas_endpoints );
+		cas_destroy();
+		if( in!=stdin ) fclose( in );
+		return( code );
+	}
            
-	if( (argc-i)!=3 ) { //-- Check for arguments
-		fprintf(stderr,"Too many arguments %d-%d\n",argc,i);
+	if( (argc-i)<3 ) { //-- Check for arguments
+		fprintf(stderr,"Too few arguments %d-%d\n",argc,i);
 		usage();
 		return(CAS_FAIL);
 	}
 	
 	cas_validation_url=argv[i++];
 	cas_escaped_service=argv[i++];
-	cas_service_ticket=argv[i++];
+	cas_service_ticket=argv[i];
 	
 	cas_debug("\nValidation URL: %s\nEscaped Service: %s\nService Ticket:%s\nProtocol: %s\nMode: %s\nCertificate Path: %s\nVerify Server Certificate: %s\n",cas_validation_url,cas_escaped_service,cas_service_ticket,protocol,cas_code_str_str(mode),(cas_ca_location?(cas_ca_location):("libcurl default")),(cas_ca_verify?("yes"):("no")));
 	
-	//-- Init libcas, obtain new CAS handle
+	if( cas_connect ) {
+		return( client( cas_connect,protocol,cas_validation_url,cas_escaped_service,&argv[i],argc-i,cas_renew ) );
+	}
+	
+	//-- Init libcas, attach to the session cache, obtain new CAS handle
+	cas_set_mem_counting(cas_stats);
 	cas_init();
+	cas_set_negative_cache(cas_negative,CAS_DEFAULT_NEGATIVE_TTL_MS);
+	if(cas_session_cache){
+		if((cas_sessions=cas_sessions_new(cas_session_cache,1024))==NULL){
+			fprintf(stderr,"Could not open session cache %s\n",cas_session_cache);
+			return(CAS_FAIL);
+		}
+	}
 	CAS* cas=cas_new();
-	if(cas_ca_verify){
-		if(cas_ca_location){
-			cas_set_ssl_ca(cas,cas_ca_location);
+	configure(cas,&config);
+	if(cas_prewarming){
+		code=cas_prewarm(cas,cas_validation_url);
+		if(code!=CAS_VALIDATION_SUCCESS){
+			fprintf(stderr,"(%d) %s: prewarming %s\n",code,cas_code_str(code),cas_validation_url);
 		}
-		cas_set_ssl_validate_server(cas,1);
-	}else{
-		cas_set_ssl_validate_server(cas,0);
 	}
 	
-	//-- Call appropriate validation function for supplied protocol
-	if( strcmp(protocol,"cas1")==0 ) {
-		code=cas_cas1_validate( cas,cas_validation_url,cas_escaped_service,cas_service_ticket, cas_renew);
-	} else if( strcmp(protocol,"cas2")==0 ) {
-		code=cas_cas2_servicevalidate( cas,cas_validation_url,cas_escaped_service,cas_service_ticket, cas_renew);
+	//-- Prepare a validator for the supplied protocol
+	CAS_PREPARED* prepared=cas_prepare( cas,cas_validation_url,cas_escaped_service,protocol_code( protocol ),cas_renew );
+
+	//-- A session already validated, by this process or another, needs no ticket
+	CAS_CODE rc=CAS_VALIDATION_SUCCESS;
+	if( cas_sessions && cas_session_id ) {
+		char principal[CAS_SESSION_PRINCIPAL_MAX];
+		if( cas_sessions_get( cas_sessions,cas_session_id,principal,sizeof( principal ) )==CAS_VALIDATION_SUCCESS ) {
+			fprintf( stdout,"%s\n",principal );
+			i=argc;
+		}
 	}
 
-	//-- Check code, act appropriately
-	if( code==CAS_VALIDATION_SUCCESS ) {
-		fprintf( stdout,"%s\n",cas_get_principal( cas ) );
-	} else {
-		fprintf( stderr,"(%d) %s: %s\n",code,cas_code_str( code ),cas_get_message(cas) );
+	//-- Validate each ticket in turn on the same handle, returning the first failure
+	for( ; i<argc; i++ ) {
+		cas_service_ticket=argv[i];
+		code=cas_prepared_validate( prepared,cas_service_ticket );
+
+		//-- Check code, act appropriately
+		if( code==CAS_VALIDATION_SUCCESS ) {
+			fprintf( stdout,"%s\n",cas_get_principal( cas ) );
+			if( cas_sessions && cas_session_id ) {
+				cas_sessions_put( cas_sessions,cas_session_id,cas_get_principal( cas ),CASCLI_SESSION_TTL );
+				cas_session_id=NULL;
+			}
+			if( cas_attribute ) {
+				char* value;
+				for( value=cas_get_attribute( cas,cas_attribute ); value; value=cas_get_attribute_next( cas,value ) ) {
+					fprintf( stdout,"%s=%s\n",cas_attribute,value );
+				}
+			}
+		} else {
+			fprintf( stderr,"(%d) %s: %s\n",code,cas_code_str( code ),cas_get_message(cas) );
+			if( rc==CAS_VALIDATION_SUCCESS ) rc=code;
+		}
+	}
+	code=rc;
+
+	if(cas_stats){
+		CAS_STATS stats;
+		cas_get_stats(cas,&stats);
+		fprintf( stderr,"validations=%lu parser_contexts=%lu fastpath_responses=%lu coalesced=%lu failovers=%lu hedges=%lu hedge_wins=%lu\n",stats.validations,stats.parser_contexts,stats.fastpath_responses,stats.coalesced,stats.failovers,stats.hedges,stats.hedge_wins );
+		fprintf( stderr,"allocations=%lu allocated_bytes=%lu\n",stats.allocations,stats.allocated_bytes );
+		fprintf( stderr,"rejected_malformed=%lu rejected_cached=%lu\n",stats.rejected_malformed,stats.rejected_cached );
+		fprintf( stderr,"shed=%lu\n",stats.shed );
+
+		CAS_TIMINGS timings;
+		cas_get_timings(cas,&timings);
+		fprintf( stderr,"namelookup_us=%.0f connect_us=%.0f appconnect_us=%.0f starttransfer_us=%.0f total_us=%.0f parse_us=%.1f bytes_received=%lu\n",timings.namelookup_us,timings.connect_us,timings.appconnect_us,timings.starttransfer_us,timings.total_us,timings.parse_us,timings.bytes_received );
+
+		CAS_SESSIONS_STATS sessions;
+		if( cas_sessions_get_stats( cas_sessions,&sessions )==CAS_VALIDATION_SUCCESS ) {
+			fprintf( stderr,"sessions=%lu capacity=%lu session_hits=%lu session_misses=%lu session_evictions=%lu\n",sessions.sessions,sessions.capacity,sessions.hits,sessions.misses,sessions.evictions );
+		}
+	}
+
+	if(cas_tracing){
+		cas_trace_dump(STDERR_FILENO);
 	}
 
+	cas_prepared_zap( prepared );
 	cas_zap( cas );
+	cas_endpoints_zap( cas_endpoints );
+	cas_sessions_zap( cas_sessions );
 	cas_destroy();
 
 	return( code );
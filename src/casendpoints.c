@@ -0,0 +1,745 @@
+/*******************************************************************************
+ * casendpoints.c
+ *
+ * Failover across the nodes of a CAS cluster
+ *
+ * A CAS_ENDPOINTS is a set of base URLs ("https://cas1.example.edu:8443"),
+ * shared by any number of handles.  A handle with endpoints still validates
+ * against the URL it is given, but with the scheme, host and port of that URL
+ * replaced by those of the endpoint chosen for the attempt.  If the transfer
+ * fails (no connection, timeout, 5xx) the validation is retried on the next
+ * best endpoint not yet tried, before the caller sees CAS_CURL_FAILURE.
+ *
+ * Each endpoint keeps exponentially weighted moving averages of the latency
+ * and error rate of the attempts made on it, and endpoints are tried in order
+ * of latency weighted by error rate, so traffic drifts away from a node as it
+ * degrades.  A circuit breaker takes an endpoint out of rotation after a run
+ * of consecutive failures; a background thread, started with the first open
+ * breaker, then probes it every cooldown until it answers again.  An open
+ * endpoint is still tried, last, when every other endpoint has failed.
+ *
+ * Admission control keeps each endpoint within its capacity: an attempt
+ * needs a token from a bucket refilled at a fixed rate, and a free slot under
+ * a cap of attempts in flight.  A blocking validation that finds neither waits
+ * for them on a bounded queue, with a timeout; anything else, or anything
+ * over the bound, is shed on the spot with CAS_OVERLOADED rather than adding
+ * to the pile-up on a server that is already slow.
+ *
+ * Everything is guarded by one mutex per set; nothing is held across a
+ * transfer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cas.h"
+#include "cas-int.h"
+
+#define CAS_ENDPOINTS_MAX 32			// - endpoints tried are a bit mask on the handle
+#define CAS_ENDPOINT_EWMA_WEIGHT 0.2	// - weight of the newest sample
+#define CAS_ENDPOINT_ERROR_PENALTY 4.0	// - a 100% error rate scores as 5 times the latency
+
+typedef struct {
+	char* url;						// - base URL, without a trailing /
+	size_t size;
+	CAS_ENDPOINT_STATE state;
+	double latency_us;				// - EWMA of attempt latency, 0 before the first
+	double error_rate;				// - EWMA of failures, 0 to 1
+	int failures_in_row;			// - consecutive failures, reset by a success
+	double reopen_us;				// - cas_clock_us() at which to probe an open breaker
+	unsigned long attempts;
+	unsigned long failures;
+
+	double tokens;					// - token bucket of admission control
+	double refilled_us;				// - cas_clock_us() tokens was last brought up to date
+	int in_flight;					// - attempts admitted and not yet released
+	int queued;						// - blocking validations waiting for admission
+	unsigned long shed;
+} CAS_ENDPOINT;
+
+struct CAS_ENDPOINTS {
+	pthread_mutex_t lock;			// - guards everything below
+	CAS_ENDPOINT endpoints[CAS_ENDPOINTS_MAX];
+	int count;
+	long connect_timeout_ms;
+	long attempt_timeout_ms;
+	int breaker_failures;
+	long breaker_cooldown_ms;
+	char* probe_path;				// - path of the first validation, probed without a ticket
+	char* probe_ssl_ca;				// - TLS settings of the handle of the first validation, for probes
+	int probe_ssl_validate_server;
+
+	int admission;					// - any of the limits below is set
+	double rate;					// - tokens per second, 0 for no limit
+	double burst;					// - tokens a bucket holds
+	int max_in_flight;				// - 0 for no limit
+	int max_queued;
+	long queue_timeout_ms;
+	pthread_cond_t released;		// - an attempt was released, for validations waiting for admission
+
+	pthread_t prober;
+	int prober_running;
+	int stopping;
+	pthread_cond_t wake;			// - a breaker opened, or the set is being zapped
+};
+
+static void* cas_endpoints_prober( CAS_ENDPOINTS* endpoints );
+
+/*******************************************************************************
+ * cas_endpoints_new: create a new, empty endpoint set
+ */
+CAS_ENDPOINTS*
+cas_endpoints_new() {
+	CAS_ENDPOINTS* endpoints=NULL;
+	pthread_condattr_t attr;
+
+	if((endpoints=cas_calloc( 1,sizeof( CAS_ENDPOINTS ) ))){
+		pthread_mutex_init( &endpoints->lock,NULL );
+		pthread_condattr_init( &attr );
+		pthread_condattr_setclock( &attr,CLOCK_MONOTONIC );
+		pthread_cond_init( &endpoints->wake,&attr );
+		pthread_cond_init( &endpoints->released,&attr );
+		pthread_condattr_destroy( &attr );
+
+		endpoints->connect_timeout_ms=CAS_DEFAULT_ENDPOINT_CONNECT_TIMEOUT_MS;
+		endpoints->breaker_failures=CAS_DEFAULT_BREAKER_FAILURES;
+		endpoints->breaker_cooldown_ms=CAS_DEFAULT_BREAKER_COOLDOWN_MS;
+	}
+
+	return( endpoints );
+}
+
+/*******************************************************************************
+ * cas_endpoints_add: add a base URL to the set
+ */
+CAS_CODE
+cas_endpoints_add( CAS_ENDPOINTS* endpoints, const char* base_url ) {
+	CAS_CODE rc=CAS_VALIDATION_SUCCESS;
+
+	if(!endpoints || !base_url || strstr( base_url,"://" )==NULL) {
+		return(CAS_INVALID_PARAMETERS);
+	}
+
+	pthread_mutex_lock( &endpoints->lock );
+	if( endpoints->count==CAS_ENDPOINTS_MAX ) {
+		rc=CAS_INVALID_PARAMETERS;
+	} else {
+		CAS_ENDPOINT* endpoint=&endpoints->endpoints[endpoints->count];
+		memset( endpoint,0,sizeof( CAS_ENDPOINT ) );
+		if((endpoint->url=cas_strdup( base_url ))==NULL) {
+			rc=CAS_ENOMEM;
+		} else {
+			endpoint->size=strlen( endpoint->url );
+			endpoint->tokens=endpoints->burst;
+			endpoint->refilled_us=cas_clock_us();
+			while( endpoint->size && endpoint->url[endpoint->size-1]=='/' ) {
+				endpoint->url[--endpoint->size]='\0';
+			}
+			endpoints->count++;
+		}
+	}
+	pthread_mutex_unlock( &endpoints->lock );
+
+	return( rc );
+}
+
+/*******************************************************************************
+ * cas_endpoints_set_timeouts: set the connect and whole-attempt timeouts of
+ *  each attempt, in milliseconds, 0 for cURL's defaults
+ */
+void
+cas_endpoints_set_timeouts( CAS_ENDPOINTS* endpoints, long connect_timeout_ms, long attempt_timeout_ms ) {
+	pthread_mutex_lock( &endpoints->lock );
+	endpoints->connect_timeout_ms=( connect_timeout_ms>0 ? connect_timeout_ms : 0 );
+	endpoints->attempt_timeout_ms=( attempt_timeout_ms>0 ? attempt_timeout_ms : 0 );
+	pthread_mutex_unlock( &endpoints->lock );
+}
+
+/*******************************************************************************
+ * cas_endpoints_set_breaker: set the consecutive failures that open the
+ *  breaker of an endpoint, 0 to never open it, and the time between probes
+ */
+void
+cas_endpoints_set_breaker( CAS_ENDPOINTS* endpoints, int failures, long cooldown_ms ) {
+	pthread_mutex_lock( &endpoints->lock );
+	endpoints->breaker_failures=( failures>0 ? failures : 0 );
+	endpoints->breaker_cooldown_ms=( cooldown_ms>0 ? cooldown_ms : CAS_DEFAULT_BREAKER_COOLDOWN_MS );
+	pthread_mutex_unlock( &endpoints->lock );
+}
+
+/*******************************************************************************
+ * cas_endpoints_set_admission: set the token bucket, cap on attempts in
+ *  flight and wait queue of every endpoint, 0 for no limit
+ */
+void
+cas_endpoints_set_admission( CAS_ENDPOINTS* endpoints, double rate, int burst, int max_in_flight, int max_queued, long queue_timeout_ms ) {
+	double now=cas_clock_us();
+	int i;
+
+	pthread_mutex_lock( &endpoints->lock );
+	endpoints->rate=( rate>0 ? rate : 0 );
+	endpoints->burst=( burst>1 ? burst : 1 );
+	endpoints->max_in_flight=( max_in_flight>0 ? max_in_flight : 0 );
+	endpoints->max_queued=( max_queued>0 && queue_timeout_ms>0 ? max_queued : 0 );
+	endpoints->queue_timeout_ms=( queue_timeout_ms>0 ? queue_timeout_ms : 0 );
+	endpoints->admission=( endpoints->rate>0 || endpoints->max_in_flight>0 );
+	for( i=0; i<endpoints->count; i++ ) {
+		endpoints->endpoints[i].tokens=endpoints->burst;
+		endpoints->endpoints[i].refilled_us=now;
+	}
+	//Waiters go by the new limits
+	pthread_cond_broadcast( &endpoints->released );
+	pthread_mutex_unlock( &endpoints->lock );
+}
+
+/*******************************************************************************
+ * cas_endpoints_get_stats: Retrieve the health of endpoint index
+ */
+CAS_CODE
+cas_endpoints_get_stats( CAS_ENDPOINTS* endpoints, int index, CAS_ENDPOINT_STATS* stats ) {
+	CAS_CODE rc=CAS_VALIDATION_SUCCESS;
+
+	if(!endpoints || !stats) {
+		return(CAS_INVALID_PARAMETERS);
+	}
+
+	pthread_mutex_lock( &endpoints->lock );
+	if( index<0 || index>=endpoints->count ) {
+		rc=CAS_INVALID_PARAMETERS;
+	} else {
+		CAS_ENDPOINT* endpoint=&endpoints->endpoints[index];
+		stats->url=endpoint->url;
+		stats->state=endpoint->state;
+		stats->latency_us=endpoint->latency_us;
+		stats->error_rate=endpoint->error_rate;
+		stats->attempts=endpoint->attempts;
+		stats->failures=endpoint->failures;
+		stats->in_flight=endpoint->in_flight;
+		stats->queued=endpoint->queued;
+		stats->shed=endpoint->shed;
+	}
+	pthread_mutex_unlock( &endpoints->lock );
+
+	return( rc );
+}
+
+/*******************************************************************************
+ * cas_endpoints_zap: destroy the set, stopping its prober.  Every handle using
+ *  it must have been zapped, or given other endpoints, first.
+ */
+void
+cas_endpoints_zap( CAS_ENDPOINTS* endpoints ) {
+	int i;
+
+	if(endpoints){
+		pthread_mutex_lock( &endpoints->lock );
+		endpoints->stopping=1;
+		pthread_cond_broadcast( &endpoints->wake );
+		pthread_mutex_unlock( &endpoints->lock );
+		if( endpoints->prober_running ) {
+			pthread_join( endpoints->prober,NULL );
+		}
+
+		for( i=0; i<endpoints->count; i++ ) {
+			cas_free( endpoints->endpoints[i].url );
+		}
+		if( endpoints->probe_path ) cas_free( endpoints->probe_path );
+		if( endpoints->probe_ssl_ca ) cas_free( endpoints->probe_ssl_ca );
+		pthread_cond_destroy( &endpoints->wake );
+		pthread_cond_destroy( &endpoints->released );
+		pthread_mutex_destroy( &endpoints->lock );
+
+		cas_free( endpoints );
+	}
+}
+
+/*******************************************************************************
+ * cas_set_endpoints: validate on the endpoints of a set, NULL for the URL as
+ *  given
+ */
+void
+cas_set_endpoints( CAS* cas, CAS_ENDPOINTS* endpoints ) {
+	cas->endpoints=endpoints;
+	if( endpoints==NULL ) {
+		curl_easy_setopt( cas->curl,CURLOPT_CONNECTTIMEOUT_MS,0L );
+		cas->attempt_timeout_ms=0;
+	}
+}
+
+/*******************************************************************************
+ * cas_endpoint_path: The part of url after its scheme and authority
+ */
+static const char*
+cas_endpoint_path( const char* url ) {
+	const char* p=strstr( url,"://" );
+
+	if( p==NULL ) {
+		return( url );
+	}
+	for( p+=3; *p && *p!='/' && *p!='?'; p++ );
+	return( p );
+}
+
+/*******************************************************************************
+ * cas_endpoint_score: Order of preference of an endpoint, lowest first
+ */
+static double
+cas_endpoint_score( CAS_ENDPOINT* endpoint ) {
+	return( endpoint->latency_us*( 1.0+CAS_ENDPOINT_ERROR_PENALTY*endpoint->error_rate ) );
+}
+
+/*******************************************************************************
+ * cas_endpoints_pick: Render the URL of the next attempt of the validation in
+ *  progress on cas into cas->endpoint_url, on the best endpoint not yet tried.
+ *  Must be called with the lock held.
+ */
+static const char*
+cas_endpoints_pick( CAS* cas, CAS_ENDPOINTS* endpoints ) {
+	CAS_ENDPOINT* best=NULL;
+	int best_index=-1;
+	int i;
+
+	for( i=0; i<endpoints->count; i++ ) {
+		CAS_ENDPOINT* endpoint=&endpoints->endpoints[i];
+		if( cas->endpoint_tried&( 1u<<i ) ) {
+			continue;
+		}
+		//Any closed breaker beats any open one, then the lowest score
+		if( best==NULL
+		 || ( best->state!=CAS_ENDPOINT_CLOSED && endpoint->state==CAS_ENDPOINT_CLOSED )
+		 || ( ( best->state==CAS_ENDPOINT_CLOSED )==( endpoint->state==CAS_ENDPOINT_CLOSED ) && cas_endpoint_score( endpoint )<cas_endpoint_score( best ) ) ) {
+			best=endpoint;
+			best_index=i;
+		}
+	}
+	if( best==NULL ) {
+		return( NULL );
+	}
+
+	const char* path=cas_endpoint_path( cas->endpoint_target );
+	size_t path_size=strlen( path );
+	if( cas_buffer_reserve( &cas->endpoint_url,best->size+path_size+1 )!=CAS_VALIDATION_SUCCESS ) {
+		return( NULL );
+	}
+	memcpy( cas->endpoint_url.contents,best->url,best->size );
+	memcpy( &cas->endpoint_url.contents[best->size],path,path_size+1 );
+	cas->endpoint_url.size=best->size+path_size;
+
+	cas->endpoint_tried|=1u<<best_index;
+	cas->endpoint_index=best_index;
+	curl_easy_setopt( cas->curl,CURLOPT_CONNECTTIMEOUT_MS,endpoints->connect_timeout_ms );
+	cas->attempt_timeout_ms=endpoints->attempt_timeout_ms;
+
+	cas_debug("Attempt on endpoint %d: %s",best_index,cas->endpoint_url.contents);
+	return( cas->endpoint_url.contents );
+}
+
+/*******************************************************************************
+ * cas_endpoints_first: URL of the first attempt of a validation of url
+ */
+const char*
+cas_endpoints_first( CAS* cas, const char* url ) {
+	CAS_ENDPOINTS* endpoints=cas->endpoints;
+	const char* first;
+
+	pthread_mutex_lock( &endpoints->lock );
+	if( endpoints->count==0 ) {
+		pthread_mutex_unlock( &endpoints->lock );
+		cas->endpoint_index=-1;
+		return( url );
+	}
+	if( endpoints->probe_path==NULL ) {
+		const char* path=cas_endpoint_path( url );
+		endpoints->probe_path=cas_strndup( path,strcspn( path,"?" ) );
+		endpoints->probe_ssl_ca=( cas->ssl_ca ? cas_strdup( cas->ssl_ca ) : NULL );
+		endpoints->probe_ssl_validate_server=cas->ssl_validate_server;
+	}
+	cas->endpoint_target=url;
+	cas->endpoint_tried=0;
+	first=cas_endpoints_pick( cas,endpoints );
+	pthread_mutex_unlock( &endpoints->lock );
+
+	return( first );
+}
+
+/*******************************************************************************
+ * cas_endpoints_hedge: URL of a second request for the validation in flight on
+ *  cas, on the best endpoint cas has not tried, or NULL if it has tried all
+ */
+const char*
+cas_endpoints_hedge( CAS* hedge, CAS* cas ) {
+	CAS_ENDPOINTS* endpoints=cas->endpoints;
+	const char* url;
+
+	pthread_mutex_lock( &endpoints->lock );
+	hedge->endpoint_target=cas->endpoint_target;
+	hedge->endpoint_tried=cas->endpoint_tried;
+	url=cas_endpoints_pick( hedge,endpoints );
+	pthread_mutex_unlock( &endpoints->lock );
+
+	return( url );
+}
+
+/*******************************************************************************
+ * cas_endpoints_urls: The URLs url is validated at: on every endpoint whose
+ *  breaker is closed, or url itself if the set is empty.  A NULL-terminated
+ *  array, to free with cas_endpoints_urls_free(), or NULL on failure.
+ */
+char**
+cas_endpoints_urls( CAS_ENDPOINTS* endpoints, const char* url ) {
+	const char* path=cas_endpoint_path( url );
+	size_t path_size=strlen( path );
+	char** urls;
+	int count=0;
+	int i;
+
+	pthread_mutex_lock( &endpoints->lock );
+	if((urls=cas_calloc( endpoints->count+2,sizeof( char* ) ))==NULL) {
+		pthread_mutex_unlock( &endpoints->lock );
+		return( NULL );
+	}
+	if( endpoints->count==0 ) {
+		urls[count++]=cas_strdup( url );
+	}
+	for( i=0; i<endpoints->count; i++ ) {
+		CAS_ENDPOINT* endpoint=&endpoints->endpoints[i];
+		if( endpoint->state!=CAS_ENDPOINT_CLOSED ) {
+			continue;
+		}
+		if((urls[count]=cas_malloc( endpoint->size+path_size+1 ))) {
+			memcpy( urls[count],endpoint->url,endpoint->size );
+			memcpy( &urls[count][endpoint->size],path,path_size+1 );
+		}
+		count++;
+	}
+	pthread_mutex_unlock( &endpoints->lock );
+
+	for( i=0; i<count && urls[i]; i++ );
+	if( i<count ) {
+		for( i=0; i<count; i++ ) {
+			cas_free( urls[i] );
+		}
+		cas_free( urls );
+		return( NULL );
+	}
+	return( urls );
+}
+
+/*******************************************************************************
+ * cas_endpoints_urls_free: Free an array of cas_endpoints_urls()
+ */
+void
+cas_endpoints_urls_free( char** urls ) {
+	char** url;
+
+	if( urls ) {
+		for( url=urls; *url; url++ ) {
+			cas_free( *url );
+		}
+		cas_free( urls );
+	}
+}
+
+/*******************************************************************************
+ * cas_endpoint_failed: Whether a transfer says nothing of the validation but
+ *  that the endpoint could not answer it
+ */
+static int
+cas_endpoint_failed( CAS* cas, CURLcode status ) {
+	long http=0;
+
+	//A 5xx fails, even once its error page has failed the parse
+	curl_easy_getinfo( cas->curl,CURLINFO_RESPONSE_CODE,&http );
+	if( http>=500 ) {
+		return( 1 );
+	}
+	if( status==CURLE_WRITE_ERROR && cas->abort!=CAS_ABORT_NONE ) {
+		return( 0 );
+	}
+	return( status!=CURLE_OK );
+}
+
+/*******************************************************************************
+ * cas_endpoint_update: Fold the outcome of an attempt into the health of
+ *  endpoint, opening its breaker as needed.  Must be called with the lock held.
+ */
+static void
+cas_endpoint_update( CAS_ENDPOINTS* endpoints, CAS_ENDPOINT* endpoint, int failed, double latency_us ) {
+	endpoint->attempts++;
+	if( endpoint->latency_us==0 ) {
+		endpoint->latency_us=latency_us;
+	} else {
+		endpoint->latency_us+=CAS_ENDPOINT_EWMA_WEIGHT*( latency_us-endpoint->latency_us );
+	}
+	endpoint->error_rate+=CAS_ENDPOINT_EWMA_WEIGHT*( ( failed ? 1.0 : 0.0 )-endpoint->error_rate );
+
+	if( !failed ) {
+		endpoint->failures_in_row=0;
+		return;
+	}
+	endpoint->failures++;
+	endpoint->failures_in_row++;
+	if( endpoint->state==CAS_ENDPOINT_CLOSED && endpoints->breaker_failures && endpoint->failures_in_row>=endpoints->breaker_failures ) {
+		cas_debug("Opening the breaker of %s",endpoint->url);
+		endpoint->state=CAS_ENDPOINT_OPEN;
+		endpoint->reopen_us=cas_clock_us()+endpoints->breaker_cooldown_ms*1e3;
+		if( !endpoints->prober_running && !endpoints->stopping
+		 && pthread_create( &endpoints->prober,NULL,( void*(*)( void* ) )cas_endpoints_prober,endpoints )==0 ) {
+			endpoints->prober_running=1;
+		}
+		pthread_cond_broadcast( &endpoints->wake );
+	}
+}
+
+/*******************************************************************************
+ * cas_endpoints_wait: Wait on cond for at most wait_us.  Must be called with
+ *  the lock held.
+ */
+static void
+cas_endpoints_wait( CAS_ENDPOINTS* endpoints, pthread_cond_t* cond, double wait_us ) {
+	struct timespec until;
+
+	clock_gettime( CLOCK_MONOTONIC,&until );
+	until.tv_sec+=( time_t )( wait_us/1e6 );
+	until.tv_nsec+=( long )( ( wait_us-( double )( long )( wait_us/1e6 )*1e6 )*1e3 );
+	if( until.tv_nsec>=1000000000L ) {
+		until.tv_sec++;
+		until.tv_nsec-=1000000000L;
+	}
+	pthread_cond_timedwait( cond,&endpoints->lock,&until );
+}
+
+/*******************************************************************************
+ * cas_endpoint_admissible: Time until endpoint can admit an attempt, 0 if it
+ *  can now, -1 if only a release can make room.  Must be called with the lock
+ *  held.
+ */
+static double
+cas_endpoint_admissible( CAS_ENDPOINTS* endpoints, CAS_ENDPOINT* endpoint, double now ) {
+	if( endpoints->rate>0 ) {
+		endpoint->tokens+=( now-endpoint->refilled_us )*endpoints->rate/1e6;
+		if( endpoint->tokens>endpoints->burst ) endpoint->tokens=endpoints->burst;
+	}
+	endpoint->refilled_us=now;
+
+	if( endpoints->max_in_flight && endpoint->in_flight>=endpoints->max_in_flight ) {
+		return( -1 );
+	}
+	if( endpoints->rate>0 && endpoint->tokens<1 ) {
+		return( ( 1-endpoint->tokens )*1e6/endpoints->rate );
+	}
+	return( 0 );
+}
+
+/*******************************************************************************
+ * cas_endpoints_admit: Admit the attempt about to start on cas to its
+ *  endpoint, waiting in its queue if wait is set.  Returns 1 if admitted, 0 if
+ *  shed, flagging cas->shed for cas_finish().
+ */
+int
+cas_endpoints_admit( CAS* cas, int wait ) {
+	CAS_ENDPOINTS* endpoints=cas->endpoints;
+	CAS_ENDPOINT* endpoint;
+	double until_us=0;
+	double delay_us;
+	int queued=0;
+
+	cas->shed=0;
+	if( endpoints==NULL || cas->endpoint_index<0 || cas->admission_index>=0 ) {
+		return( 1 );
+	}
+
+	pthread_mutex_lock( &endpoints->lock );
+	if( !endpoints->admission || cas->endpoint_index>=endpoints->count ) {
+		pthread_mutex_unlock( &endpoints->lock );
+		return( 1 );
+	}
+	endpoint=&endpoints->endpoints[cas->endpoint_index];
+	for( ;; ) {
+		double now=cas_clock_us();
+		if( (delay_us=cas_endpoint_admissible( endpoints,endpoint,now ))==0 ) {
+			break;
+		}
+		if( !queued ) {
+			if( !wait || endpoint->queued>=endpoints->max_queued ) {
+				break;
+			}
+			until_us=now+endpoints->queue_timeout_ms*1e3;
+			if( cas->deadline_us && cas->deadline_us<until_us ) until_us=cas->deadline_us;
+			endpoint->queued++;
+			queued=1;
+		}
+		if( now>=until_us ) {
+			break;
+		}
+		//A token comes with time, a slot with a release
+		if( delay_us<0 || now+delay_us>until_us ) delay_us=until_us-now;
+		cas_endpoints_wait( endpoints,&endpoints->released,delay_us );
+	}
+	if( queued ) {
+		endpoint->queued--;
+	}
+
+	if( delay_us==0 ) {
+		if( endpoints->rate>0 ) endpoint->tokens-=1;
+		endpoint->in_flight++;
+		cas->admission_index=cas->endpoint_index;
+	} else {
+		cas_debug("Shedding an attempt on %s",endpoint->url);
+		endpoint->shed++;
+		cas->shed=1;
+	}
+	pthread_mutex_unlock( &endpoints->lock );
+
+	return( !cas->shed );
+}
+
+/*******************************************************************************
+ * cas_endpoint_release: Release the attempt admitted on cas.  Must be called
+ *  with the lock held.
+ */
+static void
+cas_endpoint_release( CAS_ENDPOINTS* endpoints, CAS* cas ) {
+	if( cas->admission_index>=0 && cas->admission_index<endpoints->count ) {
+		endpoints->endpoints[cas->admission_index].in_flight--;
+		pthread_cond_broadcast( &endpoints->released );
+	}
+	cas->admission_index=-1;
+}
+
+/*******************************************************************************
+ * cas_endpoints_release: Release the attempt admitted on cas, if any, once
+ *  its transfer is over
+ */
+void
+cas_endpoints_release( CAS* cas ) {
+	if( cas->admission_index>=0 && cas->endpoints ) {
+		pthread_mutex_lock( &cas->endpoints->lock );
+		cas_endpoint_release( cas->endpoints,cas );
+		pthread_mutex_unlock( &cas->endpoints->lock );
+	}
+}
+
+/*******************************************************************************
+ * cas_endpoints_failover: Record the outcome of the attempt just made by cas,
+ *  returning the URL of the next attempt if it failed and an endpoint is left
+ *  to try, NULL if the transfer is to be finished as it is
+ */
+const char*
+cas_endpoints_failover( CAS* cas, CURLcode status ) {
+	CAS_ENDPOINTS* endpoints=cas->endpoints;
+	const char* next=NULL;
+	double seconds=0;
+	int failed=cas_endpoint_failed( cas,status );
+
+	curl_easy_getinfo( cas->curl,CURLINFO_TOTAL_TIME,&seconds );
+
+	pthread_mutex_lock( &endpoints->lock );
+	cas_endpoint_release( endpoints,cas );
+	if( cas->endpoint_index>=0 && cas->endpoint_index<endpoints->count ) {
+		cas_endpoint_update( endpoints,&endpoints->endpoints[cas->endpoint_index],failed,seconds*1e6 );
+	}
+	if( failed ) {
+		next=cas_endpoints_pick( cas,endpoints );
+	}
+	pthread_mutex_unlock( &endpoints->lock );
+
+	return( next );
+}
+
+/*******************************************************************************
+ * cas_endpoint_probe: Whether an endpoint answers a ticketless request for
+ *  the validation path, which any live CAS server rejects quickly, with the
+ *  TLS settings of the validations
+ */
+static int
+cas_endpoint_probe( const char* url, long timeout_ms, const char* capath, int verify ) {
+	CURL* curl=curl_easy_init();
+	long http=0;
+	CURLcode status;
+
+	if( curl==NULL ) {
+		return( 0 );
+	}
+	curl_easy_setopt( curl,CURLOPT_URL,url );
+	curl_easy_setopt( curl,CURLOPT_USERAGENT,PACKAGE_STRING );
+	curl_easy_setopt( curl,CURLOPT_NOBODY,1L );
+	curl_easy_setopt( curl,CURLOPT_NOSIGNAL,1L );
+#if LIBCURL_VERSION_NUM>=0x075500
+	curl_easy_setopt( curl,CURLOPT_PROTOCOLS_STR,"http,https,file" );
+#else
+	curl_easy_setopt( curl,CURLOPT_PROTOCOLS,( long )( CURLPROTO_HTTP|CURLPROTO_HTTPS|CURLPROTO_FILE ) );
+#endif
+	curl_easy_setopt( curl,CURLOPT_TIMEOUT_MS,timeout_ms );
+	cas_curl_ssl( curl,capath,verify );
+
+	status=curl_easy_perform( curl );
+	curl_easy_getinfo( curl,CURLINFO_RESPONSE_CODE,&http );
+	curl_easy_cleanup( curl );
+
+	return( status==CURLE_OK && http<500 );
+}
+
+/*******************************************************************************
+ * cas_endpoints_prober: Background thread probing endpoints whose breaker is
+ *  open, once per cooldown, until the set is zapped
+ */
+static void*
+cas_endpoints_prober( CAS_ENDPOINTS* endpoints ) {
+	char url[2048];
+	int i;
+
+	pthread_mutex_lock( &endpoints->lock );
+	while( !endpoints->stopping ) {
+		double now=cas_clock_us();
+		double due=0;
+		CAS_ENDPOINT* endpoint=NULL;
+
+		for( i=0; i<endpoints->count; i++ ) {
+			CAS_ENDPOINT* e=&endpoints->endpoints[i];
+			if( e->state==CAS_ENDPOINT_OPEN && ( due==0 || e->reopen_us<due ) ) {
+				due=e->reopen_us;
+				endpoint=e;
+			}
+		}
+
+		if( endpoint==NULL ) {
+			pthread_cond_wait( &endpoints->wake,&endpoints->lock );
+			continue;
+		}
+		if( due>now ) {
+			cas_endpoints_wait( endpoints,&endpoints->wake,due-now );
+			continue;
+		}
+
+		//Probe outside the lock; endpoint->url lives as long as the set
+		endpoint->state=CAS_ENDPOINT_PROBING;
+		snprintf( url,sizeof( url ),"%s%s",endpoint->url,( endpoints->probe_path ? endpoints->probe_path : "/" ) );
+		long timeout_ms=( endpoints->attempt_timeout_ms ? endpoints->attempt_timeout_ms : endpoints->breaker_cooldown_ms );
+		pthread_mutex_unlock( &endpoints->lock );
+
+		//probe_ssl_ca is set once, with probe_path, and lives as long as the set
+		int alive=cas_endpoint_probe( url,timeout_ms,endpoints->probe_ssl_ca,endpoints->probe_ssl_validate_server );
+
+		pthread_mutex_lock( &endpoints->lock );
+		if( alive ) {
+			cas_debug("Closing the breaker of %s",endpoint->url);
+			endpoint->state=CAS_ENDPOINT_CLOSED;
+			endpoint->failures_in_row=0;
+			endpoint->error_rate=0;
+		} else {
+			endpoint->state=CAS_ENDPOINT_OPEN;
+			endpoint->reopen_us=cas_clock_us()+endpoints->breaker_cooldown_ms*1e3;
+		}
+	}
+	pthread_mutex_unlock( &endpoints->lock );
+
+	return( NULL );
+}
@@ -0,0 +1,164 @@
+/*******************************************************************************
+ * casflight.c
+ *
+ * Singleflight: coalescing of concurrent identical validations
+ *
+ * CAS invalidates a ticket on its first validation, so when a retrying load
+ * balancer or a double-submitting browser gets the same ticket validated by
+ * several threads at once, every validation but the first fails with
+ * CAS2_INVALID_TICKET, and costs the CAS server a round trip to do so.
+ *
+ * When enabled, the first blocking validation of a URL (which carries the
+ * service, ticket, renew flag and protocol) leads: its handle is entered in a
+ * process-wide table for as long as its transfer is in flight.  Any other
+ * validation of the same URL meanwhile follows it: it waits for the leader to
+ * land and copies the leader's result onto its own handle.  The leader waits
+ * for its followers to have copied before returning, so the result is read
+ * straight off its handle, and nothing is allocated unless someone follows.
+ * A follower waits no longer than its own deadline, if it has one.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cas.h"
+#include "cas-int.h"
+
+#define CAS_FLIGHT_BUCKETS 64
+
+static int cas_flight_enabled=0;
+static pthread_once_t cas_flight_once=PTHREAD_ONCE_INIT;
+static pthread_mutex_t cas_flight_lock=PTHREAD_MUTEX_INITIALIZER;	// - guards the table and every flight_* field
+static pthread_cond_t cas_flight_landed;		// - a leader has its result, on CLOCK_MONOTONIC
+static pthread_cond_t cas_flight_released;		// - a follower has copied it, or given up
+static CAS* cas_flights[CAS_FLIGHT_BUCKETS];
+
+/*******************************************************************************
+ * cas_flight_init: Create the conditions, with followers timing out on the
+ *  clock of their deadlines
+ */
+static void
+cas_flight_init() {
+	pthread_condattr_t attr;
+
+	pthread_condattr_init( &attr );
+	pthread_condattr_setclock( &attr,CLOCK_MONOTONIC );
+	pthread_cond_init( &cas_flight_landed,&attr );
+	pthread_condattr_destroy( &attr );
+	pthread_cond_init( &cas_flight_released,NULL );
+}
+
+/*******************************************************************************
+ * cas_set_singleflight: Enable or disable coalescing of identical validations
+ */
+void
+cas_set_singleflight( int enable ) {
+	pthread_once( &cas_flight_once,cas_flight_init );
+	cas_flight_enabled=( enable ? 1 : 0 );
+}
+
+/*******************************************************************************
+ * cas_flight_wait: Wait for leader to land, until the deadline of cas if it
+ *  has one, returning whether it landed.  Must be called with the lock held.
+ */
+static int
+cas_flight_wait( CAS* cas, CAS* leader ) {
+	struct timespec until;
+
+	until.tv_sec=( time_t )( cas->deadline_us/1e6 );
+	until.tv_nsec=( long )( ( cas->deadline_us-( double )until.tv_sec*1e6 )*1e3 );
+	while( !leader->flight_landed ) {
+		if( cas->deadline_us==0 ) {
+			pthread_cond_wait( &cas_flight_landed,&cas_flight_lock );
+		} else if( cas_clock_us()>=cas->deadline_us ) {
+			return( 0 );
+		} else {
+			pthread_cond_timedwait( &cas_flight_landed,&cas_flight_lock,&until );
+		}
+	}
+	return( 1 );
+}
+
+/*******************************************************************************
+ * cas_flight_follow: Copy the result of leader onto cas
+ */
+static CAS_CODE
+cas_flight_follow( CAS* cas, CAS* leader ) {
+	cas->stats.coalesced++;
+	return( cas_result_copy( cas,leader ) );
+}
+
+/*******************************************************************************
+ * cas_perform_flight: Perform the transfer of cas, or take its result from
+ *  an identical validation in flight
+ */
+CAS_CODE
+cas_perform_flight( CAS* cas, const char* url ) {
+	CAS_CODE rc;
+	CAS** bucket;
+	CAS* leader;
+
+	if( !cas_flight_enabled ) {
+		return( cas_perform_attempts( cas ) );
+	}
+
+	unsigned int hash=cas_hash( url,strlen( url ) );
+	bucket=&cas_flights[hash%CAS_FLIGHT_BUCKETS];
+
+	pthread_mutex_lock( &cas_flight_lock );
+	for( leader=*bucket; leader; leader=leader->flight_next ) {
+		if( leader->flight_hash==hash && strcmp( leader->flight_key,url )==0 ) {
+			break;
+		}
+	}
+
+	if( leader ) {
+		cas_debug("Following the validation in flight of %s",url);
+		leader->flight_waiters++;
+		if( cas_flight_wait( cas,leader ) ) {
+			rc=cas_flight_follow( cas,leader );
+		} else {
+			cas_debug("Deadline passed following %s",url);
+			cas_result_clear( cas );
+			rc=cas->code=CAS_DEADLINE_EXCEEDED;
+		}
+		if( --leader->flight_waiters==0 ) {
+			pthread_cond_broadcast( &cas_flight_released );
+		}
+		pthread_mutex_unlock( &cas_flight_lock );
+		return( rc );
+	}
+
+	cas->flight_key=url;
+	cas->flight_hash=hash;
+	cas->flight_waiters=0;
+	cas->flight_landed=0;
+	cas->flight_next=*bucket;
+	*bucket=cas;
+	pthread_mutex_unlock( &cas_flight_lock );
+
+	rc=cas_perform_attempts( cas );
+
+	pthread_mutex_lock( &cas_flight_lock );
+	for( ; *bucket!=cas; bucket=&( *bucket )->flight_next );
+	*bucket=cas->flight_next;
+	cas->flight_next=NULL;
+	cas->flight_key=NULL;
+
+	if( cas->flight_waiters ) {
+		cas->flight_landed=1;
+		pthread_cond_broadcast( &cas_flight_landed );
+		while( cas->flight_waiters ) {
+			pthread_cond_wait( &cas_flight_released,&cas_flight_lock );
+		}
+	}
+	pthread_mutex_unlock( &cas_flight_lock );
+
+	return( rc );
+}
@@ -0,0 +1,293 @@
+/*******************************************************************************
+ * cashedge.c
+ *
+ * Hedged validation: a second request for validations slower than usual
+ *
+ * A handle with hedging runs its blocking validations on a private curl_multi
+ * rather than with curl_easy_perform().  If the request has not been answered
+ * once a percentile of the handle's recent validation latencies has passed,
+ * the same request is sent again, from a second handle kept for the purpose,
+ * to another endpoint if there is one.  Whichever request answers first
+ * wins, and the other transfer is cancelled.
+ *
+ * A CAS ticket is only good once, so the two requests race for it: the loser
+ * of the race on the server side is told the ticket is invalid, however
+ * valid it was.  An answer that the ticket is invalid (CAS2_INVALID_TICKET,
+ * CAS1_VALIDATION_NO) therefore never wins while the other request is in
+ * flight, and once both are done it only stands if the other request cannot
+ * have used the ticket: it got the same answer, or never got its request out.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <curl/curl.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cas.h"
+#include "cas-int.h"
+
+/*******************************************************************************
+ * cas_hedge_compare: qsort comparator of latencies
+ */
+static int
+cas_hedge_compare( const void* a, const void* b ) {
+	double x=*( const double* )a;
+	double y=*( const double* )b;
+	return( ( x>y )-( x<y ) );
+}
+
+/*******************************************************************************
+ * cas_hedge_delay: The configured percentile of the recent latencies of the
+ *  handle, in microseconds, 0 while it has too little history to hedge
+ */
+static double
+cas_hedge_delay( CAS* cas ) {
+	double sorted[CAS_HEDGE_HISTORY];
+	int n=cas->hedge_samples;
+
+	if( n<CAS_HEDGE_MIN_SAMPLES ) {
+		return( 0 );
+	}
+	memcpy( sorted,cas->hedge_history,n*sizeof( double ) );
+	qsort( sorted,n,sizeof( double ),cas_hedge_compare );
+
+	int i=n*cas->hedge_percentile/100;
+	return( sorted[i<n ? i : n-1] );
+}
+
+/*******************************************************************************
+ * cas_hedge_record: Add the latency of an answered validation to the history
+ */
+static void
+cas_hedge_record( CAS* cas, double latency_us ) {
+	cas->hedge_history[cas->hedge_next]=latency_us;
+	cas->hedge_next=( cas->hedge_next+1 )%CAS_HEDGE_HISTORY;
+	if( cas->hedge_samples<CAS_HEDGE_HISTORY ) cas->hedge_samples++;
+}
+
+/*******************************************************************************
+ * cas_hedge_decisive: Whether a result settles the validation, whatever the
+ *  other request may yet answer
+ */
+static int
+cas_hedge_decisive( CAS_CODE code ) {
+	return( code==CAS_VALIDATION_SUCCESS || code==CAS2_INVALID_SERVICE || code==CAS2_INVALID_REQUEST );
+}
+
+/*******************************************************************************
+ * cas_hedge_spent: Whether a result says the ticket is no good, which it also
+ *  says if the other request got to the ticket first
+ */
+static int
+cas_hedge_spent( CAS_CODE code ) {
+	return( code==CAS2_INVALID_TICKET || code==CAS1_VALIDATION_NO );
+}
+
+/*******************************************************************************
+ * cas_hedge_unsent: Whether the request of a failed transfer never went out,
+ *  so the server cannot have seen its ticket
+ */
+static int
+cas_hedge_unsent( CAS* cas ) {
+	long request_size=0;
+
+	curl_easy_getinfo( cas->curl,CURLINFO_REQUEST_SIZE,&request_size );
+	return( request_size==0 );
+}
+
+/*******************************************************************************
+ * cas_hedge_prepare: Make sure the hedge handle of cas exists and has a copy
+ *  of the cURL options of cas, while cas->curl is not in use
+ */
+static CAS_CODE
+cas_hedge_prepare( CAS* cas ) {
+	CAS* hedge=cas->hedge;
+
+	if( hedge==NULL ) {
+		if((hedge=cas->hedge=cas_new())==NULL) {
+			return( CAS_ENOMEM );
+		}
+		hedge->options_version=cas->options_version-1;
+	}
+	if( hedge->options_version!=cas->options_version ) {
+		CURL* curl=curl_easy_duphandle( cas->curl );
+		if( curl==NULL ) {
+			return( CAS_ENOMEM );
+		}
+		curl_easy_cleanup( hedge->curl );
+		hedge->curl=curl;
+		curl_easy_setopt( curl,CURLOPT_PRIVATE,hedge );
+		hedge->options_version=cas->options_version;
+	}
+
+	hedge->cas2_fastpath=cas->cas2_fastpath;
+	hedge->max_response_size=cas->max_response_size;
+	hedge->max_response_depth=cas->max_response_depth;
+	hedge->endpoints=cas->endpoints;
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_hedge_start: Set up the hedge handle for a second request of the
+ *  validation in flight on cas
+ */
+static CAS_CODE
+cas_hedge_start( CAS* cas ) {
+	CAS* hedge=cas->hedge;
+	const char* url=NULL;
+	char* current=NULL;
+
+	hedge->deadline_us=cas->deadline_us;
+	hedge->attempt_timeout_ms=cas->attempt_timeout_ms;
+	hedge->endpoint_index=-1;
+	if( cas->endpoints && cas->endpoint_index>=0 ) {
+		url=cas_endpoints_hedge( hedge,cas );
+	}
+	if( url==NULL ) {
+		//No other endpoint: the same URL again, on another connection
+		curl_easy_getinfo( cas->curl,CURLINFO_EFFECTIVE_URL,&current );
+		url=current;
+	}
+	if( url==NULL ) {
+		return( CAS_FAIL );
+	}
+
+	cas_debug("Hedging with %s",url);
+	return( cas_start_attempt( hedge,cas->protocol,url ) );
+}
+
+/*******************************************************************************
+ * cas_perform_hedged: Perform the transfer set up by cas_start, hedged, and
+ *  resolve its result
+ */
+CAS_CODE
+cas_perform_hedged( CAS* cas ) {
+	CAS* legs[2]={ cas,NULL };
+	CAS_CODE codes[2]={ CAS_FAIL,CAS_FAIL };
+	int done[2]={ 0,0 };
+	int in_flight=0;
+	int winner=-1;
+	int running;
+	int queued;
+	int i;
+	CURLMsg* msg;
+	double start=cas_clock_us();
+	double delay=cas_hedge_delay( cas );
+
+	if( cas->hedge_multi==NULL && (cas->hedge_multi=curl_multi_init())==NULL ) {
+		return( cas_finish( cas,CURLE_OUT_OF_MEMORY ) );
+	}
+	if( delay>0 && cas_hedge_prepare( cas )!=CAS_VALIDATION_SUCCESS ) {
+		delay=0;
+	}
+	if( !cas_endpoints_admit( cas,1 ) || curl_multi_add_handle( cas->hedge_multi,cas->curl )!=CURLM_OK ) {
+		return( cas_finish( cas,CURLE_FAILED_INIT ) );
+	}
+	in_flight++;
+
+	while( in_flight>0 && winner<0 ) {
+		if( curl_multi_perform( cas->hedge_multi,&running )!=CURLM_OK ) {
+			break;
+		}
+
+		while( winner<0 && (msg=curl_multi_info_read( cas->hedge_multi,&queued )) ) {
+			if( msg->msg!=CURLMSG_DONE ) {
+				continue;
+			}
+			CURL* curl=msg->easy_handle;
+			CURLcode status=msg->data.result;
+			int leg=( curl==cas->curl ? 0 : 1 );
+
+			curl_multi_remove_handle( cas->hedge_multi,curl );
+			if( cas_retry( legs[leg],status ) ) {
+				if( curl_multi_add_handle( cas->hedge_multi,curl )==CURLM_OK ) {
+					continue;
+				}
+				status=CURLE_FAILED_INIT;
+			}
+			in_flight--;
+			done[leg]=1;
+			codes[leg]=cas_finish( legs[leg],status );
+			if( cas_hedge_decisive( codes[leg] ) ) {
+				winner=leg;
+			}
+		}
+		if( in_flight==0 || winner>=0 ) {
+			break;
+		}
+
+		//Send the second request once the first is slower than usual
+		double now=cas_clock_us();
+		long wait_ms=1000;
+		if( legs[1]==NULL && delay>0 ) {
+			if( now-start>=delay ) {
+				if( cas_hedge_start( cas )==CAS_VALIDATION_SUCCESS && cas_endpoints_admit( cas->hedge,0 )
+				 && curl_multi_add_handle( cas->hedge_multi,cas->hedge->curl )==CURLM_OK ) {
+					legs[1]=cas->hedge;
+					in_flight++;
+					cas->stats.hedges++;
+				} else {
+					cas_endpoints_release( cas->hedge );
+				}
+				delay=0;
+				continue;
+			}
+			wait_ms=( long )( ( start+delay-now )/1e3 )+1;
+		}
+		curl_multi_wait( cas->hedge_multi,NULL,0,( wait_ms<1000 ? wait_ms : 1000 ),NULL );
+	}
+
+	//Cancel whatever lost
+	for( i=0; i<2; i++ ) {
+		if( legs[i] && !done[i] ) {
+			curl_multi_remove_handle( cas->hedge_multi,legs[i]->curl );
+			cas_endpoints_release( legs[i] );
+			if( winner<0 ) {
+				done[i]=1;
+				codes[i]=cas_finish( legs[i],CURLE_ABORTED_BY_CALLBACK );
+			}
+		}
+	}
+
+	if( winner<0 ) {
+		//Both done, neither decisive: an invalid ticket only stands if the
+		// other request cannot have been the one to use it up
+		winner=0;
+		if( legs[1] && cas_hedge_spent( codes[0] ) && !cas_hedge_spent( codes[1] ) && !cas_hedge_unsent( legs[1] ) ) {
+			winner=1;
+		}
+		if( legs[1] && cas_hedge_spent( codes[1] ) && !cas_hedge_spent( codes[0] ) && cas_hedge_unsent( legs[0] ) ) {
+			winner=1;
+		}
+	}
+
+	if( winner==1 ) {
+		cas_result_copy( cas,cas->hedge );
+		cas->timings=cas->hedge->timings;
+		cas->stats.hedge_wins++;
+	}
+	if( cas->code!=CAS_CURL_FAILURE && cas->code!=CAS_DEADLINE_EXCEEDED ) {
+		cas_hedge_record( cas,cas_clock_us()-start );
+	}
+
+	return( cas->code );
+}
+
+/*******************************************************************************
+ * cas_hedge_zap: Release the hedging resources of cas
+ */
+void
+cas_hedge_zap( CAS* cas ) {
+	if( cas->hedge_multi ) {
+		curl_multi_cleanup( cas->hedge_multi );
+		cas->hedge_multi=NULL;
+	}
+	if( cas->hedge ) {
+		cas_zap( cas->hedge );
+		cas->hedge=NULL;
+	}
+}
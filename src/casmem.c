@@ -0,0 +1,155 @@
+/*******************************************************************************
+ * casmem.c
+ *
+ * Allocator hooks
+ *
+ * libcas allocates through cas_mem, which cas_init_mem() points at the
+ * caller's allocator, and hands the same functions to libxml2 (xmlMemSetup())
+ * and libcurl (curl_global_init_mem()), so that a validation allocates from
+ * one allocator end to end.  Both libraries only take hooks before they are
+ * initialized, hence at cas_init_mem(), and only once.
+ *
+ * With counting enabled, the functions installed are wrappers counting calls
+ * and bytes per thread before calling on to the allocator.  A blocking
+ * validation runs on the thread that called it, from start to finish, so the
+ * counts of that thread across it are the cost of the validation.  Counts
+ * are thread-local so that counting takes no lock and shares no cache line.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <curl/curl.h>
+#include <libxml/xmlmemory.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cas.h"
+#include "cas-int.h"
+
+CAS_MEM cas_mem={ malloc,free,realloc,calloc,strdup };
+
+static CAS_MEM cas_mem_counted={ malloc,free,realloc,calloc,strdup };	// - allocator under the counting wrappers
+int cas_mem_counting=0;						// - install the counting wrappers at the next cas_init_mem()
+static __thread CAS_MEM_STATS cas_mem_thread;
+
+static void*
+cas_count_malloc( size_t size ) {
+	cas_mem_thread.allocations++;
+	cas_mem_thread.bytes+=size;
+	return( cas_mem_counted.malloc_fn( size ) );
+}
+
+static void
+cas_count_free( void* ptr ) {
+	if( ptr ) {
+		cas_mem_thread.frees++;
+	}
+	cas_mem_counted.free_fn( ptr );
+}
+
+static void*
+cas_count_realloc( void* ptr, size_t size ) {
+	cas_mem_thread.allocations++;
+	cas_mem_thread.bytes+=size;
+	return( cas_mem_counted.realloc_fn( ptr,size ) );
+}
+
+static void*
+cas_count_calloc( size_t nmemb, size_t size ) {
+	cas_mem_thread.allocations++;
+	cas_mem_thread.bytes+=nmemb*size;
+	return( cas_mem_counted.calloc_fn( nmemb,size ) );
+}
+
+static char*
+cas_count_strdup( const char* str ) {
+	cas_mem_thread.allocations++;
+	cas_mem_thread.bytes+=strlen( str )+1;
+	return( cas_mem_counted.strdup_fn( str ) );
+}
+
+/*******************************************************************************
+ * cas_set_mem_counting: Enable or disable counting of allocations, from the
+ *  next cas_init() or cas_init_mem()
+ */
+void
+cas_set_mem_counting( int enable ) {
+	cas_mem_counting=( enable ? 1 : 0 );
+}
+
+/*******************************************************************************
+ * cas_init_mem: cas_init() allocating through the given functions, the C
+ *  library's for any NULL.  Without any, and without counting, libxml2 and
+ *  libcurl are left their own allocators, as by cas_init().
+ */
+CAS_CODE
+cas_init_mem( cas_malloc_callback malloc_fn, cas_free_callback free_fn, cas_realloc_callback realloc_fn, cas_calloc_callback calloc_fn, cas_strdup_callback strdup_fn ) {
+	CAS_MEM mem={
+		( malloc_fn ? malloc_fn : malloc ),
+		( free_fn ? free_fn : free ),
+		( realloc_fn ? realloc_fn : realloc ),
+		( calloc_fn ? calloc_fn : calloc ),
+		( strdup_fn ? strdup_fn : strdup ),
+	};
+
+	if( !malloc_fn && !free_fn && !realloc_fn && !calloc_fn && !strdup_fn && !cas_mem_counting ) {
+		cas_init();
+		return( CAS_VALIDATION_SUCCESS );
+	}
+	if( cas_mem_counting ) {
+		cas_mem_counted=mem;
+		mem.malloc_fn=cas_count_malloc;
+		mem.free_fn=cas_count_free;
+		mem.realloc_fn=cas_count_realloc;
+		mem.calloc_fn=cas_count_calloc;
+		mem.strdup_fn=cas_count_strdup;
+	}
+
+	if( xmlMemSetup( mem.free_fn,mem.malloc_fn,mem.realloc_fn,mem.strdup_fn )!=0 ) {
+		return( CAS_FAIL );
+	}
+	if( curl_global_init_mem( CURL_GLOBAL_ALL,mem.malloc_fn,mem.free_fn,mem.realloc_fn,mem.strdup_fn,mem.calloc_fn )!=CURLE_OK ) {
+		return( CAS_FAIL );
+	}
+	cas_mem=mem;
+	LIBXML_TEST_VERSION
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_get_mem_thread: Retrieve the allocation counts of the calling thread
+ */
+void
+cas_get_mem_thread( CAS_MEM_STATS* stats ) {
+	*stats=cas_mem_thread;
+}
+
+/*******************************************************************************
+ * cas_mem_account: Add the allocations of the calling thread since mark to
+ *  the counters of cas
+ */
+void
+cas_mem_account( CAS* cas, const CAS_MEM_STATS* mark ) {
+	if( cas_mem.malloc_fn==cas_count_malloc ) {
+		cas->stats.allocations+=cas_mem_thread.allocations-mark->allocations;
+		cas->stats.allocated_bytes+=cas_mem_thread.bytes-mark->bytes;
+	}
+}
+
+/*******************************************************************************
+ * cas_strndup: strndup() on cas_mem
+ */
+char*
+cas_strndup( const char* str, size_t size ) {
+	char* copy;
+
+	size=strnlen( str,size );
+	if((copy=cas_malloc( size+1 ))) {
+		memcpy( copy,str,size );
+		copy[size]='\0';
+	}
+	return( copy );
+}
@@ -0,0 +1,961 @@
+/*******************************************************************************
+ * casmock.c
+ *
+ * Multi-threaded mock CAS server for benchmarks
+ *
+ * An acceptor thread hands every connection to a thread of its own, which
+ * serves requests on it until the client closes it (HTTP/1.1 keep-alive).
+ * Only what libcurl sends for a validation, or to warm a connection up, is
+ * understood: GET or HEAD request line, headers, no body.
+ *
+ * With nghttp2, HTTPS connections that negotiate h2 are served as HTTP/2
+ * instead: the connection thread answers every stream as it becomes due, so
+ * that the server latency applies to each stream rather than serializing
+ * them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined( HAVE_NGHTTP2 ) && defined( HAVE_OPENSSL )
+#include <nghttp2/nghttp2.h>
+#define CAS_MOCK_HTTP2 1
+#endif
+
+#include "casmock.h"
+
+#define CAS_MOCK_REQUEST_MAX 16384
+
+static const char* cas_mock_cas1_failure="no\n\n";
+static const char* cas_mock_cas2_failure=
+"<cas:serviceResponse xmlns:cas='http://www.yale.edu/tp/cas'>\n"
+"    <cas:authenticationFailure code=\"INVALID_TICKET\">\n"
+"        Ticket not recognized\n"
+"    </cas:authenticationFailure>\n"
+"</cas:serviceResponse>\n";
+static const char* cas_mock_json_failure=
+"{\"serviceResponse\":{\"authenticationFailure\":{\"code\":\"INVALID_TICKET\",\"description\":\"Ticket not recognized\"}}}";
+
+typedef struct CAS_MOCK_CONNECTION CAS_MOCK_CONNECTION;
+
+struct CAS_MOCK_CONNECTION {
+	CAS_MOCK* mock;
+	int fd;
+#ifdef HAVE_OPENSSL
+	SSL* ssl;
+#endif
+	CAS_MOCK_CONNECTION* next;
+};
+
+struct CAS_MOCK {
+	CAS_MOCK_CONFIG config;
+	char* bodies[6];				// - success and failure bodies, CAS1, CAS2, JSON
+	char* gzip_bodies[6];			// - the same, gzipped, if built with zlib
+	size_t gzip_sizes[6];
+	char url[64];
+	int fd;
+	pthread_t acceptor;
+#ifdef HAVE_OPENSSL
+	SSL_CTX* ssl_ctx;
+#endif
+
+	pthread_mutex_t lock;			// - guards everything below
+	pthread_cond_t idle;
+	CAS_MOCK_CONNECTION* connections;
+	int running;
+	int down;						// - requests are dropped unanswered
+	int error_status;				// - HTTP status every request is failed with, 0 for none
+	char* error_body;				// - HTML error page failing them
+	long latency_us;				// - the configured latency, until changed
+	unsigned int random;			// - state of the tail latency draw
+	unsigned long requests;
+	unsigned long connections_accepted;
+};
+
+/*******************************************************************************
+ * cas_mock_read/write: Connection I/O, over TLS if serving HTTPS
+ */
+static ssize_t
+cas_mock_read( CAS_MOCK_CONNECTION* connection, char* buffer, size_t size ) {
+#ifdef HAVE_OPENSSL
+	if( connection->ssl ) {
+		return( SSL_read( connection->ssl,buffer,size ) );
+	}
+#endif
+	return( read( connection->fd,buffer,size ) );
+}
+
+static int
+cas_mock_write( CAS_MOCK_CONNECTION* connection, const char* buffer, size_t size ) {
+	while( size>0 ) {
+		ssize_t written;
+#ifdef HAVE_OPENSSL
+		if( connection->ssl ) {
+			written=SSL_write( connection->ssl,buffer,size );
+		} else
+#endif
+		written=write( connection->fd,buffer,size );
+		if( written<=0 ) {
+			if( written<0 && errno==EINTR ) continue;
+			return( -1 );
+		}
+		buffer+=written;
+		size-=written;
+	}
+	return( 0 );
+}
+
+/*******************************************************************************
+ * cas_mock_route: Pick the body answering a request target, "<path>?<query>",
+ *  -1 for none
+ */
+static int
+cas_mock_route( const char* target, const char** type ) {
+	const char* query=strchr( target,'?' );
+	size_t path_size=( query ? ( size_t )( query-target ) : strlen( target ) );
+	const char* ticket=( query ? strstr( query,"ticket=" ) : NULL );
+	int bad=( ticket==NULL || strstr( ticket,"bad" )!=NULL );
+
+	if( path_size>=9 && strncmp( &target[path_size-9],"/validate",9 )==0 ) {
+		*type="text/plain";
+		return( 0+bad );
+	} else if( path_size>=16 && strncmp( &target[path_size-16],"/serviceValidate",16 )==0 ) {
+		if( query && strstr( query,"format=JSON" ) ) {
+			*type="application/json";
+			return( 4+bad );
+		}
+		*type="text/xml";
+		return( 2+bad );
+	}
+	return( -1 );
+}
+
+/*******************************************************************************
+ * cas_mock_accepts_gzip: Whether an Accept-Encoding value lists gzip
+ */
+static int
+cas_mock_accepts_gzip( const char* value, size_t size ) {
+	size_t i;
+
+	for( i=0; i+4<=size; i++ ) {
+		if( strncasecmp( &value[i],"gzip",4 )==0 ) return( 1 );
+	}
+	return( 0 );
+}
+
+/*******************************************************************************
+ * cas_mock_body: Body number index, gzipped if asked for and available
+ */
+static const char*
+cas_mock_body( CAS_MOCK* mock, int index, int* gzip, size_t* size ) {
+	if( *gzip && mock->gzip_bodies[index] ) {
+		*size=mock->gzip_sizes[index];
+		return( mock->gzip_bodies[index] );
+	}
+	*gzip=0;
+	*size=strlen( mock->bodies[index] );
+	return( mock->bodies[index] );
+}
+
+/*******************************************************************************
+ * cas_mock_count: Count a request answered
+ */
+static void
+cas_mock_count( CAS_MOCK* mock ) {
+	pthread_mutex_lock( &mock->lock );
+	mock->requests++;
+	pthread_mutex_unlock( &mock->lock );
+}
+
+/*******************************************************************************
+ * cas_mock_admit: The latency of a request about to be answered, or -1 if
+ *  the server is down and it is to be dropped
+ */
+static long
+cas_mock_admit( CAS_MOCK* mock ) {
+	pthread_mutex_lock( &mock->lock );
+	long latency_us=( mock->down ? -1 : mock->latency_us );
+	if( latency_us>=0 && mock->config.tail_percent>0 ) {
+		mock->random=mock->random*1103515245u+12345u;
+		if( ( mock->random>>16 )%100<( unsigned int )mock->config.tail_percent ) {
+			latency_us=mock->config.tail_latency_us;
+		}
+	}
+	pthread_mutex_unlock( &mock->lock );
+	return( latency_us );
+}
+
+/*******************************************************************************
+ * cas_mock_error: The HTTP status requests are failed with, 0 for none
+ */
+static int
+cas_mock_error( CAS_MOCK* mock ) {
+	pthread_mutex_lock( &mock->lock );
+	int error_status=mock->error_status;
+	pthread_mutex_unlock( &mock->lock );
+	return( error_status );
+}
+
+/*******************************************************************************
+ * cas_mock_respond: Answer one request line
+ */
+static int
+cas_mock_respond( CAS_MOCK_CONNECTION* connection, char* request, int keep_alive, int gzip ) {
+	CAS_MOCK* mock=connection->mock;
+	char header[256];
+	char error[32];
+	const char* status="200 OK";
+	const char* type="text/plain";
+	const char* body="";
+	size_t body_size=0;
+
+	//"GET <path>?<query> HTTP/1.1", or HEAD
+	int head=( strncmp( request,"HEAD ",5 )==0 );
+	char* target=strchr( request,' ' );
+	char* version=( target ? strchr( ++target,' ' ) : NULL );
+	if( version==NULL || ( !head && strncmp( request,"GET ",4 )!=0 ) ) {
+		status="400 Bad Request";
+		keep_alive=0;
+		gzip=0;
+	} else {
+		*version='\0';
+		int index=cas_mock_route( target,&type );
+		int error_status=cas_mock_error( mock );
+		if( error_status ) {
+			snprintf( error,sizeof( error ),"%d Server Error",error_status );
+			status=error;
+			type="text/html";
+			body=mock->error_body;
+			body_size=strlen( body );
+			gzip=0;
+		} else if( index>=0 ) {
+			body=cas_mock_body( mock,index,&gzip,&body_size );
+		} else {
+			status="404 Not Found";
+			gzip=0;
+		}
+	}
+
+	long latency_us=cas_mock_admit( mock );
+	if( latency_us<0 ) {
+		return( -1 );
+	}
+	if( latency_us>0 ) {
+		struct timespec delay={ latency_us/1000000,( latency_us%1000000 )*1000 };
+		nanosleep( &delay,NULL );
+	}
+
+	int header_size=snprintf( header,sizeof( header ),"HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\n%s%s\r\n",status,type,( unsigned long )body_size,( gzip ? "Content-Encoding: gzip\r\n" : "" ),( keep_alive ? "" : "Connection: close\r\n" ) );
+
+	cas_mock_count( mock );
+
+	if( cas_mock_write( connection,header,header_size )!=0 || ( !head && cas_mock_write( connection,body,body_size )!=0 ) ) {
+		return( -1 );
+	}
+	return( keep_alive ? 0 : -1 );
+}
+
+#ifdef CAS_MOCK_HTTP2
+/*******************************************************************************
+ * HTTP/2: one CAS_MOCK_STREAM per request, answered once it is complete and
+ *  the server latency has passed
+ */
+typedef struct CAS_MOCK_STREAM CAS_MOCK_STREAM;
+
+struct CAS_MOCK_STREAM {
+	int32_t id;
+	char target[CAS_MOCK_REQUEST_MAX];
+	int head;						// - HEAD rather than GET
+	int gzip;
+	double due;						// - when to answer, 0 until the request is complete
+	int answered;
+	const char* body;
+	size_t size;
+	size_t sent;
+	CAS_MOCK_STREAM* next;
+};
+
+typedef struct {
+	CAS_MOCK_CONNECTION* connection;
+	CAS_MOCK_STREAM* streams;
+} CAS_MOCK_SESSION;
+
+static double
+cas_mock_now() {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC,&ts );
+	return( ts.tv_sec+ts.tv_nsec/1e9 );
+}
+
+static ssize_t
+cas_mock_h2_send( nghttp2_session* session, const uint8_t* data, size_t length, int flags, CAS_MOCK_SESSION* h2 ) {
+	return( cas_mock_write( h2->connection,( const char* )data,length )==0 ? ( ssize_t )length : NGHTTP2_ERR_CALLBACK_FAILURE );
+}
+
+static int
+cas_mock_h2_begin_headers( nghttp2_session* session, const nghttp2_frame* frame, CAS_MOCK_SESSION* h2 ) {
+	if( frame->hd.type==NGHTTP2_HEADERS && frame->headers.cat==NGHTTP2_HCAT_REQUEST ) {
+		CAS_MOCK_STREAM* stream=calloc( 1,sizeof( CAS_MOCK_STREAM ) );
+		if( stream==NULL ) {
+			return( NGHTTP2_ERR_CALLBACK_FAILURE );
+		}
+		stream->id=frame->hd.stream_id;
+		stream->next=h2->streams;
+		h2->streams=stream;
+		nghttp2_session_set_stream_user_data( session,stream->id,stream );
+	}
+	return( 0 );
+}
+
+static int
+cas_mock_h2_header( nghttp2_session* session, const nghttp2_frame* frame, const uint8_t* name, size_t namelen, const uint8_t* value, size_t valuelen, uint8_t flags, CAS_MOCK_SESSION* h2 ) {
+	CAS_MOCK_STREAM* stream=nghttp2_session_get_stream_user_data( session,frame->hd.stream_id );
+
+	if( stream ) {
+		if( namelen==5 && memcmp( name,":path",5 )==0 && valuelen<sizeof( stream->target ) ) {
+			memcpy( stream->target,value,valuelen );
+			stream->target[valuelen]='\0';
+		} else if( namelen==7 && memcmp( name,":method",7 )==0 ) {
+			stream->head=( valuelen==4 && memcmp( value,"HEAD",4 )==0 );
+		} else if( namelen==15 && memcmp( name,"accept-encoding",15 )==0 ) {
+			stream->gzip=cas_mock_accepts_gzip( ( const char* )value,valuelen );
+		}
+	}
+	return( 0 );
+}
+
+static int
+cas_mock_h2_frame_recv( nghttp2_session* session, const nghttp2_frame* frame, CAS_MOCK_SESSION* h2 ) {
+	CAS_MOCK_STREAM* stream=nghttp2_session_get_stream_user_data( session,frame->hd.stream_id );
+
+	if( stream && ( frame->hd.flags&NGHTTP2_FLAG_END_STREAM ) ) {
+		long latency_us=cas_mock_admit( h2->connection->mock );
+		if( latency_us<0 ) {
+			return( NGHTTP2_ERR_CALLBACK_FAILURE );
+		}
+		stream->due=cas_mock_now()+latency_us/1e6;
+	}
+	return( 0 );
+}
+
+static int
+cas_mock_h2_stream_close( nghttp2_session* session, int32_t stream_id, uint32_t error_code, CAS_MOCK_SESSION* h2 ) {
+	CAS_MOCK_STREAM** link;
+
+	for( link=&h2->streams; *link; link=&( *link )->next ) {
+		if( ( *link )->id==stream_id ) {
+			CAS_MOCK_STREAM* stream=*link;
+			*link=stream->next;
+			free( stream );
+			break;
+		}
+	}
+	return( 0 );
+}
+
+static ssize_t
+cas_mock_h2_read( nghttp2_session* session, int32_t stream_id, uint8_t* buf, size_t length, uint32_t* data_flags, nghttp2_data_source* source, CAS_MOCK_SESSION* h2 ) {
+	CAS_MOCK_STREAM* stream=source->ptr;
+	size_t size=stream->size-stream->sent;
+
+	if( size>length ) size=length;
+	memcpy( buf,&stream->body[stream->sent],size );
+	stream->sent+=size;
+	if( stream->sent==stream->size ) *data_flags|=NGHTTP2_DATA_FLAG_EOF;
+
+	return( size );
+}
+
+/*******************************************************************************
+ * cas_mock_h2_answer: Submit the response of a complete stream
+ */
+static int
+cas_mock_h2_answer( nghttp2_session* session, CAS_MOCK* mock, CAS_MOCK_STREAM* stream ) {
+	const char* type="text/plain";
+	const char* status="200";
+	char error[16];
+	char length[32];
+	nghttp2_data_provider provider;
+
+	int index=cas_mock_route( stream->target,&type );
+	int error_status=cas_mock_error( mock );
+	if( error_status ) {
+		snprintf( error,sizeof( error ),"%d",error_status );
+		status=error;
+		type="text/html";
+		stream->body=mock->error_body;
+		stream->size=strlen( stream->body );
+		stream->gzip=0;
+	} else if( index>=0 ) {
+		stream->body=cas_mock_body( mock,index,&stream->gzip,&stream->size );
+	} else {
+		status="404";
+		stream->body="";
+		stream->size=0;
+		stream->gzip=0;
+	}
+	snprintf( length,sizeof( length ),"%lu",( unsigned long )stream->size );
+
+	nghttp2_nv headers[]={
+		{ ( uint8_t* )":status",( uint8_t* )status,7,strlen( status ),NGHTTP2_NV_FLAG_NONE },
+		{ ( uint8_t* )"content-type",( uint8_t* )type,12,strlen( type ),NGHTTP2_NV_FLAG_NONE },
+		{ ( uint8_t* )"content-length",( uint8_t* )length,14,strlen( length ),NGHTTP2_NV_FLAG_NONE },
+		{ ( uint8_t* )"content-encoding",( uint8_t* )"gzip",16,4,NGHTTP2_NV_FLAG_NONE },
+	};
+	provider.source.ptr=stream;
+	provider.read_callback=( nghttp2_data_source_read_callback )cas_mock_h2_read;
+
+	stream->answered=1;
+	cas_mock_count( mock );
+	return( nghttp2_submit_response( session,stream->id,headers,( stream->gzip ? 4 : 3 ),( stream->head ? NULL : &provider ) ) );
+}
+
+/*******************************************************************************
+ * cas_mock_serve_h2: Serve a connection that negotiated HTTP/2 until it closes
+ */
+static void
+cas_mock_serve_h2( CAS_MOCK_CONNECTION* connection ) {
+	CAS_MOCK* mock=connection->mock;
+	CAS_MOCK_SESSION h2={ connection,NULL };
+	nghttp2_session_callbacks* callbacks;
+	nghttp2_session* session;
+	nghttp2_settings_entry settings[]={ { NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS,1000 } };
+	uint8_t buffer[16384];
+
+	if( nghttp2_session_callbacks_new( &callbacks )!=0 ) {
+		return;
+	}
+	nghttp2_session_callbacks_set_send_callback( callbacks,( nghttp2_send_callback )cas_mock_h2_send );
+	nghttp2_session_callbacks_set_on_begin_headers_callback( callbacks,( nghttp2_on_begin_headers_callback )cas_mock_h2_begin_headers );
+	nghttp2_session_callbacks_set_on_header_callback( callbacks,( nghttp2_on_header_callback )cas_mock_h2_header );
+	nghttp2_session_callbacks_set_on_frame_recv_callback( callbacks,( nghttp2_on_frame_recv_callback )cas_mock_h2_frame_recv );
+	nghttp2_session_callbacks_set_on_stream_close_callback( callbacks,( nghttp2_on_stream_close_callback )cas_mock_h2_stream_close );
+	int rc=nghttp2_session_server_new( &session,callbacks,&h2 );
+	nghttp2_session_callbacks_del( callbacks );
+	if( rc!=0 ) {
+		return;
+	}
+	nghttp2_submit_settings( session,NGHTTP2_FLAG_NONE,settings,1 );
+
+	for( ;; ) {
+		//Answer every stream that is due, and find when the next one is
+		double now=cas_mock_now();
+		double next=0;
+		CAS_MOCK_STREAM* stream;
+		for( stream=h2.streams; stream; stream=stream->next ) {
+			if( stream->due==0 || stream->answered ) continue;
+			if( stream->due<=now ) {
+				if( cas_mock_h2_answer( session,mock,stream )!=0 ) goto done;
+			} else if( next==0 || stream->due<next ) {
+				next=stream->due;
+			}
+		}
+
+		if( nghttp2_session_send( session )!=0 ) break;
+		if( !nghttp2_session_want_read( session ) && !nghttp2_session_want_write( session ) ) break;
+
+		//Wait for the client, or until the next stream is due
+		if( SSL_pending( connection->ssl )==0 ) {
+			struct pollfd pfd={ connection->fd,POLLIN,0 };
+			int timeout=( next ? ( int )( ( next-now )*1000 )+1 : -1 );
+			int ready=poll( &pfd,1,timeout );
+			if( ready<0 && errno!=EINTR ) break;
+			if( ready<=0 ) continue;
+		}
+
+		ssize_t received=cas_mock_read( connection,( char* )buffer,sizeof( buffer ) );
+		if( received<=0 || nghttp2_session_mem_recv( session,buffer,received )<0 ) break;
+	}
+
+done:
+	nghttp2_session_del( session );
+	while( h2.streams ) {
+		CAS_MOCK_STREAM* stream=h2.streams;
+		h2.streams=stream->next;
+		free( stream );
+	}
+}
+
+/*******************************************************************************
+ * cas_mock_alpn: Select h2 when offered and enabled, http/1.1 otherwise
+ */
+static int
+cas_mock_alpn( SSL* ssl, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, CAS_MOCK* mock ) {
+	const unsigned char* protocol;
+	const unsigned char* http11=NULL;
+
+	for( protocol=in; protocol<in+inlen; protocol+=1+protocol[0] ) {
+		if( mock->config.http2 && protocol[0]==2 && memcmp( &protocol[1],"h2",2 )==0 ) {
+			*out=&protocol[1];
+			*outlen=protocol[0];
+			return( SSL_TLSEXT_ERR_OK );
+		}
+		if( protocol[0]==8 && memcmp( &protocol[1],"http/1.1",8 )==0 ) {
+			http11=protocol;
+		}
+	}
+	if( http11 ) {
+		*out=&http11[1];
+		*outlen=http11[0];
+		return( SSL_TLSEXT_ERR_OK );
+	}
+	return( SSL_TLSEXT_ERR_NOACK );
+}
+#endif
+
+/*******************************************************************************
+ * cas_mock_serve: Connection thread, serving requests until the connection
+ *  closes
+ */
+static void*
+cas_mock_serve( CAS_MOCK_CONNECTION* connection ) {
+	CAS_MOCK* mock=connection->mock;
+	char* buffer=malloc( CAS_MOCK_REQUEST_MAX+1 );
+	size_t size=0;
+
+#ifdef HAVE_OPENSSL
+	if( mock->ssl_ctx ) {
+		if((connection->ssl=SSL_new( mock->ssl_ctx ))==NULL) goto done;
+		SSL_set_fd( connection->ssl,connection->fd );
+		if( SSL_accept( connection->ssl )!=1 ) goto done;
+#ifdef CAS_MOCK_HTTP2
+		const unsigned char* alpn=NULL;
+		unsigned int alpn_size=0;
+		SSL_get0_alpn_selected( connection->ssl,&alpn,&alpn_size );
+		if( alpn_size==2 && memcmp( alpn,"h2",2 )==0 ) {
+			cas_mock_serve_h2( connection );
+			goto done;
+		}
+#endif
+	}
+#endif
+
+	while( buffer ) {
+		char* end;
+		buffer[size]='\0';
+
+		//Serve every complete request buffered, pipelined or not
+		while((end=strstr( buffer,"\r\n\r\n" ))) {
+			char* line_end=strstr( buffer,"\r\n" );
+			*line_end='\0';
+
+			//HTTP/1.1 keeps the connection alive unless asked not to
+			int keep_alive=( strstr( buffer," HTTP/1.1" )!=NULL );
+			int gzip=0;
+			char* header;
+			for( header=line_end+2; header<end; header=strstr( header,"\r\n" )+2 ) {
+				if( strncasecmp( header,"Connection:",11 )==0 ) {
+					const char* value=header+11;
+					while( *value==' ' ) value++;
+					keep_alive=( strncasecmp( value,"close",5 )!=0 );
+				} else if( strncasecmp( header,"Accept-Encoding:",16 )==0 ) {
+					char* header_end=strstr( header,"\r\n" );
+					gzip=cas_mock_accepts_gzip( header,header_end-header );
+				}
+			}
+
+			if( cas_mock_respond( connection,buffer,keep_alive,gzip )!=0 ) goto done;
+
+			size-=( end+4 )-buffer;
+			memmove( buffer,end+4,size+1 );
+		}
+
+		if( size==CAS_MOCK_REQUEST_MAX ) break;
+		ssize_t received=cas_mock_read( connection,&buffer[size],CAS_MOCK_REQUEST_MAX-size );
+		if( received<=0 ) {
+			if( received<0 && errno==EINTR ) continue;
+			break;
+		}
+		size+=received;
+	}
+
+done:
+#ifdef HAVE_OPENSSL
+	if( connection->ssl ) {
+		SSL_shutdown( connection->ssl );
+		SSL_free( connection->ssl );
+	}
+#endif
+	if( buffer ) free( buffer );
+
+	pthread_mutex_lock( &mock->lock );
+	CAS_MOCK_CONNECTION** link;
+	for( link=&mock->connections; *link; link=&( *link )->next ) {
+		if( *link==connection ) {
+			*link=connection->next;
+			break;
+		}
+	}
+	close( connection->fd );
+	free( connection );
+	if( mock->connections==NULL ) pthread_cond_broadcast( &mock->idle );
+	pthread_mutex_unlock( &mock->lock );
+
+	return( NULL );
+}
+
+/*******************************************************************************
+ * cas_mock_accept: Acceptor thread
+ */
+static void*
+cas_mock_accept( CAS_MOCK* mock ) {
+	for( ;; ) {
+		int fd=accept( mock->fd,NULL,NULL );
+		if( fd<0 ) {
+			if( errno==EINTR || errno==ECONNABORTED ) continue;
+			break;
+		}
+		int one=1;
+		setsockopt( fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof( one ) );
+
+		CAS_MOCK_CONNECTION* connection=calloc( 1,sizeof( CAS_MOCK_CONNECTION ) );
+		pthread_t thread;
+		pthread_attr_t attr;
+
+		pthread_mutex_lock( &mock->lock );
+		if( connection==NULL || !mock->running ) {
+			pthread_mutex_unlock( &mock->lock );
+			if( connection ) free( connection );
+			close( fd );
+			continue;
+		}
+		connection->mock=mock;
+		connection->fd=fd;
+		connection->next=mock->connections;
+		mock->connections=connection;
+		mock->connections_accepted++;
+
+		pthread_attr_init( &attr );
+		pthread_attr_setdetachstate( &attr,PTHREAD_CREATE_DETACHED );
+		if( pthread_create( &thread,&attr,( void*(*)( void* ) )cas_mock_serve,connection )!=0 ) {
+			mock->connections=connection->next;
+			close( fd );
+			free( connection );
+		}
+		pthread_attr_destroy( &attr );
+		pthread_mutex_unlock( &mock->lock );
+	}
+	return( NULL );
+}
+
+#ifdef HAVE_OPENSSL
+/*******************************************************************************
+ * cas_mock_ssl_ctx: TLS server context with a fresh self-signed certificate
+ *  for localhost
+ */
+static SSL_CTX*
+cas_mock_ssl_ctx( CAS_MOCK* mock ) {
+	SSL_CTX* ctx=NULL;
+	EVP_PKEY* key=NULL;
+	EVP_PKEY_CTX* key_ctx=NULL;
+	X509* cert=NULL;
+
+	if((key_ctx=EVP_PKEY_CTX_new_id( EVP_PKEY_EC,NULL ))==NULL
+	 || EVP_PKEY_keygen_init( key_ctx )<=0
+	 || EVP_PKEY_CTX_set_ec_paramgen_curve_nid( key_ctx,NID_X9_62_prime256v1 )<=0
+	 || EVP_PKEY_keygen( key_ctx,&key )<=0 ) {
+		goto done;
+	}
+
+	if((cert=X509_new())==NULL) goto done;
+	X509_set_version( cert,2 );
+	ASN1_INTEGER_set( X509_get_serialNumber( cert ),1 );
+	X509_gmtime_adj( X509_getm_notBefore( cert ),0 );
+	X509_gmtime_adj( X509_getm_notAfter( cert ),86400 );
+	X509_set_pubkey( cert,key );
+	X509_NAME* name=X509_get_subject_name( cert );
+	X509_NAME_add_entry_by_txt( name,"CN",MBSTRING_ASC,( const unsigned char* )"localhost",-1,-1,0 );
+	X509_set_issuer_name( cert,name );
+	if( X509_sign( cert,key,EVP_sha256() )==0 ) goto done;
+
+	if((ctx=SSL_CTX_new( TLS_server_method() ))) {
+		if( SSL_CTX_use_certificate( ctx,cert )!=1 || SSL_CTX_use_PrivateKey( ctx,key )!=1 ) {
+			SSL_CTX_free( ctx );
+			ctx=NULL;
+		}
+	}
+#ifdef CAS_MOCK_HTTP2
+	if( ctx ) SSL_CTX_set_alpn_select_cb( ctx,( SSL_CTX_alpn_select_cb_func )cas_mock_alpn,mock );
+#endif
+
+done:
+	if( cert ) X509_free( cert );
+	if( key ) EVP_PKEY_free( key );
+	if( key_ctx ) EVP_PKEY_CTX_free( key_ctx );
+	return( ctx );
+}
+#endif
+
+/*******************************************************************************
+ * cas_mock_start: Start a mock CAS server
+ */
+CAS_MOCK*
+cas_mock_start( const CAS_MOCK_CONFIG* config ) {
+	CAS_MOCK* mock=NULL;
+	struct sockaddr_in address;
+	socklen_t address_size=sizeof( address );
+	int one=1;
+	int i;
+
+	if((mock=calloc( 1,sizeof( CAS_MOCK ) ))==NULL) {
+		return( NULL );
+	}
+	mock->config=*config;
+	mock->latency_us=config->latency_us;
+	mock->random=( unsigned int )( uintptr_t )mock;
+	mock->fd=-1;
+	pthread_mutex_init( &mock->lock,NULL );
+	pthread_cond_init( &mock->idle,NULL );
+
+	//Response bodies, with the default success bodies rendered for the principal
+	// and attributes
+	const char* principal=( config->principal ? config->principal : "myprinc" );
+	int attributes=( config->attributes>0 ? config->attributes : 0 );
+	const char* configured[6]={ config->cas1_success,config->cas1_failure,config->cas2_success,config->cas2_failure,config->json_success,config->json_failure };
+	for( i=0; i<6; i++ ) {
+		if( configured[i] ) {
+			mock->bodies[i]=strdup( configured[i] );
+		} else if( i==1 ) {
+			mock->bodies[i]=strdup( cas_mock_cas1_failure );
+		} else if( i==3 ) {
+			mock->bodies[i]=strdup( cas_mock_cas2_failure );
+		} else if( i==5 ) {
+			mock->bodies[i]=strdup( cas_mock_json_failure );
+		} else if((mock->bodies[i]=malloc( strlen( principal )+256+attributes*96 ))) {
+			char* p=mock->bodies[i];
+			int j;
+			if( i==0 ) {
+				sprintf( p,"yes\n%s\n",principal );
+			} else if( i==2 ) {
+				p+=sprintf( p,"<cas:serviceResponse xmlns:cas='http://www.yale.edu/tp/cas'>\n    <cas:authenticationSuccess>\n        <cas:user>%s</cas:user>\n",principal );
+				if( attributes ) {
+					p+=sprintf( p,"        <cas:attributes>\n" );
+					for( j=0; j<attributes; j++ ) {
+						p+=sprintf( p,"            <cas:memberOf>cn=group%d,ou=groups,dc=example,dc=edu</cas:memberOf>\n",j );
+					}
+					p+=sprintf( p,"        </cas:attributes>\n" );
+				}
+				sprintf( p,"    </cas:authenticationSuccess>\n</cas:serviceResponse>\n" );
+			} else {
+				p+=sprintf( p,"{\"serviceResponse\":{\"authenticationSuccess\":{\"user\":\"%s\"",principal );
+				if( attributes ) {
+					p+=sprintf( p,",\"attributes\":{\"memberOf\":[" );
+					for( j=0; j<attributes; j++ ) {
+						p+=sprintf( p,"%s\"cn=group%d,ou=groups,dc=example,dc=edu\"",( j ? "," : "" ),j );
+					}
+					p+=sprintf( p,"]}" );
+				}
+				sprintf( p,"}}}" );
+			}
+		}
+		if( mock->bodies[i]==NULL ) goto fail;
+
+#ifdef HAVE_ZLIB
+		//gzip, as sent to clients that accept it
+		z_stream z;
+		memset( &z,0,sizeof( z ) );
+		if( deflateInit2( &z,Z_DEFAULT_COMPRESSION,Z_DEFLATED,15+16,8,Z_DEFAULT_STRATEGY )!=Z_OK ) goto fail;
+		uLong bound=deflateBound( &z,strlen( mock->bodies[i] ) );
+		if((mock->gzip_bodies[i]=malloc( bound ))) {
+			z.next_in=( Bytef* )mock->bodies[i];
+			z.avail_in=strlen( mock->bodies[i] );
+			z.next_out=( Bytef* )mock->gzip_bodies[i];
+			z.avail_out=bound;
+			deflate( &z,Z_FINISH );
+			mock->gzip_sizes[i]=z.total_out;
+		}
+		deflateEnd( &z );
+		if( mock->gzip_bodies[i]==NULL ) goto fail;
+#endif
+	}
+
+	//The error page of a load balancer, longer than any CAS response
+	if((mock->error_body=malloc( 16384 ))==NULL) goto fail;
+	char* p=mock->error_body;
+	p+=sprintf( p,"<!DOCTYPE html>\n<html>\n<head><title>Service Unavailable</title></head>\n<body>\n" );
+	for( i=0; i<160; i++ ) {
+		p+=sprintf( p,"<p>No server is available to handle this request.</p>\n" );
+	}
+	sprintf( p,"</body>\n</html>\n" );
+
+#ifdef HAVE_OPENSSL
+	if( config->https && ( mock->ssl_ctx=cas_mock_ssl_ctx( mock ) )==NULL ) {
+		goto fail;
+	}
+#ifndef CAS_MOCK_HTTP2
+	if( config->http2 ) {
+		fprintf( stderr,"cas_mock_start: built without nghttp2, no HTTP/2\n" );
+		goto fail;
+	}
+#endif
+#else
+	if( config->https ) {
+		fprintf( stderr,"cas_mock_start: built without OpenSSL, no HTTPS\n" );
+		goto fail;
+	}
+#endif
+
+	memset( &address,0,sizeof( address ) );
+	address.sin_family=AF_INET;
+	address.sin_addr.s_addr=htonl( INADDR_LOOPBACK );
+	if((mock->fd=socket( AF_INET,SOCK_STREAM,0 ))<0
+	 || setsockopt( mock->fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof( one ) )!=0
+	 || bind( mock->fd,( struct sockaddr* )&address,sizeof( address ) )!=0
+	 || listen( mock->fd,1024 )!=0
+	 || getsockname( mock->fd,( struct sockaddr* )&address,&address_size )!=0 ) {
+		goto fail;
+	}
+	snprintf( mock->url,sizeof( mock->url ),"%s://127.0.0.1:%d/cas",( config->https ? "https" : "http" ),ntohs( address.sin_port ) );
+
+	mock->running=1;
+	if( pthread_create( &mock->acceptor,NULL,( void*(*)( void* ) )cas_mock_accept,mock )!=0 ) {
+		goto fail;
+	}
+
+	return( mock );
+
+fail:
+	if( mock->fd>=0 ) close( mock->fd );
+#ifdef HAVE_OPENSSL
+	if( mock->ssl_ctx ) SSL_CTX_free( mock->ssl_ctx );
+#endif
+	for( i=0; i<6; i++ ) {
+		if( mock->bodies[i] ) free( mock->bodies[i] );
+		if( mock->gzip_bodies[i] ) free( mock->gzip_bodies[i] );
+	}
+	if( mock->error_body ) free( mock->error_body );
+	pthread_cond_destroy( &mock->idle );
+	pthread_mutex_destroy( &mock->lock );
+	free( mock );
+	return( NULL );
+}
+
+/*******************************************************************************
+ * cas_mock_url: Base URL of the server
+ */
+const char*
+cas_mock_url( CAS_MOCK* mock ) {
+	return( mock->url );
+}
+
+/*******************************************************************************
+ * cas_mock_requests: Requests answered so far
+ */
+unsigned long
+cas_mock_requests( CAS_MOCK* mock ) {
+	pthread_mutex_lock( &mock->lock );
+	unsigned long requests=mock->requests;
+	pthread_mutex_unlock( &mock->lock );
+	return( requests );
+}
+
+/*******************************************************************************
+ * cas_mock_connections: Connections accepted so far
+ */
+unsigned long
+cas_mock_connections( CAS_MOCK* mock ) {
+	pthread_mutex_lock( &mock->lock );
+	unsigned long connections=mock->connections_accepted;
+	pthread_mutex_unlock( &mock->lock );
+	return( connections );
+}
+
+/*******************************************************************************
+ * cas_mock_set_latency: Change the delay before every response
+ */
+void
+cas_mock_set_latency( CAS_MOCK* mock, long latency_us ) {
+	pthread_mutex_lock( &mock->lock );
+	mock->latency_us=latency_us;
+	pthread_mutex_unlock( &mock->lock );
+}
+
+/*******************************************************************************
+ * cas_mock_set_down: Take the server down, or bring it back up
+ */
+void
+cas_mock_set_down( CAS_MOCK* mock, int down ) {
+	pthread_mutex_lock( &mock->lock );
+	mock->down=down;
+	pthread_mutex_unlock( &mock->lock );
+}
+
+/*******************************************************************************
+ * cas_mock_set_error: Fail every request with an HTTP status, or 0 to answer
+ *  them again
+ */
+void
+cas_mock_set_error( CAS_MOCK* mock, int status ) {
+	pthread_mutex_lock( &mock->lock );
+	mock->error_status=status;
+	pthread_mutex_unlock( &mock->lock );
+}
+
+/*******************************************************************************
+ * cas_mock_stop: Stop accepting, close every connection and wait for their
+ *  threads to finish
+ */
+void
+cas_mock_stop( CAS_MOCK* mock ) {
+	CAS_MOCK_CONNECTION* connection;
+	int i;
+
+	if( mock==NULL ) {
+		return;
+	}
+
+	pthread_mutex_lock( &mock->lock );
+	mock->running=0;
+	pthread_mutex_unlock( &mock->lock );
+	shutdown( mock->fd,SHUT_RDWR );
+	pthread_join( mock->acceptor,NULL );
+	close( mock->fd );
+
+	pthread_mutex_lock( &mock->lock );
+	for( connection=mock->connections; connection; connection=connection->next ) {
+		shutdown( connection->fd,SHUT_RDWR );
+	}
+	while( mock->connections ) {
+		pthread_cond_wait( &mock->idle,&mock->lock );
+	}
+	pthread_mutex_unlock( &mock->lock );
+
+#ifdef HAVE_OPENSSL
+	if( mock->ssl_ctx ) SSL_CTX_free( mock->ssl_ctx );
+#endif
+	for( i=0; i<6; i++ ) {
+		free( mock->bodies[i] );
+		if( mock->gzip_bodies[i] ) free( mock->gzip_bodies[i] );
+	}
+	free( mock->error_body );
+	pthread_cond_destroy( &mock->idle );
+	pthread_mutex_destroy( &mock->lock );
+	free( mock );
+}
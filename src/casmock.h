@@ -0,0 +1,78 @@
+/*******************************************************************************
+ * casmock.h
+ *
+ * Multi-threaded mock CAS server for benchmarks, run inside the benchmark
+ * process.  Not part of libcas.
+ */
+
+#ifndef CASMOCK_H
+#define CASMOCK_H
+
+typedef struct CAS_MOCK CAS_MOCK;
+
+typedef struct {
+	int https;						// - serve HTTPS with a generated self-signed certificate
+	int http2;						// - also offer HTTP/2 over HTTPS, if built with nghttp2
+	int attributes;					// - released by the default CAS2 and JSON success bodies
+	long latency_us;				// - delay before every response
+	int tail_percent;				// - share of responses, at random, delayed by tail_latency_us instead
+	long tail_latency_us;
+	const char* principal;			// - principal of the default success bodies, "myprinc" if NULL
+
+	//-- Response bodies, the defaults if NULL.  Tickets containing "bad" get
+	//--  the failure bodies, any other ticket the success bodies.
+	const char* cas1_success;
+	const char* cas1_failure;
+	const char* cas2_success;
+	const char* cas2_failure;
+	const char* json_success;		// - CAS3 format=JSON
+	const char* json_failure;
+} CAS_MOCK_CONFIG;
+
+/**
+ *	Start a mock CAS server on an ephemeral port of 127.0.0.1. It answers
+ *	.../validate as CAS1, and .../serviceValidate (CAS2 and CAS3, XML or
+ *	format=JSON), with keep-alive and one thread per connection.  Responses
+ *	are gzipped for clients that accept it, if built with zlib.  SIGPIPE must
+ *	be ignored, as a client may close a connection before it is answered.
+ *  @param config the configuration, copied.
+ *  @return the running server, or NULL on failure.
+ */
+CAS_MOCK* cas_mock_start( const CAS_MOCK_CONFIG* config );
+
+/**
+ *	Base URL of a running server, such as "http://127.0.0.1:40123/cas".
+ */
+const char* cas_mock_url( CAS_MOCK* mock );
+
+/**
+ *	Number of requests answered, and of connections accepted, so far.
+ */
+unsigned long cas_mock_requests( CAS_MOCK* mock );
+unsigned long cas_mock_connections( CAS_MOCK* mock );
+
+/**
+ *	Slow a running server down, or speed it up, to latency_us before every
+ *	response.
+ */
+void cas_mock_set_latency( CAS_MOCK* mock, long latency_us );
+
+/**
+ *	Take a running server down: every request is dropped unanswered, by
+ *	closing its connection, until the server is brought back up with down 0.
+ */
+void cas_mock_set_down( CAS_MOCK* mock, int down );
+
+/**
+ *	Fail every request of a running server with an HTTP status, such as 503,
+ *	and a long HTML error page, as a load balancer with no CAS server behind
+ *	it would, until status 0 has it answer them again.
+ */
+void cas_mock_set_error( CAS_MOCK* mock, int status );
+
+/**
+ *	Stop a server, closing every connection, and free it.
+ */
+void cas_mock_stop( CAS_MOCK* mock );
+
+#endif
@@ -0,0 +1,377 @@
+/*******************************************************************************
+ * casmulti.c
+ *
+ * Concurrent validation on top of curl_multi
+ *
+ * Every CAS handle already owns its own CURL easy handle and, while a
+ * validation is in flight, its own response state (CAS1 buffer or CAS2 SAX
+ * push parser).  A CAS_BATCH therefore only has to start each handle,
+ * attach the easy handles to one curl_multi, and call the protocol finish
+ * routine as each transfer completes.
+ *
+ * A CAS_ASYNC is the same idea turned inside out for callers that own an
+ * event loop: curl_multi_socket_action() is driven by the caller, who is
+ * told which sockets and timeouts to watch, and each validation reports
+ * back through its own completion callback.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <curl/curl.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cas.h"
+#include "cas-int.h"
+
+struct CAS_BATCH {
+	CURLM* multi;
+	CAS** handles;
+	size_t count;
+	size_t capacity;
+	long max_in_flight;
+	size_t max_connects;			// - connection cache size given to multi
+};
+
+struct CAS_ASYNC {
+	CURLM* multi;
+	cas_socket_callback socket_callback;
+	cas_timer_callback timer_callback;
+	void* userp;
+	CAS* in_flight;					// - list of handles attached to multi
+};
+
+/*******************************************************************************
+ * cas_async_link: add cas to the in-flight list of async
+ */
+static void
+cas_async_link( CAS_ASYNC* async, CAS* cas ) {
+	cas->async=async;
+	cas->async_prev=NULL;
+	cas->async_next=async->in_flight;
+	if( async->in_flight ) async->in_flight->async_prev=cas;
+	async->in_flight=cas;
+}
+
+/*******************************************************************************
+ * cas_async_unlink: remove cas from the in-flight list of its CAS_ASYNC
+ */
+void
+cas_async_unlink( CAS* cas ) {
+	if( cas->async_prev ) {
+		cas->async_prev->async_next=cas->async_next;
+	} else if( cas->async ) {
+		cas->async->in_flight=cas->async_next;
+	}
+	if( cas->async_next ) cas->async_next->async_prev=cas->async_prev;
+
+	cas->async=NULL;
+	cas->async_next=NULL;
+	cas->async_prev=NULL;
+}
+
+/*******************************************************************************
+ * cas_multi_complete: finish every handle whose transfer on multi is done,
+ *  or restart it on another endpoint, returning how many were finished
+ */
+static size_t
+cas_multi_complete( CURLM* multi ) {
+	size_t completed=0;
+	CURLMsg* msg;
+	int queued;
+
+	while((msg=curl_multi_info_read( multi,&queued ))) {
+		if( msg->msg==CURLMSG_DONE ) {
+			CURL* curl=msg->easy_handle;
+			CURLcode status=msg->data.result;
+			CAS* cas=NULL;
+
+			curl_easy_getinfo( curl,CURLINFO_PRIVATE,( char** )&cas );
+			curl_multi_remove_handle( multi,curl );
+
+			//Fail over to another endpoint, still in flight
+			if( cas_retry( cas,status ) ) {
+				if( curl_multi_add_handle( multi,curl )==CURLM_OK ) {
+					continue;
+				}
+				status=CURLE_FAILED_INIT;
+			}
+			cas->multi=NULL;
+			if( cas->async ) cas_async_unlink( cas );
+			completed++;
+
+			cas_debug("Finished %p (%d)",cas,status);
+			CAS_CODE code=cas_finish( cas,status );
+			cas_reject_learn( cas );
+			if( cas->done ) {
+				cas->done( cas,code,( code==CAS_VALIDATION_SUCCESS ? cas->principal : NULL ),cas->done_userp );
+			}
+		}
+	}
+
+	return( completed );
+}
+
+/*******************************************************************************
+ * cas_batch_new: create a new, empty batch
+ */
+CAS_BATCH*
+cas_batch_new() {
+	CAS_BATCH* batch=NULL;
+
+	if((batch=cas_calloc( 1,sizeof( CAS_BATCH ) ))){
+		if((batch->multi=curl_multi_init())==NULL){
+			cas_free( batch );
+			return( NULL );
+		}
+		//Handles with cas_set_http2() share connections, many transfers at a time
+		curl_multi_setopt( batch->multi,CURLMOPT_PIPELINING,CURLPIPE_MULTIPLEX );
+	}
+
+	return( batch );
+}
+
+/*******************************************************************************
+ * cas_batch_set_max_in_flight: cap the number of concurrent transfers, 0=none
+ */
+void
+cas_batch_set_max_in_flight( CAS_BATCH* batch, long max_in_flight ) {
+	batch->max_in_flight=( max_in_flight>0 ? max_in_flight : 0 );
+}
+
+/*******************************************************************************
+ * cas_batch_add: queue a validation on cas, to be run by cas_validate_batch
+ */
+CAS_CODE
+cas_batch_add( CAS_BATCH* batch, CAS* cas, CAS_PROTOCOL protocol, char* validate_url, char* escaped_service, char* ticket, int renew ) {
+	if(!batch || !cas) {
+		return(CAS_INVALID_PARAMETERS);
+	}
+
+	if( batch->count==batch->capacity ) {
+		size_t capacity=( batch->capacity ? batch->capacity*2 : 16 );
+		CAS** handles=cas_realloc( batch->handles,capacity*sizeof( CAS* ) );
+		if(handles==NULL) return(CAS_ENOMEM);
+		batch->handles=handles;
+		batch->capacity=capacity;
+	}
+
+	CAS_CODE rc=cas_start( cas,protocol,validate_url,escaped_service,ticket,renew );
+	if( rc!=CAS_VALIDATION_SUCCESS ) {
+		cas->code=rc;
+		return( rc );
+	}
+	cas->done=NULL;
+
+	batch->handles[batch->count++]=cas;
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_validate_batch: run every queued validation concurrently, returning
+ *  once all have completed.  Results are left on each CAS handle.
+ */
+CAS_CODE
+cas_validate_batch( CAS_BATCH* batch ) {
+	if(!batch) {
+		return(CAS_INVALID_PARAMETERS);
+	}
+
+	CAS_CODE rc=CAS_VALIDATION_SUCCESS;
+	size_t next=0;
+	size_t in_flight=0;
+	int running=0;
+
+	//Keep a connection per transfer between batches; curl's default cache is
+	// sized by the handles still attached, which is none at the end of a batch
+	if( batch->count>batch->max_connects ) {
+		batch->max_connects=batch->count;
+		curl_multi_setopt( batch->multi,CURLMOPT_MAXCONNECTS,( long )batch->max_connects );
+	}
+
+	while( next<batch->count || in_flight>0 ) {
+		//Top up the multi handle to max_in_flight
+		while( next<batch->count && ( batch->max_in_flight==0 || in_flight<(size_t)batch->max_in_flight ) ) {
+			CAS* cas=batch->handles[next++];
+			if( !cas_endpoints_admit( cas,0 ) || curl_multi_add_handle( batch->multi,cas->curl )!=CURLM_OK ) {
+				cas_finish( cas,CURLE_FAILED_INIT );
+				continue;
+			}
+			cas->multi=batch->multi;
+			in_flight++;
+		}
+
+		if( curl_multi_perform( batch->multi,&running )!=CURLM_OK ) {
+			rc=CAS_CURL_FAILURE;
+			break;
+		}
+
+		//Finish anything that completed
+		in_flight-=cas_multi_complete( batch->multi );
+
+		if( running>0 ) {
+			curl_multi_wait( batch->multi,NULL,0,1000,NULL );
+		}
+	}
+
+	//Anything not finished after a multi failure is finished as a cURL failure
+	while( next<batch->count ) {
+		cas_finish( batch->handles[next++],CURLE_FAILED_INIT );
+	}
+	for( next=0; in_flight>0 && next<batch->count; next++ ) {
+		CAS* cas=batch->handles[next];
+		if( cas->multi==batch->multi ) {
+			curl_multi_remove_handle( batch->multi,cas->curl );
+			cas->multi=NULL;
+			cas_finish( cas,CURLE_FAILED_INIT );
+			in_flight--;
+		}
+	}
+
+	batch->count=0;
+	return( rc );
+}
+
+/*******************************************************************************
+ * cas_batch_zap: destroy the batch.  CAS handles added to it are not destroyed.
+ */
+void
+cas_batch_zap( CAS_BATCH* batch ) {
+	if(batch){
+		if( batch->multi ) curl_multi_cleanup( batch->multi );
+		if( batch->handles ) cas_free( batch->handles );
+
+		batch->multi=NULL;
+		batch->handles=NULL;
+
+		cas_free( batch );
+	}
+}
+
+/*******************************************************************************
+ * cas_async_socket: cURL socket callback, handed on to the caller's event loop
+ */
+static int
+cas_async_socket( CURL* curl, curl_socket_t s, int what, CAS_ASYNC* async, void* socketp ) {
+	cas_debug("Socket %d: %d",(int)s,what);
+	return( async->socket_callback( (int)s,what,async->userp ) );
+}
+
+/*******************************************************************************
+ * cas_async_timer: cURL timer callback, handed on to the caller's event loop
+ */
+static int
+cas_async_timer( CURLM* multi, long timeout_ms, CAS_ASYNC* async ) {
+	cas_debug("Timer: %ld",timeout_ms);
+	if( async->timer_callback ) {
+		async->timer_callback( timeout_ms,async->userp );
+	}
+	return( 0 );
+}
+
+/*******************************************************************************
+ * cas_async_new: create a validation context driven by the caller's event loop
+ */
+CAS_ASYNC*
+cas_async_new( cas_socket_callback socket_callback, cas_timer_callback timer_callback, void* userp ) {
+	CAS_ASYNC* async=NULL;
+
+	if(!socket_callback) {
+		return( NULL );
+	}
+
+	if((async=cas_calloc( 1,sizeof( CAS_ASYNC ) ))){
+		if((async->multi=curl_multi_init())==NULL){
+			cas_free( async );
+			return( NULL );
+		}
+		async->socket_callback=socket_callback;
+		async->timer_callback=timer_callback;
+		async->userp=userp;
+
+		curl_multi_setopt( async->multi,CURLMOPT_SOCKETFUNCTION,( curl_socket_callback )cas_async_socket );
+		curl_multi_setopt( async->multi,CURLMOPT_SOCKETDATA,async );
+		curl_multi_setopt( async->multi,CURLMOPT_TIMERFUNCTION,( curl_multi_timer_callback )cas_async_timer );
+		curl_multi_setopt( async->multi,CURLMOPT_TIMERDATA,async );
+		curl_multi_setopt( async->multi,CURLMOPT_PIPELINING,CURLPIPE_MULTIPLEX );
+	}
+
+	return( async );
+}
+
+/*******************************************************************************
+ * cas_async_start: begin a validation on cas without waiting for it
+ */
+CAS_CODE
+cas_async_start( CAS_ASYNC* async, CAS* cas, CAS_PROTOCOL protocol, char* validate_url, char* escaped_service, char* ticket, int renew, cas_done_callback done, void* done_userp ) {
+	if(!async || !cas || !done || cas->multi) {
+		return(CAS_INVALID_PARAMETERS);
+	}
+
+	CAS_CODE rc=cas_start( cas,protocol,validate_url,escaped_service,ticket,renew );
+	if( rc!=CAS_VALIDATION_SUCCESS ) {
+		cas->code=rc;
+		return( rc );
+	}
+
+	cas->done=done;
+	cas->done_userp=done_userp;
+
+	//Adding the handle asks the timer callback for an immediate timeout, which
+	// is what actually starts the transfer
+	if( !cas_endpoints_admit( cas,0 ) || curl_multi_add_handle( async->multi,cas->curl )!=CURLM_OK ) {
+		cas->done=NULL;
+		return( cas_finish( cas,CURLE_FAILED_INIT ) );
+	}
+	cas->multi=async->multi;
+	cas_async_link( async,cas );
+
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_async_socket_action: tell libcas that fd is ready (or, for
+ *  CAS_SOCKET_TIMEOUT, that the timer expired).  Completion callbacks of any
+ *  validations that finished are called before this returns.
+ */
+CAS_CODE
+cas_async_socket_action( CAS_ASYNC* async, int fd, int events, int* running ) {
+	int still_running=0;
+
+	if(!async) {
+		return(CAS_INVALID_PARAMETERS);
+	}
+
+	CURLMcode mrc=curl_multi_socket_action( async->multi,( curl_socket_t )fd,events,&still_running );
+	cas_multi_complete( async->multi );
+	if( running ) {
+		*running=still_running;
+	}
+
+	return( mrc==CURLM_OK ? CAS_VALIDATION_SUCCESS : CAS_CURL_FAILURE );
+}
+
+/*******************************************************************************
+ * cas_async_zap: destroy the context.  Validations still in flight are
+ *  abandoned without their completion callback, CAS handles are not destroyed.
+ */
+void
+cas_async_zap( CAS_ASYNC* async ) {
+	if(async){
+		while( async->in_flight ) {
+			CAS* cas=async->in_flight;
+			curl_multi_remove_handle( async->multi,cas->curl );
+			cas_endpoints_release( cas );
+			cas->multi=NULL;
+			cas_async_unlink( cas );
+		}
+		if( async->multi ) curl_multi_cleanup( async->multi );
+
+		async->multi=NULL;
+
+		cas_free( async );
+	}
+}
@@ -0,0 +1,368 @@
+/*******************************************************************************
+ * caspool.c
+ *
+ * Thread-safe pool of CAS handles
+ *
+ * A CAS handle must still only be used by one thread at a time, but handles
+ * taken from a CAS_POOL share DNS cache, TLS session IDs and live connections
+ * through one CURLSH.  libcurl serializes access to the shared data through
+ * the lock callbacks below, one mutex per kind of shared data.
+ *
+ * A pool can be prewarmed: a number of its handles open connections to every
+ * endpoint at once, and go back to the pool idle, so that as many validations
+ * find a live connection waiting.  With a keepalive interval a background
+ * thread then warms the same connections again every interval, through the
+ * handles idle at the time, before servers close them for being idle.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cas.h"
+#include "cas-int.h"
+
+//Idle connections a handle leaves in the shared cache before curl_easy_perform()
+// closes the oldest: cURL's default of 5 would churn connections as soon as
+// more than 5 threads validate at once
+#define CAS_POOL_MAX_CONNECTS 1024L
+
+struct CAS_POOL {
+	CURLSH* share;
+	pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+	pthread_mutex_t lock;			// - guards everything below
+	CAS** idle;
+	size_t count;
+	size_t capacity;
+
+	char* ssl_ca;
+	int ssl_validate_server;
+	CAS_ENDPOINTS* endpoints;
+
+	char* prewarm_url;				// - of the last cas_pool_prewarm(), NULL before
+	int prewarm_count;
+	long keepalive_ms;				// - time between keepalive rounds, 0 for none
+	pthread_t keeper;
+	int keeper_running;
+	int stopping;
+	pthread_cond_t wake;			// - keepalive changed, or the pool is being zapped
+};
+
+static void* cas_pool_keeper( CAS_POOL* pool );
+
+/*******************************************************************************
+ * cas_pool_share_lock/unlock: cURL share lock callbacks
+ */
+static void
+cas_pool_share_lock( CURL* curl, curl_lock_data data, curl_lock_access access, CAS_POOL* pool ) {
+	pthread_mutex_lock( &pool->share_locks[data] );
+}
+
+static void
+cas_pool_share_unlock( CURL* curl, curl_lock_data data, CAS_POOL* pool ) {
+	pthread_mutex_unlock( &pool->share_locks[data] );
+}
+
+/*******************************************************************************
+ * cas_pool_new: create a new, empty pool
+ */
+CAS_POOL*
+cas_pool_new() {
+	CAS_POOL* pool=NULL;
+	pthread_condattr_t attr;
+	int i;
+
+	if((pool=cas_calloc( 1,sizeof( CAS_POOL ) ))){
+		if((pool->share=curl_share_init())==NULL){
+			cas_free( pool );
+			return( NULL );
+		}
+		for( i=0; i<CURL_LOCK_DATA_LAST; i++ ) {
+			pthread_mutex_init( &pool->share_locks[i],NULL );
+		}
+		pthread_mutex_init( &pool->lock,NULL );
+		pthread_condattr_init( &attr );
+		pthread_condattr_setclock( &attr,CLOCK_MONOTONIC );
+		pthread_cond_init( &pool->wake,&attr );
+		pthread_condattr_destroy( &attr );
+		pool->ssl_validate_server=1;
+
+		curl_share_setopt( pool->share,CURLSHOPT_LOCKFUNC,( curl_lock_function )cas_pool_share_lock );
+		curl_share_setopt( pool->share,CURLSHOPT_UNLOCKFUNC,( curl_unlock_function )cas_pool_share_unlock );
+		curl_share_setopt( pool->share,CURLSHOPT_USERDATA,pool );
+		curl_share_setopt( pool->share,CURLSHOPT_SHARE,CURL_LOCK_DATA_DNS );
+		curl_share_setopt( pool->share,CURLSHOPT_SHARE,CURL_LOCK_DATA_SSL_SESSION );
+		curl_share_setopt( pool->share,CURLSHOPT_SHARE,CURL_LOCK_DATA_CONNECT );
+	}
+
+	return( pool );
+}
+
+/*******************************************************************************
+ * cas_pool_set_ssl_ca: set the CA for handles handed out by the pool
+ */
+void
+cas_pool_set_ssl_ca( CAS_POOL* pool, const char* capath ) {
+	size_t i;
+
+	pthread_mutex_lock( &pool->lock );
+	if( pool->ssl_ca ) cas_free( pool->ssl_ca );
+	pool->ssl_ca=( capath ? cas_strdup( capath ) : NULL );
+	for( i=0; pool->ssl_ca && i<pool->count; i++ ) {
+		cas_set_ssl_ca( pool->idle[i],pool->ssl_ca );
+	}
+	pthread_mutex_unlock( &pool->lock );
+}
+
+/*******************************************************************************
+ * cas_pool_set_ssl_validate_server: set server certificate validation for
+ *  handles handed out by the pool
+ */
+void
+cas_pool_set_ssl_validate_server( CAS_POOL* pool, int verify ) {
+	size_t i;
+
+	pthread_mutex_lock( &pool->lock );
+	pool->ssl_validate_server=verify;
+	for( i=0; i<pool->count; i++ ) {
+		cas_set_ssl_validate_server( pool->idle[i],verify );
+	}
+	pthread_mutex_unlock( &pool->lock );
+}
+
+/*******************************************************************************
+ * cas_pool_set_endpoints: set the endpoints of handles handed out by the pool
+ */
+void
+cas_pool_set_endpoints( CAS_POOL* pool, CAS_ENDPOINTS* endpoints ) {
+	size_t i;
+
+	pthread_mutex_lock( &pool->lock );
+	pool->endpoints=endpoints;
+	for( i=0; i<pool->count; i++ ) {
+		cas_set_endpoints( pool->idle[i],endpoints );
+	}
+	pthread_mutex_unlock( &pool->lock );
+}
+
+/*******************************************************************************
+ * cas_pool_get: take a handle from the pool, creating one if none are idle
+ */
+CAS*
+cas_pool_get( CAS_POOL* pool ) {
+	CAS* cas=NULL;
+
+	pthread_mutex_lock( &pool->lock );
+	if( pool->count>0 ) {
+		cas=pool->idle[--pool->count];
+	} else if((cas=cas_new())) {
+		curl_easy_setopt( cas->curl,CURLOPT_SHARE,pool->share );
+		curl_easy_setopt( cas->curl,CURLOPT_MAXCONNECTS,CAS_POOL_MAX_CONNECTS );
+		cas->options_version++;
+		if( pool->ssl_ca ) cas_set_ssl_ca( cas,pool->ssl_ca );
+		cas_set_ssl_validate_server( cas,pool->ssl_validate_server );
+		if( pool->endpoints ) cas_set_endpoints( cas,pool->endpoints );
+		cas->pool=pool;
+	}
+	pthread_mutex_unlock( &pool->lock );
+
+	return( cas );
+}
+
+/*******************************************************************************
+ * cas_pool_put: return a handle taken with cas_pool_get to the pool
+ */
+void
+cas_pool_put( CAS_POOL* pool, CAS* cas ) {
+	if(!pool || !cas) {
+		return;
+	}
+	if( cas->pool!=pool ) {
+		cas_zap( cas );
+		return;
+	}
+
+	pthread_mutex_lock( &pool->lock );
+	if( pool->count==pool->capacity ) {
+		size_t capacity=( pool->capacity ? pool->capacity*2 : 16 );
+		CAS** idle=cas_realloc( pool->idle,capacity*sizeof( CAS* ) );
+		if(idle==NULL) {
+			pthread_mutex_unlock( &pool->lock );
+			cas_zap( cas );
+			return;
+		}
+		pool->idle=idle;
+		pool->capacity=capacity;
+	}
+	pool->idle[pool->count++]=cas;
+	pthread_mutex_unlock( &pool->lock );
+}
+
+/*******************************************************************************
+ * cas_pool_warm: Warm the connections of the last cas_pool_prewarm(), through
+ *  as many handles as it asked for, created if need be, or only through those
+ *  idle at the time
+ */
+static CAS_CODE
+cas_pool_warm( CAS_POOL* pool, int create ) {
+	CAS** handles=NULL;
+	CURLM* multi=NULL;
+	char* url=NULL;
+	CAS_CODE rc=CAS_ENOMEM;
+	int count=0;
+	int n;
+	int i;
+
+	pthread_mutex_lock( &pool->lock );
+	n=pool->prewarm_count;
+	url=( pool->prewarm_url ? cas_strdup( pool->prewarm_url ) : NULL );
+	pthread_mutex_unlock( &pool->lock );
+
+	if( url && (handles=cas_calloc( n,sizeof( CAS* ) )) && (multi=curl_multi_init()) ) {
+		if( create ) {
+			while( count<n && (handles[count]=cas_pool_get( pool )) ) {
+				count++;
+			}
+		} else {
+			pthread_mutex_lock( &pool->lock );
+			while( count<n && pool->count>0 ) {
+				handles[count++]=pool->idle[--pool->count];
+			}
+			pthread_mutex_unlock( &pool->lock );
+		}
+
+		rc=( count>0 ? cas_prewarm_handles( multi,handles,count,url ) : CAS_VALIDATION_SUCCESS );
+		if( create && count<n && rc==CAS_VALIDATION_SUCCESS ) {
+			rc=CAS_ENOMEM;
+		}
+		for( i=0; i<count; i++ ) {
+			cas_pool_put( pool,handles[i] );
+		}
+	}
+
+	if( multi ) curl_multi_cleanup( multi );
+	if( handles ) cas_free( handles );
+	if( url ) cas_free( url );
+	return( rc );
+}
+
+/*******************************************************************************
+ * cas_pool_prewarm: warm connections of n handles to every endpoint of url
+ */
+CAS_CODE
+cas_pool_prewarm( CAS_POOL* pool, const char* url, int n ) {
+	char* copy;
+
+	if(!pool || !url || n<1) {
+		return(CAS_INVALID_PARAMETERS);
+	}
+	if((copy=cas_strdup( url ))==NULL) {
+		return(CAS_ENOMEM);
+	}
+
+	pthread_mutex_lock( &pool->lock );
+	if( pool->prewarm_url ) cas_free( pool->prewarm_url );
+	pool->prewarm_url=copy;
+	pool->prewarm_count=n;
+	pthread_mutex_unlock( &pool->lock );
+
+	return( cas_pool_warm( pool,1 ) );
+}
+
+/*******************************************************************************
+ * cas_pool_set_keepalive: warm the prewarmed connections again every
+ *  interval_ms, 0 to stop
+ */
+void
+cas_pool_set_keepalive( CAS_POOL* pool, long interval_ms ) {
+	pthread_mutex_lock( &pool->lock );
+	pool->keepalive_ms=( interval_ms>0 ? interval_ms : 0 );
+	if( pool->keepalive_ms && !pool->keeper_running ) {
+		pool->keeper_running=( pthread_create( &pool->keeper,NULL,( void*(*)( void* ) )cas_pool_keeper,pool )==0 );
+	}
+	pthread_cond_signal( &pool->wake );
+	pthread_mutex_unlock( &pool->lock );
+}
+
+/*******************************************************************************
+ * cas_pool_keeper: Background thread warming the prewarmed connections every
+ *  keepalive interval, until the pool is zapped
+ */
+static void*
+cas_pool_keeper( CAS_POOL* pool ) {
+	struct timespec until;
+
+	pthread_mutex_lock( &pool->lock );
+	while( !pool->stopping ) {
+		if( pool->keepalive_ms==0 ) {
+			pthread_cond_wait( &pool->wake,&pool->lock );
+			continue;
+		}
+
+		clock_gettime( CLOCK_MONOTONIC,&until );
+		until.tv_sec+=pool->keepalive_ms/1000;
+		until.tv_nsec+=( pool->keepalive_ms%1000 )*1000000L;
+		if( until.tv_nsec>=1000000000L ) {
+			until.tv_sec++;
+			until.tv_nsec-=1000000000L;
+		}
+		//Woken early: the interval changed, or the pool is being zapped
+		if( pthread_cond_timedwait( &pool->wake,&pool->lock,&until )!=ETIMEDOUT || pool->prewarm_url==NULL ) {
+			continue;
+		}
+
+		pthread_mutex_unlock( &pool->lock );
+		cas_pool_warm( pool,0 );
+		pthread_mutex_lock( &pool->lock );
+	}
+	pthread_mutex_unlock( &pool->lock );
+
+	return( NULL );
+}
+
+/*******************************************************************************
+ * cas_pool_zap: destroy the pool and its idle handles.  Every handle taken
+ *  with cas_pool_get must have been returned or zapped first.
+ */
+void
+cas_pool_zap( CAS_POOL* pool ) {
+	int i;
+
+	if(pool){
+		pthread_mutex_lock( &pool->lock );
+		pool->stopping=1;
+		pthread_cond_signal( &pool->wake );
+		pthread_mutex_unlock( &pool->lock );
+		if( pool->keeper_running ) {
+			pthread_join( pool->keeper,NULL );
+		}
+
+		while( pool->count>0 ) {
+			cas_zap( pool->idle[--pool->count] );
+		}
+		if( pool->share ) curl_share_cleanup( pool->share );
+		if( pool->idle ) cas_free( pool->idle );
+		if( pool->ssl_ca ) cas_free( pool->ssl_ca );
+		if( pool->prewarm_url ) cas_free( pool->prewarm_url );
+
+		for( i=0; i<CURL_LOCK_DATA_LAST; i++ ) {
+			pthread_mutex_destroy( &pool->share_locks[i] );
+		}
+		pthread_mutex_destroy( &pool->lock );
+		pthread_cond_destroy( &pool->wake );
+
+		pool->share=NULL;
+		pool->idle=NULL;
+
+		cas_free( pool );
+	}
+}
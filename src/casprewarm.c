@@ -0,0 +1,145 @@
+/*******************************************************************************
+ * casprewarm.c
+ *
+ * Connection prewarming
+ *
+ * A fresh handle pays for name resolution, the TCP connection and the TLS
+ * handshake inside its first validation.  Prewarming pays for them ahead of
+ * time, with a HEAD request of the validation path, without a ticket, to
+ * every endpoint the handle may validate at.  That leaves a live connection
+ * in the connection cache the validations of the handle draw on: the CURLSH
+ * of its pool, its hedging curl_multi, or its own.  Any HTTP answer will do;
+ * only transfers that fail count as failures.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <curl/curl.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cas.h"
+#include "cas-int.h"
+
+#define CAS_PREWARM_TIMEOUT_MS 10000L
+
+/*******************************************************************************
+ * cas_prewarm_setup: Set cas->curl up for a HEAD request of url
+ */
+static void
+cas_prewarm_setup( CAS* cas, const char* url ) {
+	curl_easy_setopt( cas->curl,CURLOPT_URL,url );
+	curl_easy_setopt( cas->curl,CURLOPT_NOBODY,1L );
+	curl_easy_setopt( cas->curl,CURLOPT_TIMEOUT_MS,CAS_PREWARM_TIMEOUT_MS );
+}
+
+/*******************************************************************************
+ * cas_prewarm_restore: Set cas->curl back to GET requests for validations
+ */
+static void
+cas_prewarm_restore( CAS* cas ) {
+	//Also clears CURLOPT_NOBODY
+	curl_easy_setopt( cas->curl,CURLOPT_HTTPGET,1L );
+}
+
+/*******************************************************************************
+ * cas_prewarm_round: Warm one connection to url per handle, all at once on
+ *  multi, or with curl_easy_perform() for a single handle if multi is NULL
+ */
+static CAS_CODE
+cas_prewarm_round( CURLM* multi, CAS** handles, int n, const char* url ) {
+	CAS_CODE rc=CAS_VALIDATION_SUCCESS;
+	CURLMsg* msg;
+	int running=0;
+	int queued;
+	int i;
+
+	cas_debug("Prewarming %d connections to %s",n,url);
+	if( multi==NULL ) {
+		cas_prewarm_setup( handles[0],url );
+		if( curl_easy_perform( handles[0]->curl )!=CURLE_OK ) {
+			rc=CAS_CURL_FAILURE;
+		}
+		cas_prewarm_restore( handles[0] );
+		return( rc );
+	}
+
+	for( i=0; i<n; i++ ) {
+		cas_prewarm_setup( handles[i],url );
+		if( curl_multi_add_handle( multi,handles[i]->curl )!=CURLM_OK ) {
+			rc=CAS_CURL_FAILURE;
+		}
+	}
+	do {
+		if( curl_multi_perform( multi,&running )!=CURLM_OK ) {
+			rc=CAS_CURL_FAILURE;
+			break;
+		}
+		while((msg=curl_multi_info_read( multi,&queued ))) {
+			if( msg->msg==CURLMSG_DONE && msg->data.result!=CURLE_OK ) {
+				rc=CAS_CURL_FAILURE;
+			}
+		}
+		if( running ) {
+			curl_multi_wait( multi,NULL,0,1000,NULL );
+		}
+	} while( running );
+
+	for( i=0; i<n; i++ ) {
+		curl_multi_remove_handle( multi,handles[i]->curl );
+		cas_prewarm_restore( handles[i] );
+	}
+	return( rc );
+}
+
+/*******************************************************************************
+ * cas_prewarm_handles: Warm one connection per handle to every endpoint of
+ *  the first handle url may be validated at
+ */
+CAS_CODE
+cas_prewarm_handles( CURLM* multi, CAS** handles, int n, const char* url ) {
+	char* given[2]={ ( char* )url,NULL };
+	char** urls=given;
+	CAS_CODE rc=CAS_VALIDATION_SUCCESS;
+	int i;
+
+	if( handles[0]->endpoints && (urls=cas_endpoints_urls( handles[0]->endpoints,url ))==NULL ) {
+		return( CAS_ENOMEM );
+	}
+	if( urls[0]==NULL ) {
+		//Every endpoint is out of rotation
+		rc=CAS_CURL_FAILURE;
+	}
+	for( i=0; urls[i]; i++ ) {
+		if( cas_prewarm_round( multi,handles,n,urls[i] )!=CAS_VALIDATION_SUCCESS ) {
+			rc=CAS_CURL_FAILURE;
+		}
+	}
+
+	if( urls!=given ) {
+		cas_endpoints_urls_free( urls );
+	}
+	return( rc );
+}
+
+/*******************************************************************************
+ * cas_prewarm: Warm a connection of a handle to every endpoint of url
+ */
+CAS_CODE
+cas_prewarm( CAS* cas, const char* url ) {
+	if(!cas || !url) {
+		return(CAS_INVALID_PARAMETERS);
+	}
+
+	//Hedged validations run on, and keep their connections in, the hedging multi
+	if( cas->hedge_percentile ) {
+		if( cas->hedge_multi==NULL && (cas->hedge_multi=curl_multi_init())==NULL ) {
+			return( CAS_ENOMEM );
+		}
+		return( cas_prewarm_handles( cas->hedge_multi,&cas,1,url ) );
+	}
+	return( cas_prewarm_handles( NULL,&cas,1,url ) );
+}
@@ -0,0 +1,273 @@
+/*******************************************************************************
+ * casreject.c
+ *
+ * Local rejection of tickets that cannot validate
+ *
+ * A junk ticket costs a round trip to the CAS server to be told it is
+ * invalid, which a replay or credential-stuffing attack sends by the
+ * thousand.  Two checks answer such tickets without the CAS server:
+ *
+ * Syntax, per handle: a ticket of the wrong prefix, characters or length is
+ * refused outright, as CAS would refuse it.
+ *
+ * A negative cache, process-wide: a validation the CAS server answered with
+ * CAS2_INVALID_TICKET or CAS1_VALIDATION_NO is remembered, by a 64-bit hash
+ * of its validation URL (service, ticket, renew and protocol), until a TTL
+ * runs out; the same validation is then answered with the same code.  A
+ * ticket only validates once, so an answer that it is invalid does not go
+ * stale.  The cache only holds hashes, and a false match would refuse a
+ * good ticket, hence 64 bits rather than a Bloom filter.  It is
+ * set-associative, buckets of CAS_REJECT_WAYS entries evicting by CLOCK,
+ * guarded by CAS_REJECT_STRIPES mutexes, bucket b by stripe
+ * b%CAS_REJECT_STRIPES.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cas.h"
+#include "cas-int.h"
+
+#define CAS_REJECT_WAYS 8
+#define CAS_REJECT_STRIPES 16
+
+typedef struct {
+	unsigned long long key;			// - 0 for an empty entry
+	double expires_us;
+	CAS_CODE code;
+	int referenced;					// - used since the clock hand last passed it
+} CAS_REJECT_ENTRY;
+
+typedef struct {
+	unsigned int hand;				// - next way the clock looks at
+	CAS_REJECT_ENTRY ways[CAS_REJECT_WAYS];
+} CAS_REJECT_BUCKET;
+
+static CAS_REJECT_BUCKET* cas_rejects=NULL;
+static size_t cas_reject_buckets=0;
+static double cas_reject_ttl_us=0;
+static pthread_mutex_t cas_reject_locks[CAS_REJECT_STRIPES]={ [0 ... CAS_REJECT_STRIPES-1]=PTHREAD_MUTEX_INITIALIZER };
+
+/*******************************************************************************
+ * cas_set_negative_cache: Size, or disable, the cache of rejected validations
+ */
+CAS_CODE
+cas_set_negative_cache( unsigned long capacity, long ttl_ms ) {
+	CAS_REJECT_BUCKET* rejects=NULL;
+	size_t buckets=( capacity+CAS_REJECT_WAYS-1 )/CAS_REJECT_WAYS;
+
+	if( capacity && ttl_ms<=0 ) {
+		return( CAS_INVALID_PARAMETERS );
+	}
+	if( buckets && (rejects=cas_calloc( buckets,sizeof( CAS_REJECT_BUCKET ) ))==NULL ) {
+		return( CAS_ENOMEM );
+	}
+
+	if( cas_rejects ) cas_free( cas_rejects );
+	cas_rejects=rejects;
+	cas_reject_buckets=buckets;
+	cas_reject_ttl_us=ttl_ms*1e3;
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_reject_key: FNV-1a 64 of the validation URL, never 0
+ */
+static unsigned long long
+cas_reject_key( const char* url ) {
+	unsigned long long key=14695981039346656037ull;
+
+	for( ; *url; url++ ) {
+		key^=( unsigned char )*url;
+		key*=1099511628211ull;
+	}
+	return( key ? key : 1 );
+}
+
+/*******************************************************************************
+ * cas_reject_lookup: The code the CAS server rejected the validation of key
+ *  with, CAS_VALIDATION_SUCCESS if it is not in the cache
+ */
+static CAS_CODE
+cas_reject_lookup( unsigned long long key ) {
+	size_t b=key%cas_reject_buckets;
+	CAS_REJECT_BUCKET* bucket=&cas_rejects[b];
+	CAS_CODE code=CAS_VALIDATION_SUCCESS;
+	double now=cas_clock_us();
+	int i;
+
+	pthread_mutex_lock( &cas_reject_locks[b%CAS_REJECT_STRIPES] );
+	for( i=0; i<CAS_REJECT_WAYS; i++ ) {
+		CAS_REJECT_ENTRY* entry=&bucket->ways[i];
+		if( entry->key==key ) {
+			if( entry->expires_us>now ) {
+				entry->referenced=1;
+				code=entry->code;
+			} else {
+				entry->key=0;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock( &cas_reject_locks[b%CAS_REJECT_STRIPES] );
+	return( code );
+}
+
+/*******************************************************************************
+ * cas_reject_insert: Remember that the CAS server rejected the validation of
+ *  key with code
+ */
+static void
+cas_reject_insert( unsigned long long key, CAS_CODE code ) {
+	size_t b=key%cas_reject_buckets;
+	CAS_REJECT_BUCKET* bucket=&cas_rejects[b];
+	CAS_REJECT_ENTRY* entry=NULL;
+	double now=cas_clock_us();
+	int i;
+
+	pthread_mutex_lock( &cas_reject_locks[b%CAS_REJECT_STRIPES] );
+	for( i=0; i<CAS_REJECT_WAYS && entry==NULL; i++ ) {
+		if( bucket->ways[i].key==key || bucket->ways[i].key==0 || bucket->ways[i].expires_us<=now ) {
+			entry=&bucket->ways[i];
+		}
+	}
+	while( entry==NULL ) {
+		CAS_REJECT_ENTRY* candidate=&bucket->ways[bucket->hand];
+		bucket->hand=( bucket->hand+1 )%CAS_REJECT_WAYS;
+		if( candidate->referenced ) {
+			candidate->referenced=0;
+		} else {
+			entry=candidate;
+		}
+	}
+	entry->key=key;
+	entry->code=code;
+	entry->expires_us=now+cas_reject_ttl_us;
+	entry->referenced=0;
+	pthread_mutex_unlock( &cas_reject_locks[b%CAS_REJECT_STRIPES] );
+}
+
+/*******************************************************************************
+ * cas_set_ticket_syntax: Refuse tickets not of the given prefixes, characters
+ *  and length, without asking the CAS server
+ */
+CAS_CODE
+cas_set_ticket_syntax( CAS* cas, const char* prefixes, const char* charset, size_t min_length, size_t max_length ) {
+	char* copy=NULL;
+	const char* c;
+
+	if(!cas || ( max_length && min_length>max_length )) {
+		return(CAS_INVALID_PARAMETERS);
+	}
+	if( prefixes && (copy=cas_strdup( prefixes ))==NULL ) {
+		return(CAS_ENOMEM);
+	}
+	if( cas->ticket_prefixes ) cas_free( cas->ticket_prefixes );
+	cas->ticket_prefixes=copy;
+	cas->ticket_min=min_length;
+	cas->ticket_max=max_length;
+
+	//"a-z" is a range, a '-' anywhere else itself
+	memset( cas->ticket_charset,0,sizeof( cas->ticket_charset ) );
+	cas->ticket_charset_set=( charset!=NULL );
+	for( c=charset; c && *c; c++ ) {
+		unsigned char from=*c;
+		unsigned char to=*c;
+		if( c[1]=='-' && c[2] ) {
+			to=c[2];
+			c+=2;
+		}
+		for( ; from<=to; from++ ) {
+			cas->ticket_charset[from>>3]|=1<<( from&7 );
+			if( from==255 ) break;
+		}
+	}
+
+	cas->ticket_syntax=( prefixes || charset || min_length || max_length );
+	return(CAS_VALIDATION_SUCCESS);
+}
+
+/*******************************************************************************
+ * cas_ticket_wellformed: Whether ticket is of the syntax set on cas
+ */
+static int
+cas_ticket_wellformed( CAS* cas, const char* ticket ) {
+	size_t length=strlen( ticket );
+	const char* prefix;
+
+	if( length<cas->ticket_min || ( cas->ticket_max && length>cas->ticket_max ) ) {
+		return( 0 );
+	}
+	if( cas->ticket_prefixes ) {
+		for( prefix=cas->ticket_prefixes; *prefix; prefix+=strcspn( prefix,"," ),prefix+=( *prefix==',' ) ) {
+			size_t size=strcspn( prefix,"," );
+			if( size && strncmp( ticket,prefix,size )==0 ) {
+				break;
+			}
+		}
+		if( *prefix=='\0' ) {
+			return( 0 );
+		}
+		ticket+=strcspn( prefix,"," );
+	}
+	for( ; cas->ticket_charset_set && *ticket; ticket++ ) {
+		unsigned char c=*ticket;
+		if( !( cas->ticket_charset[c>>3]&( 1<<( c&7 ) ) ) ) {
+			return( 0 );
+		}
+	}
+	return( 1 );
+}
+
+/*******************************************************************************
+ * cas_reject: Answer a validation of ticket, at url, without the CAS server
+ *  if it cannot succeed.  Returns CAS_VALIDATION_SUCCESS if it is to go to
+ *  the CAS server, otherwise its result, left on cas.
+ */
+CAS_CODE
+cas_reject( CAS* cas, CAS_PROTOCOL protocol, const char* url, const char* ticket ) {
+	const char* message=NULL;
+	CAS_CODE code=CAS_VALIDATION_SUCCESS;
+
+	cas->reject_key=0;
+	if( cas->ticket_syntax && !cas_ticket_wellformed( cas,ticket ) ) {
+		cas->stats.rejected_malformed++;
+		code=( protocol==CAS_PROTOCOL_CAS1 ? CAS1_VALIDATION_NO : CAS2_INVALID_TICKET );
+		message="Malformed ticket, not sent to the CAS server";
+	} else if( cas_rejects ) {
+		unsigned long long key=cas_reject_key( url );
+		if( (code=cas_reject_lookup( key ))!=CAS_VALIDATION_SUCCESS ) {
+			cas->stats.rejected_cached++;
+			message="Ticket rejected recently, not sent to the CAS server";
+		} else {
+			cas->reject_key=key;
+		}
+	}
+
+	if( code!=CAS_VALIDATION_SUCCESS ) {
+		cas_debug("Rejecting %s: %s",ticket,message);
+		cas_result_clear( cas );
+		cas_attributes_clear( &cas->attributes );
+		cas->protocol=protocol;
+		cas->code=code;
+		cas_result_set( &cas->message_buffer,&cas->message,message,strlen( message ) );
+	}
+	return( code );
+}
+
+/*******************************************************************************
+ * cas_reject_learn: Remember the result of the validation just completed on
+ *  cas, if the CAS server rejected its ticket
+ */
+void
+cas_reject_learn( CAS* cas ) {
+	if( cas->reject_key && cas_rejects && ( cas->code==CAS2_INVALID_TICKET || cas->code==CAS1_VALIDATION_NO ) ) {
+		cas_reject_insert( cas->reject_key,cas->code );
+	}
+	cas->reject_key=0;
+}
@@ -0,0 +1,417 @@
+/*******************************************************************************
+ * cassessions.c
+ *
+ * Session cache shared by the processes of a host
+ *
+ * A CAS_SESSIONS maps session IDs to the principal they were validated for,
+ * until an expiry, in one fixed-size table in shared memory: an anonymous
+ * mapping inherited by the workers a parent forks after creating it, or a
+ * file mapping any process can attach to.  Nothing in the table is a
+ * pointer, so it means the same at any address.
+ *
+ * The table is set-associative: a session ID hashes to a bucket of
+ * CAS_SESSIONS_WAYS entries, and a full bucket evicts by CLOCK, the entry
+ * its hand finds first that has not been used since the hand last passed.
+ * Buckets are guarded by CAS_SESSIONS_STRIPES process-shared mutexes, bucket
+ * b by stripe b%CAS_SESSIONS_STRIPES.  The mutexes are robust: if a worker
+ * dies holding one, the next process to take it empties the buckets of the
+ * stripe, whose entries may be half written, and carries on.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cas.h"
+#include "cas-int.h"
+
+#define CAS_SESSIONS_MAGIC 0x43415353	// - "CASS"
+#define CAS_SESSIONS_VERSION 1
+#define CAS_SESSIONS_WAYS 8
+#define CAS_SESSIONS_STRIPES 64
+
+typedef struct {
+	unsigned int hash;				// - 0 for an empty entry
+	unsigned int referenced;		// - used since the clock hand last passed it
+	time_t expires;
+	char session_id[CAS_SESSION_ID_MAX];
+	char principal[CAS_SESSION_PRINCIPAL_MAX];
+} CAS_SESSION_ENTRY;
+
+typedef struct {
+	unsigned int hand;				// - next way the clock looks at
+	CAS_SESSION_ENTRY ways[CAS_SESSIONS_WAYS];
+} CAS_SESSION_BUCKET;
+
+typedef struct {
+	pthread_mutex_t lock;			// - guards the buckets of the stripe, and the counters below
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+} CAS_SESSION_STRIPE;
+
+typedef struct {
+	unsigned int magic;				// - set last, once the table is ready
+	unsigned int version;
+	size_t size;					// - of the whole mapping
+	size_t buckets;
+	CAS_SESSION_STRIPE stripes[CAS_SESSIONS_STRIPES];
+	CAS_SESSION_BUCKET bucket[];
+} CAS_SESSION_TABLE;
+
+struct CAS_SESSIONS {
+	CAS_SESSION_TABLE* table;
+	size_t size;
+};
+
+/*******************************************************************************
+ * cas_sessions_format: Set up an empty table of the given number of buckets
+ *  in fresh, zeroed, shared memory
+ */
+static int
+cas_sessions_format( CAS_SESSION_TABLE* table, size_t size, size_t buckets ) {
+	pthread_mutexattr_t attr;
+	int i;
+
+	if( pthread_mutexattr_init( &attr )!=0 ) {
+		return( -1 );
+	}
+	pthread_mutexattr_setpshared( &attr,PTHREAD_PROCESS_SHARED );
+	pthread_mutexattr_setrobust( &attr,PTHREAD_MUTEX_ROBUST );
+	for( i=0; i<CAS_SESSIONS_STRIPES; i++ ) {
+		if( pthread_mutex_init( &table->stripes[i].lock,&attr )!=0 ) {
+			pthread_mutexattr_destroy( &attr );
+			return( -1 );
+		}
+	}
+	pthread_mutexattr_destroy( &attr );
+
+	table->version=CAS_SESSIONS_VERSION;
+	table->size=size;
+	table->buckets=buckets;
+	__atomic_store_n( &table->magic,CAS_SESSIONS_MAGIC,__ATOMIC_RELEASE );
+	return( 0 );
+}
+
+/*******************************************************************************
+ * cas_sessions_attach: Map the table of the file open on fd, formatting it
+ *  first if the file is new.  Processes attaching at once are serialized by
+ *  a lock on the file.
+ */
+static CAS_SESSION_TABLE*
+cas_sessions_attach( int fd, size_t size, size_t buckets ) {
+	CAS_SESSION_TABLE* table=MAP_FAILED;
+	struct stat st;
+
+	if( flock( fd,LOCK_EX )!=0 ) {
+		return( NULL );
+	}
+	if( fstat( fd,&st )==0 ) {
+		if( st.st_size==0 ) {
+			//New file: the table is formatted at the size asked for
+			if( ftruncate( fd,size )==0
+			 && (table=mmap( NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0 ))!=MAP_FAILED
+			 && cas_sessions_format( table,size,buckets )!=0 ) {
+				munmap( table,size );
+				table=MAP_FAILED;
+			}
+			if( table==MAP_FAILED && ftruncate( fd,0 )!=0 ) {
+				cas_debug("Could not truncate the session cache file back");
+			}
+		} else if( ( size_t )st.st_size>=sizeof( CAS_SESSION_TABLE ) ) {
+			//Existing file: the table keeps its own size
+			size=st.st_size;
+			if((table=mmap( NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0 ))!=MAP_FAILED
+			 && ( table->magic!=CAS_SESSIONS_MAGIC || table->version!=CAS_SESSIONS_VERSION || table->size!=size
+			   || table->size<sizeof( CAS_SESSION_TABLE )+table->buckets*sizeof( CAS_SESSION_BUCKET ) ) ) {
+				cas_debug("Not a session cache of this version of libcas");
+				munmap( table,size );
+				table=MAP_FAILED;
+			}
+		}
+	}
+	flock( fd,LOCK_UN );
+
+	return( table==MAP_FAILED ? NULL : table );
+}
+
+/*******************************************************************************
+ * cas_sessions_new: create a session cache, or attach to the one in a file
+ */
+CAS_SESSIONS*
+cas_sessions_new( const char* path, size_t capacity ) {
+	CAS_SESSIONS* sessions=NULL;
+	size_t buckets=( capacity+CAS_SESSIONS_WAYS-1 )/CAS_SESSIONS_WAYS;
+	size_t size;
+	int fd;
+
+	if( buckets==0 ) {
+		buckets=1;
+	}
+	size=sizeof( CAS_SESSION_TABLE )+buckets*sizeof( CAS_SESSION_BUCKET );
+
+	if((sessions=cas_calloc( 1,sizeof( CAS_SESSIONS ) ))==NULL) {
+		return( NULL );
+	}
+	if( path==NULL ) {
+		//Anonymous shared memory is zeroed, and shared with children forked later
+		sessions->table=mmap( NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0 );
+		if( sessions->table==MAP_FAILED ) {
+			sessions->table=NULL;
+		} else if( cas_sessions_format( sessions->table,size,buckets )!=0 ) {
+			munmap( sessions->table,size );
+			sessions->table=NULL;
+		}
+	} else if((fd=open( path,O_RDWR|O_CREAT|O_CLOEXEC,0600 ))>=0) {
+		sessions->table=cas_sessions_attach( fd,size,buckets );
+		close( fd );
+	}
+
+	if( sessions->table==NULL ) {
+		cas_free( sessions );
+		return( NULL );
+	}
+	sessions->size=sessions->table->size;
+	return( sessions );
+}
+
+/*******************************************************************************
+ * cas_sessions_zap: detach from a session cache, which lives on in other
+ *  processes attached to it, and in its file if it has one
+ */
+void
+cas_sessions_zap( CAS_SESSIONS* sessions ) {
+	if( sessions ) {
+		if( sessions->table ) munmap( sessions->table,sessions->size );
+		cas_free( sessions );
+	}
+}
+
+/*******************************************************************************
+ * cas_sessions_lock: Take the lock of a stripe, emptying its buckets if the
+ *  process that held it died with it
+ */
+static CAS_SESSION_STRIPE*
+cas_sessions_lock( CAS_SESSION_TABLE* table, size_t stripe_index ) {
+	CAS_SESSION_STRIPE* stripe=&table->stripes[stripe_index];
+	size_t b;
+
+	if( pthread_mutex_lock( &stripe->lock )==EOWNERDEAD ) {
+		cas_debug("Emptying session stripe %lu, abandoned by a dead process",( unsigned long )stripe_index);
+		for( b=stripe_index; b<table->buckets; b+=CAS_SESSIONS_STRIPES ) {
+			memset( &table->bucket[b],0,sizeof( CAS_SESSION_BUCKET ) );
+		}
+		pthread_mutex_consistent( &stripe->lock );
+	}
+	return( stripe );
+}
+
+/*******************************************************************************
+ * cas_sessions_find: The entry of a session ID in its bucket, or NULL
+ */
+static CAS_SESSION_ENTRY*
+cas_sessions_find( CAS_SESSION_BUCKET* bucket, unsigned int hash, const char* session_id ) {
+	int i;
+
+	for( i=0; i<CAS_SESSIONS_WAYS; i++ ) {
+		CAS_SESSION_ENTRY* entry=&bucket->ways[i];
+		if( entry->hash==hash && strcmp( entry->session_id,session_id )==0 ) {
+			return( entry );
+		}
+	}
+	return( NULL );
+}
+
+/*******************************************************************************
+ * cas_sessions_victim: The entry of a bucket to store a new session in: an
+ *  empty or expired one, or else the one the clock evicts
+ */
+static CAS_SESSION_ENTRY*
+cas_sessions_victim( CAS_SESSION_BUCKET* bucket, CAS_SESSION_STRIPE* stripe, time_t now ) {
+	CAS_SESSION_ENTRY* entry;
+	int i;
+
+	for( i=0; i<CAS_SESSIONS_WAYS; i++ ) {
+		entry=&bucket->ways[i];
+		if( entry->hash==0 || entry->expires<=now ) {
+			return( entry );
+		}
+	}
+	//Second chance: at most one full turn clears every referenced flag
+	for( ;; ) {
+		entry=&bucket->ways[bucket->hand];
+		bucket->hand=( bucket->hand+1 )%CAS_SESSIONS_WAYS;
+		if( !entry->referenced ) {
+			stripe->evictions++;
+			return( entry );
+		}
+		entry->referenced=0;
+	}
+}
+
+/*******************************************************************************
+ * cas_sessions_slot: Hash a session ID, and find its bucket and stripe.
+ *  Returns the length of the ID, or 0 if it is not a valid ID.
+ */
+static size_t
+cas_sessions_slot( CAS_SESSION_TABLE* table, const char* session_id, unsigned int* hash, size_t* bucket ) {
+	size_t size=strlen( session_id );
+
+	if( size==0 || size>=CAS_SESSION_ID_MAX ) {
+		return( 0 );
+	}
+	*hash=cas_hash( session_id,size );
+	*bucket=*hash%table->buckets;
+	//0 marks an empty entry
+	*hash|=1u;
+	return( size );
+}
+
+/*******************************************************************************
+ * cas_sessions_put: store the principal of a session until it expires
+ */
+CAS_CODE
+cas_sessions_put( CAS_SESSIONS* sessions, const char* session_id, const char* principal, long ttl_seconds ) {
+	CAS_SESSION_TABLE* table;
+	CAS_SESSION_STRIPE* stripe;
+	CAS_SESSION_BUCKET* bucket;
+	CAS_SESSION_ENTRY* entry;
+	unsigned int hash;
+	size_t b;
+	size_t id_size;
+	size_t principal_size;
+
+	if(!sessions || !session_id || !principal || ttl_seconds<=0) {
+		return(CAS_INVALID_PARAMETERS);
+	}
+	table=sessions->table;
+	principal_size=strlen( principal );
+	if((id_size=cas_sessions_slot( table,session_id,&hash,&b ))==0 || principal_size>=CAS_SESSION_PRINCIPAL_MAX) {
+		return(CAS_INVALID_PARAMETERS);
+	}
+
+	time_t now=time( NULL );
+	bucket=&table->bucket[b];
+	stripe=cas_sessions_lock( table,b%CAS_SESSIONS_STRIPES );
+	if((entry=cas_sessions_find( bucket,hash,session_id ))==NULL) {
+		entry=cas_sessions_victim( bucket,stripe,now );
+		entry->hash=hash;
+		memcpy( entry->session_id,session_id,id_size+1 );
+	}
+	memcpy( entry->principal,principal,principal_size+1 );
+	entry->expires=now+ttl_seconds;
+	entry->referenced=1;
+	pthread_mutex_unlock( &stripe->lock );
+
+	return( CAS_VALIDATION_SUCCESS );
+}
+
+/*******************************************************************************
+ * cas_sessions_get: copy out the principal of a live session
+ */
+CAS_CODE
+cas_sessions_get( CAS_SESSIONS* sessions, const char* session_id, char* principal, size_t size ) {
+	CAS_SESSION_TABLE* table;
+	CAS_SESSION_STRIPE* stripe;
+	CAS_SESSION_ENTRY* entry;
+	CAS_CODE rc=CAS_SESSION_UNKNOWN;
+	unsigned int hash;
+	size_t b;
+
+	if(!sessions || !session_id || !principal || size==0) {
+		return(CAS_INVALID_PARAMETERS);
+	}
+	table=sessions->table;
+	if(cas_sessions_slot( table,session_id,&hash,&b )==0) {
+		return(CAS_INVALID_PARAMETERS);
+	}
+
+	time_t now=time( NULL );
+	stripe=cas_sessions_lock( table,b%CAS_SESSIONS_STRIPES );
+	if((entry=cas_sessions_find( &table->bucket[b],hash,session_id ))) {
+		if( entry->expires<=now ) {
+			entry->hash=0;
+		} else if( strlen( entry->principal )>=size ) {
+			rc=CAS_INVALID_PARAMETERS;
+		} else {
+			strcpy( principal,entry->principal );
+			entry->referenced=1;
+			rc=CAS_VALIDATION_SUCCESS;
+		}
+	}
+	if( rc==CAS_VALIDATION_SUCCESS ) {
+		stripe->hits++;
+	} else if( rc==CAS_SESSION_UNKNOWN ) {
+		stripe->misses++;
+	}
+	pthread_mutex_unlock( &stripe->lock );
+
+	return( rc );
+}
+
+/*******************************************************************************
+ * cas_sessions_remove: forget a session, on logout
+ */
+void
+cas_sessions_remove( CAS_SESSIONS* sessions, const char* session_id ) {
+	CAS_SESSION_TABLE* table;
+	CAS_SESSION_STRIPE* stripe;
+	CAS_SESSION_ENTRY* entry;
+	unsigned int hash;
+	size_t b;
+
+	if(!sessions || !session_id || cas_sessions_slot( sessions->table,session_id,&hash,&b )==0) {
+		return;
+	}
+	table=sessions->table;
+	stripe=cas_sessions_lock( table,b%CAS_SESSIONS_STRIPES );
+	if((entry=cas_sessions_find( &table->bucket[b],hash,session_id ))) {
+		entry->hash=0;
+	}
+	pthread_mutex_unlock( &stripe->lock );
+}
+
+/*******************************************************************************
+ * cas_sessions_get_stats: sum up a session cache, stripe by stripe
+ */
+CAS_CODE
+cas_sessions_get_stats( CAS_SESSIONS* sessions, CAS_SESSIONS_STATS* stats ) {
+	CAS_SESSION_TABLE* table;
+	size_t s;
+	size_t b;
+	int i;
+
+	if(!sessions || !stats) {
+		return(CAS_INVALID_PARAMETERS);
+	}
+	table=sessions->table;
+	memset( stats,0,sizeof( CAS_SESSIONS_STATS ) );
+	stats->capacity=table->buckets*CAS_SESSIONS_WAYS;
+
+	time_t now=time( NULL );
+	for( s=0; s<CAS_SESSIONS_STRIPES; s++ ) {
+		CAS_SESSION_STRIPE* stripe=cas_sessions_lock( table,s );
+		for( b=s; b<table->buckets; b+=CAS_SESSIONS_STRIPES ) {
+			for( i=0; i<CAS_SESSIONS_WAYS; i++ ) {
+				CAS_SESSION_ENTRY* entry=&table->bucket[b].ways[i];
+				if( entry->hash && entry->expires>now ) stats->sessions++;
+			}
+		}
+		stats->hits+=stripe->hits;
+		stats->misses+=stripe->misses;
+		stats->evictions+=stripe->evictions;
+		pthread_mutex_unlock( &stripe->lock );
+	}
+	return( CAS_VALIDATION_SUCCESS );
+}
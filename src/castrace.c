@@ -0,0 +1,233 @@
+/*******************************************************************************
+ * castrace.c
+ *
+ * Runtime tracing
+ *
+ * cas_debug() records an event (SAX state transitions, transfers, curl's
+ * connection messages, result codes) into a ring of the calling thread once
+ * cas_set_tracing() has turned tracing on, and costs one load and a branch
+ * while it is off.  A ring belongs to one thread at a time: only that thread
+ * writes it, so recording takes no lock, and a thread that exits hands its
+ * ring on to the next thread to trace.  Rings are found through a list they
+ * are pushed onto, lock-free, and never leave.
+ *
+ * cas_trace_drain() reads the rings while they are being written, one
+ * drainer at a time.  Each slot carries the sequence number of the event in
+ * it, cleared while the event is written, so that an event overwritten while
+ * it is copied is dropped rather than reported torn.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cas.h"
+#include "cas-int.h"
+
+typedef struct {
+	unsigned long sequence;			// - of the event in the slot, 0 while it is written
+	CAS_TRACE_EVENT event;
+} CAS_TRACE_SLOT;
+
+typedef struct CAS_TRACE_RING {
+	struct CAS_TRACE_RING* next;	// - next ring of cas_trace_rings
+	int in_use;						// - owned by a live thread
+	unsigned int thread;
+	unsigned long head;				// - events written
+	unsigned long drained;			// - events drained, or lost to the writer
+	size_t mask;					// - slots-1, slots a power of 2
+	CAS_TRACE_SLOT slots[];
+} CAS_TRACE_RING;
+
+int cas_tracing=0;
+
+static size_t cas_trace_size=CAS_DEFAULT_TRACE_EVENTS;
+static CAS_TRACE_RING* cas_trace_rings=NULL;
+static unsigned int cas_trace_threads=0;
+static __thread CAS_TRACE_RING* cas_trace_ring=NULL;
+static pthread_key_t cas_trace_key;
+static pthread_once_t cas_trace_once=PTHREAD_ONCE_INIT;
+static pthread_mutex_t cas_trace_drain_lock=PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************************
+ * cas_set_tracing: Enable tracing, with rings of at least events each, or
+ *  disable it with 0
+ */
+void
+cas_set_tracing( size_t events ) {
+	if( events ) {
+		size_t size=2;
+		while( size<events && size<( (size_t)1<<20 ) ) size<<=1;
+		cas_trace_size=size;
+	}
+	__atomic_store_n( &cas_tracing,( events ? 1 : 0 ),__ATOMIC_RELAXED );
+}
+
+/*******************************************************************************
+ * cas_trace_release: Hand the ring of an exiting thread on
+ */
+static void
+cas_trace_release( void* ring ) {
+	__atomic_store_n( &( ( CAS_TRACE_RING* )ring )->in_use,0,__ATOMIC_RELEASE );
+}
+
+/*******************************************************************************
+ * cas_trace_key_create: Create the key releasing rings at thread exit
+ */
+static void
+cas_trace_key_create() {
+	pthread_key_create( &cas_trace_key,cas_trace_release );
+}
+
+/*******************************************************************************
+ * cas_trace_claim: The ring of the calling thread: one left by an exited
+ *  thread, or a new one.  NULL if there is no memory for one.
+ */
+static CAS_TRACE_RING*
+cas_trace_claim() {
+	CAS_TRACE_RING* ring;
+	int unused=0;
+
+	pthread_once( &cas_trace_once,cas_trace_key_create );
+	for( ring=__atomic_load_n( &cas_trace_rings,__ATOMIC_ACQUIRE ); ring; ring=ring->next ) {
+		if( ring->mask+1>=cas_trace_size && __atomic_compare_exchange_n( &ring->in_use,&unused,1,0,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED ) ) {
+			break;
+		}
+		unused=0;
+	}
+
+	if( ring==NULL ) {
+		if((ring=cas_calloc( 1,sizeof( CAS_TRACE_RING )+cas_trace_size*sizeof( CAS_TRACE_SLOT ) ))==NULL) {
+			return( NULL );
+		}
+		ring->in_use=1;
+		ring->mask=cas_trace_size-1;
+		ring->thread=__atomic_add_fetch( &cas_trace_threads,1,__ATOMIC_RELAXED );
+		ring->next=__atomic_load_n( &cas_trace_rings,__ATOMIC_RELAXED );
+		while( !__atomic_compare_exchange_n( &cas_trace_rings,&ring->next,ring,0,__ATOMIC_RELEASE,__ATOMIC_RELAXED ) );
+	}
+
+	pthread_setspecific( cas_trace_key,ring );
+	return( cas_trace_ring=ring );
+}
+
+/*******************************************************************************
+ * cas_trace: Record an event in the ring of the calling thread
+ */
+void
+cas_trace( const char* function, int line, const char* format, ... ) {
+	CAS_TRACE_RING* ring=cas_trace_ring;
+	CAS_TRACE_SLOT* slot;
+	unsigned long head;
+	va_list args;
+
+	if( ring==NULL && (ring=cas_trace_claim())==NULL ) {
+		return;
+	}
+
+	head=ring->head;
+	slot=&ring->slots[head&ring->mask];
+	__atomic_store_n( &slot->sequence,0,__ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+
+	slot->event.sequence=head+1;
+	slot->event.time_us=cas_clock_us();
+	slot->event.thread=ring->thread;
+	slot->event.function=function;
+	slot->event.line=line;
+	va_start( args,format );
+	vsnprintf( slot->event.message,sizeof( slot->event.message ),format,args );
+	va_end( args );
+
+	__atomic_store_n( &slot->sequence,head+1,__ATOMIC_RELEASE );
+	__atomic_store_n( &ring->head,head+1,__ATOMIC_RELEASE );
+}
+
+/*******************************************************************************
+ * cas_trace_curl: CURLOPT_DEBUGFUNCTION, recording curl's own messages
+ */
+int
+cas_trace_curl( CURL* curl, curl_infotype type, char* data, size_t size, void* userp ) {
+	if( type==CURLINFO_TEXT ) {
+		while( size && ( data[size-1]=='\n' || data[size-1]=='\r' ) ) size--;
+		cas_debug("curl: %.*s",(int)size,data);
+	}
+	return( 0 );
+}
+
+/*******************************************************************************
+ * cas_trace_drain: Pass every event recorded since the last drain to callback,
+ *  thread by thread, returning how many were passed
+ */
+size_t
+cas_trace_drain( cas_trace_callback callback, void* userp ) {
+	CAS_TRACE_RING* ring;
+	CAS_TRACE_EVENT event;
+	size_t drained=0;
+
+	if(!callback) {
+		return( 0 );
+	}
+
+	pthread_mutex_lock( &cas_trace_drain_lock );
+	for( ring=__atomic_load_n( &cas_trace_rings,__ATOMIC_ACQUIRE ); ring; ring=ring->next ) {
+		unsigned long head=__atomic_load_n( &ring->head,__ATOMIC_ACQUIRE );
+
+		//Whatever the writer lapped is lost
+		if( head-ring->drained>ring->mask+1 ) {
+			ring->drained=head-( ring->mask+1 );
+		}
+		for( ; ring->drained<head; ring->drained++ ) {
+			CAS_TRACE_SLOT* slot=&ring->slots[ring->drained&ring->mask];
+			unsigned long sequence=__atomic_load_n( &slot->sequence,__ATOMIC_ACQUIRE );
+			if( sequence!=ring->drained+1 ) {
+				continue;
+			}
+			memcpy( &event,&slot->event,sizeof( CAS_TRACE_EVENT ) );
+			__atomic_thread_fence( __ATOMIC_ACQUIRE );
+			if( __atomic_load_n( &slot->sequence,__ATOMIC_RELAXED )!=sequence ) {
+				continue;
+			}
+			event.message[sizeof( event.message )-1]='\0';
+			callback( &event,userp );
+			drained++;
+		}
+	}
+	pthread_mutex_unlock( &cas_trace_drain_lock );
+
+	return( drained );
+}
+
+/*******************************************************************************
+ * cas_trace_write: cas_trace_callback writing an event as a line to the file
+ *  descriptor at userp
+ */
+static void
+cas_trace_write( const CAS_TRACE_EVENT* event, void* userp ) {
+	char line[CAS_TRACE_MESSAGE_MAX+128];
+	int size;
+
+	size=snprintf( line,sizeof( line ),"%.0f %u %lu %s:%d %s\n",event->time_us,event->thread,event->sequence,event->function,event->line,event->message );
+	if( size>=( int )sizeof( line ) ) {
+		size=sizeof( line )-1;
+		line[size-1]='\n';
+	}
+	if( size>0 && write( *( int* )userp,line,size )<0 ) {
+		//Nothing to be done about a trace that cannot be written
+	}
+}
+
+/*******************************************************************************
+ * cas_trace_dump: Drain the trace to fd, one line per event
+ */
+size_t
+cas_trace_dump( int fd ) {
+	return( cas_trace_drain( cas_trace_write,&fd ) );
+}
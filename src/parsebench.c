@@ -0,0 +1,107 @@
+/*******************************************************************************
+ * parsebench.c
+ *
+ * Microbenchmark of response parsing, CAS2 fast path against libxml2 and the
+ * CAS3 JSON tokenizer, run by "make bench".  No network is involved: canonical
+ * success and failure documents are parsed straight from memory on one handle.
+ * Allocations are counted along, as a warm handle should need none.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cas.h"
+#include "cas-int.h"
+
+static const char* success=
+"<cas:serviceResponse xmlns:cas='http://www.yale.edu/tp/cas'>\n"
+"    <cas:authenticationSuccess>\n"
+"        <cas:user>myprinc</cas:user>\n"
+"    </cas:authenticationSuccess>\n"
+"</cas:serviceResponse>\n";
+
+static const char* failure=
+"<cas:serviceResponse xmlns:cas='http://www.yale.edu/tp/cas'>\n"
+"    <cas:authenticationFailure code=\"INVALID_TICKET\">\n"
+"        Ticket ST-1856339-aA5Yuvrxzpv8Tau1cYQ7 not recognized\n"
+"    </cas:authenticationFailure>\n"
+"</cas:serviceResponse>\n";
+
+static const char* json_success=
+"{\"serviceResponse\":{\"authenticationSuccess\":{\"user\":\"myprinc\"}}}";
+
+static const char* json_failure=
+"{\"serviceResponse\":{\"authenticationFailure\":{\"code\":\"INVALID_TICKET\",\"description\":\"Ticket ST-1856339-aA5Yuvrxzpv8Tau1cYQ7 not recognized\"}}}";
+
+typedef CAS_CODE (*parse_function)( CAS* cas, const char* body, size_t size );
+
+static CAS_CODE
+cas3_parse( CAS* cas, const char* body, size_t size ) {
+	cas_cas3_reset( cas );
+	cas_cas3_json( cas,body,size );
+	return( cas->code=cas_cas3_result( cas ) );
+}
+
+static double
+now() {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC,&ts );
+	return( ts.tv_sec*1e9+ts.tv_nsec );
+}
+
+static void
+bench( const char* path, const char* response, CAS* cas, parse_function parse, const char* body, CAS_CODE expected, long iterations ) {
+	CAS_MEM_STATS before,after;
+	size_t size=strlen( body );
+	long i;
+
+	for( i=0; i<iterations/10; i++ ) { //-- Warm up
+		parse( cas,body,size );
+	}
+
+	cas_get_mem_thread( &before );
+	double start=now();
+	for( i=0; i<iterations; i++ ) {
+		if( parse( cas,body,size )!=expected ) {
+			fprintf( stderr,"Unexpected result %d\n",cas_get_code( cas ) );
+			exit( 1 );
+		}
+	}
+	double elapsed=now()-start;
+	cas_get_mem_thread( &after );
+
+	printf( "%-10s %-8s %12.0f %12.1f\n",path,response,elapsed/iterations,( double )( after.allocations-before.allocations )/iterations );
+}
+
+int
+main( int argc, char** argv ) {
+	long iterations=( argc>1 ? atol( argv[1] ) : 200000 );
+
+	cas_set_mem_counting( 1 );
+	cas_init();
+	CAS* cas=cas_new();
+
+	printf( "%-10s %-8s %12s %12s\n","path","response","ns/response","allocations" );
+
+	cas_set_cas2_fastpath( cas,1 );
+	bench( "fastpath","success",cas,cas_cas2_parse,success,CAS_VALIDATION_SUCCESS,iterations );
+	bench( "fastpath","failure",cas,cas_cas2_parse,failure,CAS2_INVALID_TICKET,iterations );
+
+	cas_set_cas2_fastpath( cas,0 );
+	bench( "libxml2","success",cas,cas_cas2_parse,success,CAS_VALIDATION_SUCCESS,iterations );
+	bench( "libxml2","failure",cas,cas_cas2_parse,failure,CAS2_INVALID_TICKET,iterations );
+
+	bench( "json","success",cas,cas3_parse,json_success,CAS_VALIDATION_SUCCESS,iterations );
+	bench( "json","failure",cas,cas3_parse,json_failure,CAS2_INVALID_TICKET,iterations );
+
+	cas_zap( cas );
+	cas_destroy();
+
+	return( 0 );
+}